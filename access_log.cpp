@@ -0,0 +1,399 @@
+#include "access_log.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <chrono>
+#include <uv.h>
+#include "http_parser.h"
+#include "http_connection.h"
+#include "http_request.h"
+#include "clock_cache.h"
+#include "clock_source.h"
+#include "logger.h"
+#include "utils.h"
+
+/* batches are written out once they reach this size, or when the ring runs dry */
+const size_t access_log_batch_bytes = 64 * 1024;
+
+const int access_log_min_nap_ms = 1;
+const int access_log_max_nap_ms = 64;
+
+access_log_t *access_log_t::s_paccess_log = NULL;
+
+access_log_t::access_log_t(const std::string &path, const access_log_options_t &options)
+	: m_path(path), m_options(options), m_fd(-1), m_file_bytes(0), m_file_opened_ns(0),
+	m_ring(options.ring_records), m_dropped(0), m_stopping(false)
+{
+	if (!open_file())
+		log(log_error, "access_log_t : couldn't open %s (%s)\n", m_path.c_str(), strerror(errno));
+
+	if (s_paccess_log == NULL)
+		s_paccess_log = this;
+	else
+		log(log_warning, "access_log_t : multiple access logs are open\n");
+
+	m_writer = std::thread(&access_log_t::writer_main, this);
+}
+
+access_log_t::~access_log_t()
+{
+	if (s_paccess_log == this)
+		s_paccess_log = NULL;
+
+	m_stopping.store(true, std::memory_order_release);
+	m_wake.notify_one();
+	m_writer.join();
+
+	if (m_fd != -1)
+		close(m_fd);
+}
+
+access_log_record_t *access_log_t::claim()
+{
+	access_log_record_t *record = m_ring.claim();
+	if (record == nullptr)
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+	return record;
+}
+
+void access_log_t::publish()
+{
+	m_ring.publish();
+}
+
+bool access_log_t::open_file()
+{
+	m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (m_fd == -1)
+		return false;
+
+	struct stat st;
+	m_file_bytes = (fstat(m_fd, &st) == 0) ? st.st_size : 0;
+	m_file_opened_ns = clock_monotonic_ns();
+	return true;
+}
+
+void access_log_t::rotate(double now)
+{
+	std::stringstream ss;
+	ss << m_path << '.';
+	append_time(ss, now, false /*exact*/, false /*for_humans*/);
+
+	/* don't clobber an earlier rotation from the same second */
+	std::string rotated = ss.str();
+	for (int i = 1; access(rotated.c_str(), F_OK) == 0; ++i)
+	{
+		std::stringstream numbered;
+		numbered << ss.str() << '-' << i;
+		rotated = numbered.str();
+	}
+
+	close(m_fd);
+	m_fd = -1;
+	if (rename(m_path.c_str(), rotated.c_str()) != 0)
+		log(log_warning, "access_log_t : couldn't rotate %s (%s)\n", m_path.c_str(), strerror(errno));
+
+	if (!open_file())
+		log(log_error, "access_log_t : couldn't reopen %s (%s)\n", m_path.c_str(), strerror(errno));
+}
+
+static void access_log_append_escaped(std::string &batch, const char *text)
+{
+	/* Apache style, quotes and unprintables become \xHH */
+	static const char hex[] = "0123456789abcdef";
+	for (const unsigned char *pch = (const unsigned char *)text; *pch != '\0'; ++pch)
+	{
+		if (*pch == '"' || *pch == '\\' || *pch < 0x20 || *pch >= 0x7f)
+		{
+			char escaped[4] = { '\\', 'x', hex[*pch >> 4], hex[*pch & 0xf] };
+			batch.append(escaped, sizeof(escaped));
+		}
+		else
+		{
+			batch.push_back(*pch);
+		}
+	}
+}
+
+static void access_log_append_quoted(std::string &batch, const char *text)
+{
+	batch.push_back('"');
+	if (*text == '\0')
+		batch.push_back('-');
+	access_log_append_escaped(batch, text);
+	batch.push_back('"');
+}
+
+static void access_log_append_json(std::string &batch, const char *text)
+{
+	static const char hex[] = "0123456789abcdef";
+	batch.push_back('"');
+	for (const unsigned char *pch = (const unsigned char *)text; *pch != '\0'; ++pch)
+	{
+		if (*pch == '"' || *pch == '\\')
+		{
+			batch.push_back('\\');
+			batch.push_back(*pch);
+		}
+		else if (*pch < 0x20)
+		{
+			char escaped[6] = { '\\', 'u', '0', '0', hex[*pch >> 4], hex[*pch & 0xf] };
+			batch.append(escaped, sizeof(escaped));
+		}
+		else
+		{
+			batch.push_back(*pch);
+		}
+	}
+	batch.push_back('"');
+}
+
+static char *access_log_put_2(char *pch, int value)
+{
+	pch[0] = '0' + (value / 10) % 10;
+	pch[1] = '0' + value % 10;
+	return pch + 2;
+}
+
+static char *access_log_put_4(char *pch, int value)
+{
+	pch = access_log_put_2(pch, value / 100);
+	return access_log_put_2(pch, value % 100);
+}
+
+void access_log_stamp_t::render(double time)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+	time_t now = (time_t)time;
+	if (now == second)
+		return;
+	second = now;
+
+	tm tdata;
+	gmtime_r(&now, &tdata);
+
+	/* fixed width by hand, like the clock cache's stamps */
+	char *pch = clf;
+	*pch++ = '[';
+	pch = access_log_put_2(pch, tdata.tm_mday);
+	*pch++ = '/';
+	memcpy(pch, months + 3 * tdata.tm_mon, 3);
+	pch += 3;
+	*pch++ = '/';
+	pch = access_log_put_4(pch, tdata.tm_year + 1900);
+	*pch++ = ':';
+	pch = access_log_put_2(pch, tdata.tm_hour);
+	*pch++ = ':';
+	pch = access_log_put_2(pch, tdata.tm_min);
+	*pch++ = ':';
+	pch = access_log_put_2(pch, tdata.tm_sec);
+	memcpy(pch, " +0000]", 8);
+
+	pch = iso;
+	pch = access_log_put_4(pch, tdata.tm_year + 1900);
+	*pch++ = '-';
+	pch = access_log_put_2(pch, tdata.tm_mon + 1);
+	*pch++ = '-';
+	pch = access_log_put_2(pch, tdata.tm_mday);
+	*pch++ = 'T';
+	pch = access_log_put_2(pch, tdata.tm_hour);
+	*pch++ = ':';
+	pch = access_log_put_2(pch, tdata.tm_min);
+	*pch++ = ':';
+	pch = access_log_put_2(pch, tdata.tm_sec);
+	*pch = '\0';
+}
+
+void access_log_t::format_record(const access_log_record_t &record, std::string &batch)
+{
+	m_stamp.render(record.time);
+
+	const char *method = http_method_str((http_method)record.method);
+	char number[96];
+
+	if (m_options.format == access_log_json)
+	{
+		batch.append("{\"time\":\"");
+		batch.append(m_stamp.iso);
+		snprintf(number, sizeof(number), ".%03dZ\",\"peer\":", (int)((record.time - (time_t)record.time) * 1000));
+		batch.append(number);
+		access_log_append_json(batch, record.peer);
+		batch.append(",\"method\":\"");
+		batch.append(method);
+		batch.append("\",\"path\":");
+		access_log_append_json(batch, record.path);
+		snprintf(number, sizeof(number), ",\"status\":%u,\"bytes\":%llu,\"latency_us\":%u",
+				(unsigned)record.status, (unsigned long long)record.bytes, (unsigned)record.latency_us);
+		batch.append(number);
+		batch.append(",\"referer\":");
+		access_log_append_json(batch, record.referer);
+		batch.append(",\"user_agent\":");
+		access_log_append_json(batch, record.user_agent);
+		batch.append("}\n");
+		return;
+	}
+
+	batch.append(record.peer[0] != '\0' ? record.peer : "-");
+	batch.append(" - - ");
+	batch.append(m_stamp.clf, sizeof(m_stamp.clf) - 1);
+	batch.append(" \"");
+	batch.append(method);
+	batch.push_back(' ');
+	access_log_append_escaped(batch, record.path);
+	snprintf(number, sizeof(number), " HTTP/1.%u\" %u %llu", (unsigned)record.http_minor,
+			(unsigned)record.status, (unsigned long long)record.bytes);
+	batch.append(number);
+
+	if (m_options.format == access_log_combined)
+	{
+		batch.push_back(' ');
+		access_log_append_quoted(batch, record.referer);
+		batch.push_back(' ');
+		access_log_append_quoted(batch, record.user_agent);
+		snprintf(number, sizeof(number), " %u", (unsigned)record.latency_us);
+		batch.append(number);
+	}
+	batch.push_back('\n');
+}
+
+void access_log_t::write_batch(const std::string &batch)
+{
+	bool rotate_size = (m_options.rotate_bytes != 0)
+		&& (m_file_bytes + batch.size() > m_options.rotate_bytes) && (m_file_bytes != 0);
+	bool rotate_time = (m_options.rotate_seconds != 0)
+		&& (clock_monotonic_ns() - m_file_opened_ns >= m_options.rotate_seconds * 1000000000ull);
+	if (m_fd != -1 && (rotate_size || rotate_time))
+		rotate(get_current_time());
+
+	if (m_fd == -1)
+		return;
+
+	const char *pch = batch.c_str();
+	size_t left = batch.size();
+	while (left != 0)
+	{
+		ssize_t written = write(m_fd, pch, left);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			log(log_error, "access_log_t : write to %s failed (%s)\n", m_path.c_str(), strerror(errno));
+			return;
+		}
+		pch += written;
+		left -= written;
+		m_file_bytes += written;
+	}
+}
+
+void access_log_t::writer_main()
+{
+	std::string batch;
+	batch.reserve(access_log_batch_bytes * 2);
+	int nap_ms = access_log_min_nap_ms;
+	uint64_t dropped_reported = 0;
+
+	while (true)
+	{
+		bool stopping = m_stopping.load(std::memory_order_acquire);
+
+		size_t drained = 0;
+		const access_log_record_t *record;
+		while ((record = m_ring.front()) != nullptr)
+		{
+			format_record(*record, batch);
+			m_ring.release();
+			++drained;
+
+			if (batch.size() >= access_log_batch_bytes)
+			{
+				write_batch(batch);
+				batch.clear();
+			}
+		}
+
+		if (batch.size() != 0)
+		{
+			write_batch(batch);
+			batch.clear();
+		}
+
+		uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+		if (dropped != dropped_reported)
+		{
+			log(log_warning, "access_log_t : dropped %llu records, the ring was full\n",
+					(unsigned long long)(dropped - dropped_reported));
+			dropped_reported = dropped;
+		}
+
+		if (drained != 0)
+		{
+			nap_ms = access_log_min_nap_ms;
+			continue;
+		}
+
+		if (stopping)
+			break;
+
+		/* time based rotation shouldn't wait for traffic */
+		if (m_options.rotate_seconds != 0 && m_fd != -1 && m_file_bytes != 0
+				&& clock_monotonic_ns() - m_file_opened_ns >= m_options.rotate_seconds * 1000000000ull)
+		{
+			rotate(get_current_time());
+		}
+
+		std::unique_lock<std::mutex> lock(m_wake_lock);
+		m_wake.wait_for(lock, std::chrono::milliseconds(nap_ms));
+		nap_ms = std::min(nap_ms * 2, access_log_max_nap_ms);
+	}
+}
+
+static void access_log_copy(char *dest, size_t size, const char *src, size_t length)
+{
+	if (length >= size)
+		length = size - 1;
+	memcpy(dest, src, length);
+	dest[length] = '\0';
+}
+
+void access_log_request(http_connection_t *connection, const http_request_t &request, int status, uint64_t bytes)
+{
+	access_log_t *access_log = access_log_t::s_paccess_log;
+	if (access_log == NULL)
+		return;
+
+	access_log_record_t *record = access_log->claim();
+	if (record == nullptr)
+		return;
+
+	record->time = clock_cache_now();
+	uint64_t latency = (clock_fast_ns() - request.start_time) / 1000;
+	record->latency_us = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+	record->status = status;
+	record->method = request.method;
+	record->http_minor = request.http_minor;
+	record->bytes = bytes;
+
+	const std::string &peer = connection->peer_name();
+	access_log_copy(record->peer, sizeof(record->peer), peer.c_str(), peer.size());
+	access_log_copy(record->path, sizeof(record->path), request.uri().c_str(), request.uri().size());
+
+	record->referer[0] = '\0';
+	record->user_agent[0] = '\0';
+	for (auto &field : request.fields)
+	{
+		if (strcasecmp(field.key.c_str(), "Referer") == 0)
+			access_log_copy(record->referer, sizeof(record->referer), field.value.c_str(), field.value.size());
+		else if (strcasecmp(field.key.c_str(), "User-Agent") == 0)
+			access_log_copy(record->user_agent, sizeof(record->user_agent), field.value.c_str(), field.value.size());
+	}
+
+	access_log->publish();
+}
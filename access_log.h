@@ -0,0 +1,112 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "nocopy.h"
+#include "spsc_ring.h"
+
+enum access_log_format_t
+{
+	/* NCSA common log format */
+	access_log_common,
+	/* common plus referer, user agent and latency in microseconds */
+	access_log_combined,
+	/* one JSON object per line */
+	access_log_json,
+};
+
+struct access_log_options_t
+{
+	access_log_format_t format = access_log_combined;
+
+	/* rotate once the file reaches this many bytes, 0 to never */
+	uint64_t rotate_bytes = 256 * 1024 * 1024;
+
+	/* rotate files older than this many seconds, 0 to never */
+	int rotate_seconds = 0;
+
+	size_t ring_records = 4096;
+};
+
+/* one request, laid out flat so the loop thread can fill it in place.
+ * strings are truncated to fit. */
+struct access_log_record_t
+{
+	double time;
+	uint32_t latency_us;
+	uint16_t status;
+	uint8_t method;
+	uint8_t http_minor;
+	uint64_t bytes;
+	char peer[48];
+	char path[256];
+	char referer[128];
+	char user_agent[128];
+};
+
+/* "[10/Oct/2000:13:55:36 +0000]" for common/combined, "2000-10-10T13:55:36"
+ * for JSON. records arrive in time order, so re-rendering once a second is
+ * enough. */
+struct access_log_stamp_t
+{
+	time_t second = -1;
+	char clf[29];
+	char iso[20];
+
+	void render(double time);
+};
+
+/* writes an access log from its own thread. records are handed over through
+ * a lock-free ring by the thread that runs the loop (only that thread may
+ * produce), formatted in batches, and appended with plain write(2) calls.
+ * rotation renames the file to path.YYYYMMDDTHHMMSS, also on the writer. */
+class access_log_t
+{
+public:
+	NOCOPY(access_log_t);
+	access_log_t(const std::string &path, const access_log_options_t &options = access_log_options_t());
+	~access_log_t();
+
+	/* nullptr when the ring is full, the record is counted as dropped */
+	access_log_record_t *claim();
+	void publish();
+
+	uint64_t dropped_records() const { return m_dropped.load(std::memory_order_relaxed); }
+
+	/* the access log the http server reports to, if any */
+	static access_log_t *s_paccess_log;
+
+private:
+	bool open_file();
+	void rotate(double now);
+	void format_record(const access_log_record_t &record, std::string &batch);
+	void write_batch(const std::string &batch);
+	void writer_main();
+
+	std::string m_path;
+	access_log_options_t m_options;
+	int m_fd;
+	uint64_t m_file_bytes;
+	/* clock_monotonic_ns, so stepping the clock can't bring on a rotation */
+	uint64_t m_file_opened_ns;
+	/* only touched by the writer */
+	access_log_stamp_t m_stamp;
+
+	spsc_ring_t<access_log_record_t> m_ring;
+	std::atomic<uint64_t> m_dropped;
+	std::atomic<bool> m_stopping;
+	std::thread m_writer;
+
+	std::mutex m_wake_lock;
+	std::condition_variable m_wake;
+};
+
+/* convenience for the http server: fills and publishes a record for request
+ * if an access log is open */
+struct http_connection_t;
+struct http_request_t;
+void access_log_request(http_connection_t *connection, const http_request_t &request, int status, uint64_t bytes);
@@ -0,0 +1,561 @@
+#include "async_fs.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include "nocopy.h"
+#include "logger_decls.h"
+#include "uring.h"
+#include "loop_monitor.h"
+#ifdef HAVE_IO_URING
+#include <sys/sysmacros.h>
+#endif
+
+/* files with no useful size (procfs and friends) are read in chunks */
+const size_t async_fs_read_chunk = 64 * 1024;
+
+static uv_loop_t *async_fs_loop = nullptr;
+static uring_t *async_fs_ring = nullptr;
+
+async_fs_backend_t async_fs_init(uv_loop_t *loop, async_fs_backend_t backend)
+{
+	/* only call this while nothing is outstanding */
+	if (async_fs_ring != nullptr && (backend != async_fs_uring || loop != async_fs_loop))
+	{
+		delete async_fs_ring;
+		async_fs_ring = nullptr;
+	}
+
+	async_fs_loop = loop;
+	if (backend == async_fs_uring && async_fs_ring == nullptr)
+	{
+		async_fs_ring = uring_t::create(loop);
+		if (async_fs_ring == nullptr)
+			dlog(log_info, "async_fs : no io_uring here, using the threadpool\n");
+	}
+	return (async_fs_ring != nullptr) ? async_fs_uring : async_fs_threadpool;
+}
+
+static uv_loop_t *async_fs_get_loop()
+{
+	return (async_fs_loop != nullptr) ? async_fs_loop : uv_default_loop();
+}
+
+/* one operation in progress, whichever backend runs it */
+struct async_fs_op_t
+{
+	NOCOPY(async_fs_op_t);
+	async_fs_op_t()
+	{
+		memset(&req, 0, sizeof(req));
+		req.data = this;
+		memset(&st, 0, sizeof(st));
+	}
+
+	uv_fs_t req;
+	std::string path;
+	std::string new_path;
+	std::string data;
+	int fd = -1;
+	size_t done = 0;
+	size_t expected = 0;
+	bool size_known = false;
+	int status = 0;
+	struct stat st;
+
+#ifdef HAVE_IO_URING
+	/* completions still due before the next step can start */
+	int waiting = 0;
+	struct statx stx;
+#endif
+
+	async_fs_read_callback_t read_callback;
+	async_fs_callback_t callback;
+	async_fs_stat_callback_t stat_callback;
+	async_fs_readdir_callback_t readdir_callback;
+};
+
+static void async_fs_finish_read(async_fs_op_t *op)
+{
+	if (op->status != 0)
+	{
+		dlog(log_info, "async_fs : reading %s failed\n", op->path.c_str());
+		op->done = 0;
+	}
+
+	op->data.resize(op->done);
+	auto callback = std::move(op->read_callback);
+	std::string data;
+	data.swap(op->data);
+	int status = op->status;
+	delete op;
+	callback(status, std::move(data));
+}
+
+static void async_fs_finish(async_fs_op_t *op)
+{
+	if (op->status != 0)
+		dlog(log_info, "async_fs : operation on %s failed\n", op->path.c_str());
+
+	auto callback = std::move(op->callback);
+	int status = op->status;
+	delete op;
+	callback(status);
+}
+
+static void async_fs_finish_stat(async_fs_op_t *op)
+{
+	auto callback = std::move(op->stat_callback);
+	int status = op->status;
+	struct stat st = op->st;
+	delete op;
+	callback(status, st);
+}
+
+/* the threadpool backend: each step is a uv_fs request */
+
+static void async_fs_uv_read_next(async_fs_op_t *op);
+
+static void async_fs_uv_read_closed(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_read_closed");
+	uv_fs_req_cleanup(req);
+	async_fs_finish_read((async_fs_op_t *)req->data);
+}
+
+static void async_fs_uv_read_more(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_read_more");
+	auto op = (async_fs_op_t *)req->data;
+	ssize_t result = req->result;
+	uv_fs_req_cleanup(req);
+
+	if (result < 0)
+		op->status = -1;
+	else
+		op->done += result;
+
+	if (result <= 0 || (op->size_known && op->done >= op->expected))
+	{
+		uv_fs_close(async_fs_get_loop(), req, op->fd, async_fs_uv_read_closed);
+		return;
+	}
+	async_fs_uv_read_next(op);
+}
+
+static void async_fs_uv_read_next(async_fs_op_t *op)
+{
+	size_t chunk = op->size_known ? (op->expected - op->done) : async_fs_read_chunk;
+	op->data.resize(op->done + chunk);
+	uv_fs_read(async_fs_get_loop(), &op->req, op->fd, &op->data[op->done], chunk,
+			op->done, async_fs_uv_read_more);
+}
+
+static void async_fs_uv_read_stat(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_read_stat");
+	auto op = (async_fs_op_t *)req->data;
+	if (req->result == 0)
+	{
+		auto st = (struct stat *)req->ptr;
+		op->size_known = S_ISREG(st->st_mode) && (st->st_size > 0);
+		op->expected = st->st_size;
+	}
+	uv_fs_req_cleanup(req);
+	async_fs_uv_read_next(op);
+}
+
+static void async_fs_uv_read_opened(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_read_opened");
+	auto op = (async_fs_op_t *)req->data;
+	int fd = req->result;
+	uv_fs_req_cleanup(req);
+
+	if (fd < 0)
+	{
+		op->status = -1;
+		async_fs_finish_read(op);
+		return;
+	}
+
+	op->fd = fd;
+	uv_fs_fstat(async_fs_get_loop(), req, fd, async_fs_uv_read_stat);
+}
+
+static void async_fs_uv_write_next(async_fs_op_t *op);
+
+static void async_fs_uv_write_closed(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_write_closed");
+	auto op = (async_fs_op_t *)req->data;
+	if (req->result < 0)
+		op->status = -1;
+	uv_fs_req_cleanup(req);
+	async_fs_finish(op);
+}
+
+static void async_fs_uv_write_more(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_write_more");
+	auto op = (async_fs_op_t *)req->data;
+	ssize_t result = req->result;
+	uv_fs_req_cleanup(req);
+
+	if (result < 0)
+		op->status = -1;
+	else
+		op->done += result;
+
+	if (result <= 0 || op->done >= op->data.size())
+	{
+		uv_fs_close(async_fs_get_loop(), req, op->fd, async_fs_uv_write_closed);
+		return;
+	}
+	async_fs_uv_write_next(op);
+}
+
+static void async_fs_uv_write_next(async_fs_op_t *op)
+{
+	if (op->done >= op->data.size())
+	{
+		uv_fs_close(async_fs_get_loop(), &op->req, op->fd, async_fs_uv_write_closed);
+		return;
+	}
+
+	uv_fs_write(async_fs_get_loop(), &op->req, op->fd, &op->data[op->done],
+			op->data.size() - op->done, op->done, async_fs_uv_write_more);
+}
+
+static void async_fs_uv_write_opened(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_write_opened");
+	auto op = (async_fs_op_t *)req->data;
+	int fd = req->result;
+	uv_fs_req_cleanup(req);
+
+	if (fd < 0)
+	{
+		op->status = -1;
+		async_fs_finish(op);
+		return;
+	}
+
+	op->fd = fd;
+	async_fs_uv_write_next(op);
+}
+
+static void async_fs_uv_stat_done(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_stat_done");
+	auto op = (async_fs_op_t *)req->data;
+	if (req->result == 0)
+		op->st = *(struct stat *)req->ptr;
+	else
+		op->status = -1;
+	uv_fs_req_cleanup(req);
+	async_fs_finish_stat(op);
+}
+
+static void async_fs_uv_readdir_done(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_readdir_done");
+	auto op = (async_fs_op_t *)req->data;
+	std::vector<std::string> leaf_names;
+	if (req->result < 0)
+	{
+		op->status = -1;
+	}
+	else
+	{
+		/* the names come back as one buffer of nul separated strings */
+		const char *name = (const char *)req->ptr;
+		for (ssize_t i = 0; i < req->result; ++i)
+		{
+			leaf_names.push_back(name);
+			name += strlen(name) + 1;
+		}
+	}
+	uv_fs_req_cleanup(req);
+
+	auto callback = std::move(op->readdir_callback);
+	int status = op->status;
+	delete op;
+	callback(status, std::move(leaf_names));
+}
+
+static void async_fs_uv_done(uv_fs_t *req)
+{
+	loop_monitor_scope_t scope("async_fs_uv_done");
+	auto op = (async_fs_op_t *)req->data;
+	if (req->result < 0)
+		op->status = -1;
+	uv_fs_req_cleanup(req);
+	async_fs_finish(op);
+}
+
+#ifdef HAVE_IO_URING
+/* the io_uring backend: the same steps as ring operations */
+
+static io_uring_sqe async_fs_sqe(int opcode, int fd)
+{
+	io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	return sqe;
+}
+
+static bool async_fs_uring_has(int opcode)
+{
+	return (async_fs_ring != nullptr) && async_fs_ring->supports(opcode);
+}
+
+static void async_fs_uring_close(async_fs_op_t *op, void (*finish)(async_fs_op_t *))
+{
+	async_fs_ring->queue(async_fs_sqe(IORING_OP_CLOSE, op->fd), [op, finish](int result) {
+		if (result < 0)
+			op->status = -1;
+		finish(op);
+	});
+}
+
+static void async_fs_uring_read_next(async_fs_op_t *op)
+{
+	size_t chunk = op->size_known ? (op->expected - op->done) : async_fs_read_chunk;
+	op->data.resize(op->done + chunk);
+
+	io_uring_sqe sqe = async_fs_sqe(IORING_OP_READ, op->fd);
+	sqe.addr = (uintptr_t)&op->data[op->done];
+	sqe.len = chunk;
+	sqe.off = op->done;
+	async_fs_ring->queue(sqe, [op](int result) {
+		if (result < 0)
+			op->status = -1;
+		else
+			op->done += result;
+
+		if (result <= 0 || (op->size_known && op->done >= op->expected))
+			async_fs_uring_close(op, async_fs_finish_read);
+		else
+			async_fs_uring_read_next(op);
+	});
+}
+
+static void async_fs_uring_read_ready(async_fs_op_t *op)
+{
+	if (--op->waiting != 0)
+		return;
+
+	if (op->fd < 0)
+	{
+		async_fs_finish_read(op);
+		return;
+	}
+	async_fs_uring_read_next(op);
+}
+
+static void async_fs_uring_read(async_fs_op_t *op)
+{
+	/* open and statx go out in the same batch, neither needs the other */
+	op->waiting = 2;
+
+	io_uring_sqe open_sqe = async_fs_sqe(IORING_OP_OPENAT, AT_FDCWD);
+	open_sqe.addr = (uintptr_t)op->path.c_str();
+	open_sqe.open_flags = O_RDONLY | O_CLOEXEC;
+	async_fs_ring->queue(open_sqe, [op](int result) {
+		if (result < 0)
+			op->status = -1;
+		else
+			op->fd = result;
+		async_fs_uring_read_ready(op);
+	});
+
+	io_uring_sqe statx_sqe = async_fs_sqe(IORING_OP_STATX, AT_FDCWD);
+	statx_sqe.addr = (uintptr_t)op->path.c_str();
+	statx_sqe.len = STATX_TYPE | STATX_SIZE;
+	statx_sqe.off = (uintptr_t)&op->stx;
+	async_fs_ring->queue(statx_sqe, [op](int result) {
+		if (result == 0)
+		{
+			op->size_known = S_ISREG(op->stx.stx_mode) && (op->stx.stx_size > 0);
+			op->expected = op->stx.stx_size;
+		}
+		async_fs_uring_read_ready(op);
+	});
+}
+
+static void async_fs_uring_write_next(async_fs_op_t *op)
+{
+	if (op->done >= op->data.size())
+	{
+		async_fs_uring_close(op, async_fs_finish);
+		return;
+	}
+
+	io_uring_sqe sqe = async_fs_sqe(IORING_OP_WRITE, op->fd);
+	sqe.addr = (uintptr_t)&op->data[op->done];
+	sqe.len = op->data.size() - op->done;
+	sqe.off = op->done;
+	async_fs_ring->queue(sqe, [op](int result) {
+		if (result <= 0)
+		{
+			op->status = -1;
+			async_fs_uring_close(op, async_fs_finish);
+			return;
+		}
+		op->done += result;
+		async_fs_uring_write_next(op);
+	});
+}
+
+static void async_fs_uring_write(async_fs_op_t *op)
+{
+	io_uring_sqe sqe = async_fs_sqe(IORING_OP_OPENAT, AT_FDCWD);
+	sqe.addr = (uintptr_t)op->path.c_str();
+	sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	sqe.len = 0644;
+	async_fs_ring->queue(sqe, [op](int result) {
+		if (result < 0)
+		{
+			op->status = -1;
+			async_fs_finish(op);
+			return;
+		}
+		op->fd = result;
+		async_fs_uring_write_next(op);
+	});
+}
+
+static void async_fs_statx_to_stat(const struct statx &stx, struct stat &st)
+{
+	memset(&st, 0, sizeof(st));
+	st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st.st_ino = stx.stx_ino;
+	st.st_mode = stx.stx_mode;
+	st.st_nlink = stx.stx_nlink;
+	st.st_uid = stx.stx_uid;
+	st.st_gid = stx.stx_gid;
+	st.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st.st_size = stx.stx_size;
+	st.st_blksize = stx.stx_blksize;
+	st.st_blocks = stx.stx_blocks;
+	st.st_atim.tv_sec = stx.stx_atime.tv_sec;
+	st.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
+
+static void async_fs_uring_stat(async_fs_op_t *op)
+{
+	io_uring_sqe sqe = async_fs_sqe(IORING_OP_STATX, AT_FDCWD);
+	sqe.addr = (uintptr_t)op->path.c_str();
+	sqe.len = STATX_BASIC_STATS;
+	sqe.off = (uintptr_t)&op->stx;
+	async_fs_ring->queue(sqe, [op](int result) {
+		if (result == 0)
+			async_fs_statx_to_stat(op->stx, op->st);
+		else
+			op->status = -1;
+		async_fs_finish_stat(op);
+	});
+}
+
+static void async_fs_uring_rename(async_fs_op_t *op)
+{
+	io_uring_sqe sqe = async_fs_sqe(IORING_OP_RENAMEAT, AT_FDCWD);
+	sqe.addr = (uintptr_t)op->path.c_str();
+	sqe.len = (uint32_t)AT_FDCWD;
+	sqe.addr2 = (uintptr_t)op->new_path.c_str();
+	async_fs_ring->queue(sqe, [op](int result) {
+		if (result < 0)
+			op->status = -1;
+		async_fs_finish(op);
+	});
+}
+#endif
+
+void async_fs_read_file(const std::string &path, async_fs_read_callback_t &&callback)
+{
+	auto op = new async_fs_op_t;
+	op->path = path;
+	op->read_callback = std::move(callback);
+
+#ifdef HAVE_IO_URING
+	if (async_fs_uring_has(IORING_OP_OPENAT) && async_fs_uring_has(IORING_OP_STATX)
+			&& async_fs_uring_has(IORING_OP_READ) && async_fs_uring_has(IORING_OP_CLOSE))
+	{
+		async_fs_uring_read(op);
+		return;
+	}
+#endif
+
+	uv_fs_open(async_fs_get_loop(), &op->req, op->path.c_str(), O_RDONLY | O_CLOEXEC, 0,
+			async_fs_uv_read_opened);
+}
+
+void async_fs_write_file(const std::string &path, const std::string &data, async_fs_callback_t &&callback)
+{
+	auto op = new async_fs_op_t;
+	op->path = path;
+	op->data = data;
+	op->callback = std::move(callback);
+
+#ifdef HAVE_IO_URING
+	if (async_fs_uring_has(IORING_OP_OPENAT) && async_fs_uring_has(IORING_OP_WRITE)
+			&& async_fs_uring_has(IORING_OP_CLOSE))
+	{
+		async_fs_uring_write(op);
+		return;
+	}
+#endif
+
+	uv_fs_open(async_fs_get_loop(), &op->req, op->path.c_str(),
+			O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644, async_fs_uv_write_opened);
+}
+
+void async_fs_stat(const std::string &path, async_fs_stat_callback_t &&callback)
+{
+	auto op = new async_fs_op_t;
+	op->path = path;
+	op->stat_callback = std::move(callback);
+
+#ifdef HAVE_IO_URING
+	if (async_fs_uring_has(IORING_OP_STATX))
+	{
+		async_fs_uring_stat(op);
+		return;
+	}
+#endif
+
+	uv_fs_stat(async_fs_get_loop(), &op->req, op->path.c_str(), async_fs_uv_stat_done);
+}
+
+void async_fs_readdir(const std::string &path, async_fs_readdir_callback_t &&callback)
+{
+	/* io_uring has no getdents */
+	auto op = new async_fs_op_t;
+	op->path = path;
+	op->readdir_callback = std::move(callback);
+	uv_fs_readdir(async_fs_get_loop(), &op->req, op->path.c_str(), 0, async_fs_uv_readdir_done);
+}
+
+void async_fs_rename(const std::string &from, const std::string &to, async_fs_callback_t &&callback)
+{
+	auto op = new async_fs_op_t;
+	op->path = from;
+	op->new_path = to;
+	op->callback = std::move(callback);
+
+#ifdef HAVE_IO_URING
+	if (async_fs_uring_has(IORING_OP_RENAMEAT))
+	{
+		async_fs_uring_rename(op);
+		return;
+	}
+#endif
+
+	uv_fs_rename(async_fs_get_loop(), &op->req, op->path.c_str(), op->new_path.c_str(),
+			async_fs_uv_done);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/stat.h>
+#include <uv.h>
+
+/* file operations that complete on the loop instead of blocking it. by
+ * default each one is a chain of uv_fs_* requests on libuv's threadpool.
+ * with the io_uring backend, operations the kernel supports go through a
+ * ring instead, and everything queued during a loop iteration is submitted
+ * with a single syscall. readdir always uses the threadpool.
+ *
+ * status is 0 on success and -1 on failure. */
+
+enum async_fs_backend_t
+{
+	async_fs_threadpool,
+	async_fs_uring,
+};
+
+/* selects the loop and backend for everything that follows, and returns the
+ * backend actually in effect (io_uring falls back to the threadpool when the
+ * kernel doesn't have it). without a call, the default loop and the
+ * threadpool are used. */
+async_fs_backend_t async_fs_init(uv_loop_t *loop, async_fs_backend_t backend = async_fs_uring);
+
+typedef std::function<void(int status)> async_fs_callback_t;
+typedef std::function<void(int status, std::string &&data)> async_fs_read_callback_t;
+typedef std::function<void(int status, const struct stat &st)> async_fs_stat_callback_t;
+typedef std::function<void(int status, std::vector<std::string> &&leaf_names)> async_fs_readdir_callback_t;
+
+void async_fs_read_file(const std::string &path, async_fs_read_callback_t &&callback);
+
+/* creates or truncates path */
+void async_fs_write_file(const std::string &path, const std::string &data, async_fs_callback_t &&callback);
+
+void async_fs_stat(const std::string &path, async_fs_stat_callback_t &&callback);
+void async_fs_readdir(const std::string &path, async_fs_readdir_callback_t &&callback);
+void async_fs_rename(const std::string &from, const std::string &to, async_fs_callback_t &&callback);
@@ -0,0 +1,135 @@
+#include "clock_cache.h"
+#include <time.h>
+#include <string.h>
+#include "clock_source.h"
+
+struct clock_cache_t
+{
+	uv_loop_t *loop;
+	uint64_t loop_ms;
+	double now;
+	uint64_t monotonic_ns;
+
+	time_t date_second;
+	char http_date[clock_http_date_length + 1];
+
+	time_t log_second;
+	char log_stamp[clock_log_stamp_length + 1];
+};
+
+static thread_local clock_cache_t t_clock_cache = { nullptr, 0, 0.0, 0, -1, "", -1, "" };
+
+void clock_cache_bind(uv_loop_t *loop)
+{
+	t_clock_cache.loop = loop;
+	t_clock_cache.loop_ms = uv_now(loop);
+	t_clock_cache.now = clock_realtime_ns() / 1e9;
+	t_clock_cache.monotonic_ns = clock_monotonic_ns();
+}
+
+/* false if there's no loop to go by and the clocks have to be read */
+static bool clock_cache_refresh(clock_cache_t &cache)
+{
+	if (cache.loop == nullptr)
+		return false;
+
+	uint64_t loop_ms = uv_now(cache.loop);
+	if (loop_ms != cache.loop_ms)
+	{
+		cache.loop_ms = loop_ms;
+		cache.now = clock_realtime_ns() / 1e9;
+		cache.monotonic_ns = clock_monotonic_ns();
+	}
+	return true;
+}
+
+double clock_cache_now()
+{
+	clock_cache_t &cache = t_clock_cache;
+	if (!clock_cache_refresh(cache))
+		return clock_realtime_ns() / 1e9;
+	return cache.now;
+}
+
+uint64_t clock_cache_monotonic_ns()
+{
+	clock_cache_t &cache = t_clock_cache;
+	if (!clock_cache_refresh(cache))
+		return clock_monotonic_ns();
+	return cache.monotonic_ns;
+}
+
+static char *clock_put_2(char *pch, int value)
+{
+	pch[0] = '0' + (value / 10) % 10;
+	pch[1] = '0' + value % 10;
+	return pch + 2;
+}
+
+static char *clock_put_4(char *pch, int value)
+{
+	pch = clock_put_2(pch, value / 100);
+	return clock_put_2(pch, value % 100);
+}
+
+const char *clock_cache_http_date()
+{
+	static const char days[] = "SunMonTueWedThuFriSat";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+	clock_cache_t &cache = t_clock_cache;
+	time_t second = (time_t)clock_cache_now();
+	if (second != cache.date_second)
+	{
+		tm tdata;
+		gmtime_r(&second, &tdata);
+
+		char *pch = cache.http_date;
+		memcpy(pch, days + 3 * tdata.tm_wday, 3);
+		pch += 3;
+		*pch++ = ',';
+		*pch++ = ' ';
+		pch = clock_put_2(pch, tdata.tm_mday);
+		*pch++ = ' ';
+		memcpy(pch, months + 3 * tdata.tm_mon, 3);
+		pch += 3;
+		*pch++ = ' ';
+		pch = clock_put_4(pch, tdata.tm_year + 1900);
+		*pch++ = ' ';
+		pch = clock_put_2(pch, tdata.tm_hour);
+		*pch++ = ':';
+		pch = clock_put_2(pch, tdata.tm_min);
+		*pch++ = ':';
+		pch = clock_put_2(pch, tdata.tm_sec);
+		memcpy(pch, " GMT", 5);
+		cache.date_second = second;
+	}
+	return cache.http_date;
+}
+
+const char *clock_cache_log_stamp(double time)
+{
+	clock_cache_t &cache = t_clock_cache;
+	time_t second = (time_t)time;
+	if (second != cache.log_second)
+	{
+		tm tdata;
+		gmtime_r(&second, &tdata);
+
+		char *pch = cache.log_stamp;
+		pch = clock_put_2(pch, tdata.tm_mon + 1);
+		*pch++ = '/';
+		pch = clock_put_2(pch, tdata.tm_mday);
+		*pch++ = '/';
+		pch = clock_put_4(pch, tdata.tm_year + 1900);
+		*pch++ = '\t';
+		pch = clock_put_2(pch, tdata.tm_hour);
+		*pch++ = ':';
+		pch = clock_put_2(pch, tdata.tm_min);
+		*pch++ = ':';
+		pch = clock_put_2(pch, tdata.tm_sec);
+		*pch = '\0';
+		cache.log_second = second;
+	}
+	return cache.log_stamp;
+}
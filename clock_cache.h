@@ -0,0 +1,28 @@
+#pragma once
+#include <uv.h>
+
+/* wall clock reads and their rendered forms, cached per thread.
+ *
+ * a thread that runs a loop can bind it, after which clock_cache_now and
+ * clock_cache_monotonic_ns only read the clocks when the loop's millisecond
+ * clock (uv_now) has moved, so everything handled in one loop iteration
+ * shares one reading. the rendered
+ * strings are redone at most once a second and are otherwise just copied. */
+
+/* call on the thread that runs loop */
+void clock_cache_bind(uv_loop_t *loop);
+
+/* seconds since the epoch */
+double clock_cache_now();
+
+/* clock_monotonic_ns as of this loop iteration, for timeouts and anything
+ * else that doesn't need better than a millisecond */
+uint64_t clock_cache_monotonic_ns();
+
+/* RFC 7231 IMF-fixdate for now, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+const int clock_http_date_length = 29;
+const char *clock_cache_http_date();
+
+/* "MM/DD/YYYY\tHH:MM:SS" for time, as the logger writes it */
+const int clock_log_stamp_length = 19;
+const char *clock_cache_log_stamp(double time);
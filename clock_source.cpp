@@ -0,0 +1,98 @@
+#include "clock_source.h"
+#include <time.h>
+#include <atomic>
+#include "logger_decls.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+static uint64_t clock_read(clockid_t clock_id)
+{
+	timespec ts;
+	clock_gettime(clock_id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t clock_monotonic_ns()
+{
+	return clock_read(CLOCK_MONOTONIC);
+}
+
+uint64_t clock_coarse_ns()
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+	return clock_read(CLOCK_MONOTONIC_COARSE);
+#else
+	return clock_read(CLOCK_MONOTONIC);
+#endif
+}
+
+uint64_t clock_realtime_ns()
+{
+	return clock_read(CLOCK_REALTIME);
+}
+
+/* ns = ns_base + ((ticks - tsc_base) * ns_per_tick) >> 32 */
+struct clock_tsc_t
+{
+	uint64_t tsc_base;
+	uint64_t ns_base;
+	uint64_t ns_per_tick;
+};
+
+static clock_tsc_t s_clock_tsc;
+static std::atomic<bool> s_clock_tsc_enabled(false);
+
+bool clock_tsc_calibrate()
+{
+#if defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+	{
+		dlog(log_info, "clock_tsc_calibrate : the TSC isn't invariant here\n");
+		return false;
+	}
+
+	uint64_t ns_start = clock_monotonic_ns();
+	uint64_t tsc_start = __rdtsc();
+	timespec nap = { 0, clock_tsc_calibration_ms * 1000000L };
+	while (nanosleep(&nap, &nap) != 0)
+	{
+	}
+	uint64_t ns_end = clock_monotonic_ns();
+	uint64_t tsc_end = __rdtsc();
+	if (tsc_end <= tsc_start)
+		return false;
+
+	s_clock_tsc.tsc_base = tsc_end;
+	s_clock_tsc.ns_base = ns_end;
+	s_clock_tsc.ns_per_tick = ((ns_end - ns_start) << 32) / (tsc_end - tsc_start);
+	s_clock_tsc_enabled.store(true, std::memory_order_release);
+	dlog(log_info, "clock_tsc_calibrate : TSC runs at %.3f GHz\n",
+			(double)(tsc_end - tsc_start) / (ns_end - ns_start));
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool clock_tsc_enabled()
+{
+	return s_clock_tsc_enabled.load(std::memory_order_acquire);
+}
+
+uint64_t clock_fast_ns()
+{
+#if defined(__x86_64__)
+	if (s_clock_tsc_enabled.load(std::memory_order_acquire))
+	{
+		/* another core's TSC can be a hair behind the one calibrated on */
+		int64_t ticks = (int64_t)(__rdtsc() - s_clock_tsc.tsc_base);
+		if (ticks < 0)
+			return s_clock_tsc.ns_base;
+		return s_clock_tsc.ns_base + (uint64_t)(((unsigned __int128)ticks * s_clock_tsc.ns_per_tick) >> 32);
+	}
+#endif
+	return clock_monotonic_ns();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+/* clocks for timing things, all in nanoseconds.
+ *
+ * monotonic and coarse never go backwards and don't jump when the wall clock
+ * is stepped, so they're what intervals, latencies and deadlines should be
+ * measured with. coarse only moves once a kernel tick (a few ms) but costs
+ * little more than a memory read. realtime is the wall clock, for stamping
+ * things people will read, never for measuring. */
+uint64_t clock_monotonic_ns();
+uint64_t clock_coarse_ns();
+uint64_t clock_realtime_ns();
+
+/* times the TSC against the monotonic clock, after which clock_fast_ns reads
+ * the TSC rather than making a clock_gettime call. only done where the cpu
+ * says its TSC is invariant (constant rate, not stopped in sleep states).
+ * blocks for clock_tsc_calibration_ms, call once at startup before the
+ * threads that will use it exist. false if the TSC can't be used. */
+const int clock_tsc_calibration_ms = 20;
+bool clock_tsc_calibrate();
+bool clock_tsc_enabled();
+
+/* the monotonic clock, from the TSC when it's been calibrated. the two can
+ * drift apart by a few parts per million, so don't compare one against the
+ * other. */
+uint64_t clock_fast_ns();
@@ -6,11 +6,20 @@
 #include <sstream>
 #include <unistd.h>
 #include <string.h>
-#include <copyfile.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
 #include <fstream>
 #include "logger_decls.h"
 #include "utils.h"
+#include "line_index.h"
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <fcntl.h>
 
 bool file_exists(const std::string &file_path)
 {
@@ -47,31 +56,8 @@ off_t file_size(const char *filename)
 
 bool get_line_col(const std::string &file_path, size_t offset, size_t &line, size_t &col)
 {
-	FILE *fp = fopen(file_path.c_str(), "rt");
-	if (fp != NULL)
-	{
-		char ch;
-		line = 1;
-		col = 1;
-		for (size_t i = 0; i < offset; i++)
-		{
-			if (fread(&ch, 1, 1, fp) == 0)
-				return false;
-			switch (ch)
-			{
-			case '\n':
-				line++;
-				col = 1;
-				continue;
-			default:
-				col++;
-				continue;
-			}
-		}
-		fclose(fp);
-		return true;
-	}
-	return false;
+	auto index = line_index_t::get(file_path);
+	return (index != nullptr) && index->locate(offset, line, col);
 }
 
 bool list_files(const std::string &folder,
@@ -110,6 +96,174 @@ bool list_files(const std::string &folder,
 	return true;
 }
 
+/* copies the contents of source_fd to dest_fd, sharing extents when the
+ * filesystem can */
+static bool move_files_copy_data(int source_fd, int dest_fd, off_t size)
+{
+#ifdef __linux__
+	if (ioctl(dest_fd, FICLONE, source_fd) == 0)
+		return true;
+
+	off_t done = 0;
+	bool use_sendfile = false;
+	while (done < size)
+	{
+		ssize_t copied;
+		if (!use_sendfile)
+		{
+			copied = copy_file_range(source_fd, NULL, dest_fd, NULL, size - done, 0);
+			if (copied < 0 && done == 0
+					&& (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				/* older kernels won't copy_file_range between filesystems */
+				use_sendfile = true;
+				continue;
+			}
+		}
+		else
+		{
+			copied = sendfile(dest_fd, source_fd, NULL, size - done);
+		}
+
+		if (copied < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (copied == 0)
+		{
+			/* the source shrank under us, a short copy mustn't replace
+			 * the target */
+			return false;
+		}
+		done += copied;
+	}
+	return true;
+#else
+	char buffer[64 * 1024];
+	while (true)
+	{
+		ssize_t bytes_read = read(source_fd, buffer, sizeof(buffer));
+		if (bytes_read < 0 && errno == EINTR)
+			continue;
+		if (bytes_read <= 0)
+			return bytes_read == 0;
+
+		for (ssize_t written = 0; written < bytes_read; )
+		{
+			ssize_t result = write(dest_fd, buffer + written, bytes_read - written);
+			if (result < 0 && errno != EINTR)
+				return false;
+			if (result > 0)
+				written += result;
+		}
+	}
+#endif
+}
+
+static bool move_files_copy(const std::string &source, const std::string &temp)
+{
+	int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source_fd == -1)
+		return false;
+
+	struct stat st;
+	int dest_fd = -1;
+	if (fstat(source_fd, &st) == 0)
+		dest_fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+
+	bool copied = (dest_fd != -1) && move_files_copy_data(source_fd, dest_fd, st.st_size);
+	if (copied)
+	{
+		fchmod(dest_fd, st.st_mode & 07777);
+#ifdef __linux__
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		futimens(dest_fd, times);
+#endif
+		/* the source is unlinked once this returns true, so the copy has
+		 * to be on disk and its writeback errors seen here */
+		copied = (fsync(dest_fd) == 0);
+	}
+
+	if (dest_fd != -1)
+		close(dest_fd);
+	close(source_fd);
+
+	if (!copied)
+		unlink(temp.c_str());
+	return copied;
+}
+
+struct move_files_copy_t
+{
+	std::string source;
+	std::string temp;
+	std::string target;
+	bool copied;
+};
+
+/* moves files that rename() can't because they're on another filesystem.
+ * everything is copied and synced in parallel to a temporary name next to
+ * its target, renamed into place, and only then are the sources removed. */
+static bool move_files_across(std::vector<move_files_copy_t> &copies, const std::string &dest)
+{
+	{
+		thread_pool_group_t tasks;
+		for (auto &copy : copies)
+		{
+			move_files_copy_t *pcopy = &copy;
+			tasks.submit([pcopy]() {
+				pcopy->copied = move_files_copy(pcopy->source, pcopy->temp);
+			});
+		}
+		tasks.wait();
+	}
+
+	int dest_fd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dest_fd == -1)
+	{
+		dlog(log_error, "move_files : error : couldn't open %s\n", dest.c_str());
+		return false;
+	}
+
+	bool moved_all = true;
+	for (auto &copy : copies)
+	{
+		if (!copy.copied)
+		{
+			dlog(log_error, "move_files : error : couldn't copy %s to %s\n",
+					copy.source.c_str(), copy.target.c_str());
+			unlink(copy.temp.c_str());
+			copy.copied = false;
+			moved_all = false;
+			continue;
+		}
+
+		if (rename(copy.temp.c_str(), copy.target.c_str()) != 0)
+		{
+			unlink(copy.temp.c_str());
+			copy.copied = false;
+			moved_all = false;
+		}
+	}
+
+	/* the renames have to be durable before the sources go away */
+	if (fsync(dest_fd) != 0)
+		moved_all = false;
+	else
+	{
+		for (auto &copy : copies)
+		{
+			if (copy.copied)
+				unlink(copy.source.c_str());
+		}
+	}
+
+	close(dest_fd);
+	return moved_all;
+}
+
 bool move_files(const std::string &source, const std::string &dest)
 {
 	if (!ensure_directory_exists(dest))
@@ -134,6 +288,9 @@ bool move_files(const std::string &source, const std::string &dest)
 		dlog(log_info, "move_files : error : funky error #3 on %s\n", source.c_str());
 		return false;
 	}
+
+	bool moved_all = true;
+	std::vector<move_files_copy_t> copies;
 	while ((stFiles = readdir(stDirIn)) != NULL)
 	{
 		std::string leaf_name = stFiles->d_name;
@@ -155,17 +312,47 @@ bool move_files(const std::string &source, const std::string &dest)
 		std::string full_target_path = dest + "/" + leaf_name;
 		dlog(log_info, "move_files : info : renaming %s to %s\n",
 				full_source_path.c_str(), full_target_path.c_str());
-		if (rename(full_source_path.c_str(), full_target_path.c_str()) != 0)
+		if (rename(full_source_path.c_str(), full_target_path.c_str()) == 0)
+		{
+			assert(!file_exists(full_source_path.c_str()));
+			assert(file_exists(full_target_path.c_str()));
+			continue;
+		}
+
+		if (errno != EXDEV)
 		{
 			closedir(stDirIn);
 			return false;
 		}
-		assert(!file_exists(full_source_path.c_str()));
-		assert(file_exists(full_target_path.c_str()));
+
+		/* source and dest are on different filesystems */
+		if (S_ISREG(stFileInfo.st_mode))
+		{
+			move_files_copy_t copy;
+			copy.source = full_source_path;
+			copy.temp = dest + "/." + leaf_name + ".partial";
+			copy.target = full_target_path;
+			copy.copied = false;
+			copies.push_back(copy);
+		}
+		else if (S_ISDIR(stFileInfo.st_mode))
+		{
+			if (!move_files(full_source_path, full_target_path) || rmdir(full_source_path.c_str()) != 0)
+				moved_all = false;
+		}
+		else
+		{
+			dlog(log_error, "move_files : error : can't copy %s across filesystems\n",
+					full_source_path.c_str());
+			moved_all = false;
+		}
 	}
 	closedir(stDirIn);
 
-	return true;
+	if (copies.size() != 0 && !move_files_across(copies, dest))
+		moved_all = false;
+
+	return moved_all;
 }
 
 bool ensure_directory_exists(const std::string &name)
@@ -193,3 +380,107 @@ std::string leaf_from_file_path(const std::string &file_path)
 	return file_path.substr(pos + 1);
 }
 
+
+bool for_each_file_entry_stat(int dir_fd, const struct dirent *entry, for_each_file_stat_t &file_stat)
+{
+	bool is_dir;
+	if (entry->d_type != DT_UNKNOWN)
+	{
+		is_dir = (entry->d_type == DT_DIR);
+	}
+	else
+	{
+		struct stat st;
+		if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			return false;
+		is_dir = S_ISDIR(st.st_mode);
+	}
+
+	file_stat.is_dir = is_dir;
+	file_stat.is_file = !is_dir;
+	return true;
+}
+
+struct for_each_file_walk_t
+{
+	for_each_file_walk_t(const for_each_file_callback_t &callback, thread_pool_t &pool)
+		: callback(callback), tasks(pool), halted(false)
+	{
+	}
+
+	const for_each_file_callback_t &callback;
+	thread_pool_group_t tasks;
+	std::atomic<bool> halted;
+};
+
+static void for_each_file_walk_dir(for_each_file_walk_t *walk, const std::string &dir);
+
+static void for_each_file_walk_queue(for_each_file_walk_t *walk, const std::string &dir)
+{
+	walk->tasks.submit([walk, dir]() {
+		for_each_file_walk_dir(walk, dir);
+	});
+}
+
+static void for_each_file_walk_dir(for_each_file_walk_t *walk, const std::string &dir)
+{
+	if (walk->halted.load(std::memory_order_relaxed))
+		return;
+
+	DIR *dir_stream = opendir(dir.c_str());
+	if (dir_stream == NULL)
+	{
+		dlog(log_error, "for_each_file_parallel - failed opening %s as a directory\n", dir.c_str());
+		return;
+	}
+
+	std::string full_name(dir);
+	full_name.push_back('/');
+	size_t dir_length = full_name.size();
+
+	struct dirent *entry;
+	while ((entry = readdir(dir_stream)) != NULL)
+	{
+		if (for_each_file_dots(entry->d_name))
+			continue;
+
+		full_name.resize(dir_length);
+		full_name.append(entry->d_name);
+
+		for_each_file_stat_t file_stat;
+		if (!for_each_file_entry_stat(dirfd(dir_stream), entry, file_stat))
+		{
+			dlog(log_warning, "for_each_file_parallel - warning - failure getting lstat on %s\n", full_name.c_str());
+			continue;
+		}
+
+		if (walk->halted.load(std::memory_order_relaxed))
+			break;
+
+		for_each_control_t control;
+		control.halt = false;
+		control.recurse = false;
+		walk->callback(full_name, file_stat, control);
+		if (control.halt)
+		{
+			walk->halted.store(true, std::memory_order_relaxed);
+			break;
+		}
+
+		if (file_stat.is_dir && control.recurse)
+			for_each_file_walk_queue(walk, full_name);
+	}
+
+	closedir(dir_stream);
+}
+
+bool for_each_file_parallel(
+		const std::string &dir,
+		const for_each_file_callback_t &callback,
+		thread_pool_t &pool)
+{
+	for_each_file_walk_t walk(callback, pool);
+	for_each_file_walk_queue(&walk, dir);
+	walk.tasks.wait();
+	return !walk.halted.load(std::memory_order_relaxed);
+}
@@ -6,7 +6,9 @@
 #include <memory>
 #include <iosfwd>
 #include <vector>
+#include <functional>
 #include "logger_decls.h"
+#include "thread_pool.h"
 #include <dirent.h>
 #include <sys/errno.h>
 #include <sys/types.h>
@@ -17,11 +19,14 @@ using std::shared_ptr;
 
 bool folder_exists(const std::string &path);
 bool file_exists(const std::string &file_path);
+/* 1 based. the file is indexed once and cached, see line_index.h */
 bool get_line_col(const std::string &file_path, size_t offset, size_t &line, size_t &col);
 off_t file_size(const char *filename);
 std::string directory_from_file_path(const std::string &file_path);
 std::string leaf_from_file_path(const std::string &file_path);
 bool ensure_directory_exists(const std::string &name);
+/* renames everything in source into dest. across filesystems the files are
+ * copied in parallel, synced, and only then removed from source */
 bool move_files(const std::string &source, const std::string &dest);
 bool list_files(const std::string &folder, const std::string &match, std::vector<std::string> &leaf_names);
 
@@ -38,73 +43,74 @@ struct for_each_control_t
 	bool recurse;
 };
 
+/* what a directory entry is, from d_type when the filesystem fills it in and
+ * fstatat relative to dir_fd when it doesn't. symlinks are reported as files
+ * and not followed. false if the entry couldn't be stat'd. */
+bool for_each_file_entry_stat(int dir_fd, const struct dirent *entry, for_each_file_stat_t &file_stat);
+
+inline bool for_each_file_dots(const char *name)
+{
+	return (name[0] == '.') && ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0')));
+}
+
 template <typename T>
 bool for_each_file(
 		const std::string &dir,
 		const T &callback)
 {
-    struct dirent *stFiles;
-    DIR *stDirIn;
-    char szFullName[MAXPATHLEN];
-    char szDirectory[MAXPATHLEN];
-    struct stat stFileInfo;
+	DIR *dir_stream = opendir(dir.c_str());
+	if (dir_stream == NULL)
+	{
+		dlog(log_error, "for_each_file - failed opening %s as a directory\n", dir.c_str());
+		return true;
+	}
 
-	strncpy(szDirectory, dir.c_str(), MAXPATHLEN - 1);
+	std::string full_name(dir);
+	full_name.push_back('/');
+	size_t dir_length = full_name.size();
 
-    if ((stDirIn = opendir(szDirectory)) != NULL)
-    {
-		while ((stFiles = readdir(stDirIn)) != NULL)
-		{
-			if ((strcmp(".", stFiles->d_name) == 0)
-					|| (strcmp("..", stFiles->d_name) == 0))
-			{
-				continue;
-			}
+	bool completed = true;
+	struct dirent *entry;
+	while ((entry = readdir(dir_stream)) != NULL)
+	{
+		if (for_each_file_dots(entry->d_name))
+			continue;
 
-			sprintf(szFullName, "%s/%s", szDirectory, stFiles->d_name);
+		full_name.resize(dir_length);
+		full_name.append(entry->d_name);
 
-			if (lstat(szFullName, &stFileInfo) < 0)
-			{
-				dlog(log_warning, "for_each_file - warning - failure getting lstat on %s\n", szFullName);
-				continue;
-			}
+		for_each_file_stat_t file_stat;
+		if (!for_each_file_entry_stat(dirfd(dir_stream), entry, file_stat))
+		{
+			dlog(log_warning, "for_each_file - warning - failure getting lstat on %s\n", full_name.c_str());
+			continue;
+		}
 
-			if (S_ISDIR(stFileInfo.st_mode))
-			{
-				std::string subdir_name(szFullName);
-				for_each_file_stat_t file_stat;
-				file_stat.is_file = false;
-				file_stat.is_dir = true;
-				for_each_control_t control;
-				control.halt = false;
-				control.recurse = false;
-				callback(subdir_name, file_stat, control);
-				if (control.halt)
-					return false;
-				if (control.recurse && !for_each_file(subdir_name, callback))
-					return false;
-			}
-			else
-			{
-				std::string file_name(szFullName);
-				for_each_file_stat_t file_stat;
-				file_stat.is_file = true;
-				file_stat.is_dir = false;
-				for_each_control_t control;
-				control.halt = false;
-				control.recurse = false;
-				callback(file_name, file_stat, control);
-				if (control.halt)
-					return false;
-			}
+		for_each_control_t control;
+		control.halt = false;
+		control.recurse = false;
+		callback(full_name, file_stat, control);
+		if (control.halt || (file_stat.is_dir && control.recurse && !for_each_file(full_name, callback)))
+		{
+			completed = false;
+			break;
 		}
-		closedir(stDirIn);
 	}
-	else
-	{
-        dlog(log_error, "for_each_file - failed opening %s as a directory\n", szDirectory);
-    }
-    return true;
+
+	closedir(dir_stream);
+	return completed;
 }
 
+typedef std::function<void(const std::string &path, const for_each_file_stat_t &file_stat,
+		for_each_control_t &control)> for_each_file_callback_t;
 
+/* for_each_file on a thread pool. every directory is a task, and the
+ * subdirectories the callback asks to recurse into are queued as they are
+ * found, so callback runs concurrently and in no particular order. a halt
+ * stops the walk once the running tasks notice it, and makes this return
+ * false. blocks until the walk is over. called from one of pool's own
+ * tasks it walks on that thread instead. */
+bool for_each_file_parallel(
+		const std::string &dir,
+		const for_each_file_callback_t &callback,
+		thread_pool_t &pool = thread_pool_t::shared());
@@ -0,0 +1,273 @@
+#include "dns_cache.h"
+#include <uv.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <utility>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "unordered.h"
+#include "logger_decls.h"
+#include "loop_monitor.h"
+
+static int dns_positive_ttl_ms = 60 * 1000;
+static int dns_negative_ttl_ms = 5 * 1000;
+
+struct dns_waiter_t
+{
+	int port;
+	dns_callback_t callback;
+};
+
+struct dns_entry_t
+{
+	enum state_t
+	{
+		resolving,
+		resolved,
+		failed,
+	};
+
+	state_t state = resolving;
+	bool pinned = false;
+	int64_t expires = 0;
+	dns_addresses_t addresses;
+	std::vector<dns_waiter_t> waiters;
+};
+
+static unordered_map<std::string, dns_entry_t> dns_entries;
+
+/* uv_now of the last sweep for expired failures */
+static int64_t dns_last_sweep = 0;
+
+void dns_cache_set_ttl(int positive_ttl_ms, int negative_ttl_ms)
+{
+	dns_positive_ttl_ms = positive_ttl_ms;
+	dns_negative_ttl_ms = negative_ttl_ms;
+}
+
+void dns_cache_clear()
+{
+	/* keep in-flight lookups, their waiters still need answers */
+	for (auto iter = dns_entries.begin(); iter != dns_entries.end();)
+	{
+		if (iter->second.state != dns_entry_t::resolving)
+			iter = dns_entries.erase(iter);
+		else
+			++iter;
+	}
+}
+
+static dns_addresses_t dns_with_port(const dns_addresses_t &addresses, int port)
+{
+	dns_addresses_t result(addresses);
+	for (auto &address : result)
+	{
+		if (address.family == AF_INET)
+			((sockaddr_in *)&address.addr)->sin_port = htons(port);
+		else if (address.family == AF_INET6)
+			((sockaddr_in6 *)&address.addr)->sin6_port = htons(port);
+	}
+	return result;
+}
+
+static bool dns_parse_literal(const std::string &text, dns_address_t &address)
+{
+	memset(&address, 0, sizeof(address));
+
+	auto *addr4 = (sockaddr_in *)&address.addr;
+	if (inet_pton(AF_INET, text.c_str(), &addr4->sin_addr) == 1)
+	{
+		addr4->sin_family = AF_INET;
+		address.family = AF_INET;
+		address.addr_len = sizeof(sockaddr_in);
+		return true;
+	}
+
+	auto *addr6 = (sockaddr_in6 *)&address.addr;
+	if (inet_pton(AF_INET6, text.c_str(), &addr6->sin6_addr) == 1)
+	{
+		addr6->sin6_family = AF_INET6;
+		address.family = AF_INET6;
+		address.addr_len = sizeof(sockaddr_in6);
+		return true;
+	}
+
+	return false;
+}
+
+static void dns_after_getaddrinfo(uv_getaddrinfo_t *gai_req, int status, struct addrinfo *ai)
+{
+	loop_monitor_scope_t scope("dns_after_getaddrinfo");
+	auto *hostname = static_cast<std::string *>(gai_req->data);
+	auto iter = dns_entries.find(*hostname);
+	assert(iter != dns_entries.end());
+	auto &entry = iter->second;
+
+	entry.addresses.clear();
+	if (status >= 0)
+	{
+		for (auto *cur = ai; cur != nullptr; cur = cur->ai_next)
+		{
+			if (cur->ai_family != AF_INET && cur->ai_family != AF_INET6)
+				continue;
+
+			dns_address_t address;
+			memset(&address, 0, sizeof(address));
+			memcpy(&address.addr, cur->ai_addr, cur->ai_addrlen);
+			address.addr_len = cur->ai_addrlen;
+			address.family = cur->ai_family;
+			entry.addresses.push_back(address);
+		}
+	}
+
+	int64_t now = uv_now(uv_default_loop());
+	if (entry.addresses.size() != 0)
+	{
+		entry.state = dns_entry_t::resolved;
+		entry.expires = now + dns_positive_ttl_ms;
+	}
+	else
+	{
+		dlog(log_error, "dns_resolve : getaddrinfo for %s failed\n", hostname->c_str());
+		entry.state = dns_entry_t::failed;
+		entry.expires = now + dns_negative_ttl_ms;
+	}
+
+	/* callbacks may issue new lookups, so detach the waiters first */
+	std::vector<dns_waiter_t> waiters;
+	std::swap(waiters, entry.waiters);
+	int result = (entry.state == dns_entry_t::resolved) ? 0 : -1;
+	dns_addresses_t addresses = entry.addresses;
+
+	if (ai != nullptr)
+		uv_freeaddrinfo(ai);
+	delete hostname;
+	delete gai_req;
+
+	for (auto &waiter : waiters)
+		waiter.callback(result, dns_with_port(addresses, waiter.port));
+}
+
+/* failures are only worth keeping until they expire, and a name that's never
+ * asked for again would otherwise hold its entry forever. swept at most once
+ * per negative ttl, so the walk is paid for by many lookups. */
+static void dns_sweep_failures(int64_t now)
+{
+	if (now - dns_last_sweep < dns_negative_ttl_ms)
+		return;
+	dns_last_sweep = now;
+
+	for (auto iter = dns_entries.begin(); iter != dns_entries.end();)
+	{
+		auto &entry = iter->second;
+		if (entry.state == dns_entry_t::failed && !entry.pinned && now >= entry.expires)
+			iter = dns_entries.erase(iter);
+		else
+			++iter;
+	}
+}
+
+void dns_resolve(const std::string &hostname, int port, dns_callback_t &&callback)
+{
+	dns_address_t literal;
+	if (dns_parse_literal(hostname, literal))
+	{
+		callback(0, dns_with_port(dns_addresses_t(1, literal), port));
+		return;
+	}
+
+	dns_sweep_failures(uv_now(uv_default_loop()));
+
+	auto &entry = dns_entries[hostname];
+	if (entry.state == dns_entry_t::resolving && entry.waiters.size() != 0)
+	{
+		dlog(log_info, "dns_resolve : coalescing lookup of %s\n", hostname.c_str());
+		entry.waiters.push_back({port, std::move(callback)});
+		return;
+	}
+
+	if (entry.state != dns_entry_t::resolving
+			&& (entry.pinned || uv_now(uv_default_loop()) < entry.expires))
+	{
+		if (entry.state == dns_entry_t::resolved)
+			callback(0, dns_with_port(entry.addresses, port));
+		else
+			callback(-1, dns_addresses_t());
+		return;
+	}
+
+	entry.state = dns_entry_t::resolving;
+	entry.waiters.push_back({port, std::move(callback)});
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	uv_getaddrinfo_t *gai_req = new uv_getaddrinfo_t;
+	gai_req->data = new std::string(hostname);
+
+	if (uv_getaddrinfo(uv_default_loop(), gai_req, dns_after_getaddrinfo,
+				hostname.c_str(), nullptr, &hints) != 0)
+	{
+		dlog(log_error, "dns_resolve : uv_getaddrinfo for %s failed to start\n",
+				hostname.c_str());
+		dns_after_getaddrinfo(gai_req, -1, nullptr);
+	}
+}
+
+bool dns_cache_load_hosts_file(const std::string &path)
+{
+	FILE *fp = fopen(path.c_str(), "rt");
+	if (fp == NULL)
+	{
+		dlog(log_warning, "dns_cache_load_hosts_file : couldn't open %s\n", path.c_str());
+		return false;
+	}
+
+	/* a name's addresses are replaced by the first line naming it in this
+	 * load, so loading a file again doesn't pile up duplicates */
+	unordered_set<std::string> loaded;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+
+		char *save = NULL;
+		char *token = strtok_r(line, " \t\r\n", &save);
+		dns_address_t address;
+		if (token == NULL || !dns_parse_literal(token, address))
+			continue;
+
+		while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+		{
+			auto &entry = dns_entries[token];
+			if (entry.state == dns_entry_t::resolving && entry.waiters.size() != 0)
+				continue;
+
+			if (loaded.insert(token).second)
+				entry.addresses.clear();
+			entry.state = dns_entry_t::resolved;
+			entry.pinned = true;
+
+			bool duplicate = false;
+			for (auto &existing : entry.addresses)
+			{
+				if (existing.addr_len == address.addr_len
+						&& memcmp(&existing.addr, &address.addr, address.addr_len) == 0)
+				{
+					duplicate = true;
+					break;
+				}
+			}
+			if (!duplicate)
+				entry.addresses.push_back(address);
+		}
+	}
+	fclose(fp);
+	return true;
+}
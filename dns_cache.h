@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+struct dns_address_t
+{
+	sockaddr_storage addr;
+	socklen_t addr_len;
+	int family;
+};
+
+typedef std::vector<dns_address_t> dns_addresses_t;
+
+/* status is 0 on success, -1 when the name could not be resolved */
+using dns_callback_t = std::function<void(int status, const dns_addresses_t &addresses)>;
+
+/* per-process DNS cache in front of uv_getaddrinfo. Lookups for the same host
+ * that arrive while a resolution is in flight are coalesced onto it. Cached
+ * answers (and failures) are handed back synchronously. */
+void dns_resolve(const std::string &hostname, int port, dns_callback_t &&callback);
+
+void dns_cache_set_ttl(int positive_ttl_ms, int negative_ttl_ms);
+void dns_cache_clear();
+
+/* pins the entries of an /etc/hosts-style file into the cache; they never expire */
+bool dns_cache_load_hosts_file(const std::string &path);
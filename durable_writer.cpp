@@ -0,0 +1,234 @@
+#include "durable_writer.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <algorithm>
+#include "disk.h"
+#include "logger_decls.h"
+
+/* keeps the number of temporaries open at once well under the fd limit */
+const size_t durable_writer_max_batch = 256;
+
+durable_writer_t::durable_writer_t(uv_loop_t *loop, thread_pool_t &pool)
+	: m_loop(loop), m_pool(pool), m_outstanding(0), m_stopping(false), m_next_temp(0), m_batches(0)
+{
+	m_completed_async = new uv_async_t;
+	uv_async_init(m_loop, m_completed_async, on_completed);
+	m_completed_async->data = this;
+
+	/* only keep the loop alive while writes are outstanding */
+	uv_unref((uv_handle_t *)m_completed_async);
+
+	m_writer = std::thread(&durable_writer_t::writer_main, this);
+}
+
+static void durable_writer_async_close(uv_handle_t *handle)
+{
+	delete (uv_async_t *)handle;
+}
+
+durable_writer_t::~durable_writer_t()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_stopping = true;
+	}
+	m_wake.notify_one();
+	m_writer.join();
+
+	deliver();
+	uv_close((uv_handle_t *)m_completed_async, durable_writer_async_close);
+}
+
+void durable_writer_t::write(const std::string &path, std::string &&data, durable_write_callback_t &&callback)
+{
+	write_t *pwrite = new write_t;
+	pwrite->path = path;
+	pwrite->data = std::move(data);
+	pwrite->callback = std::move(callback);
+	pwrite->fd = -1;
+	pwrite->status = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_queued.push_back(pwrite);
+	}
+	m_wake.notify_one();
+
+	if (m_outstanding++ == 0)
+		uv_ref((uv_handle_t *)m_completed_async);
+}
+
+void durable_writer_t::writer_main()
+{
+	std::vector<write_t *> batch;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_wake.wait(lock, [this]() { return m_stopping || !m_queued.empty(); });
+			if (m_queued.empty())
+				break;
+
+			/* everything that arrived while the last batch was syncing */
+			size_t count = std::min(m_queued.size(), durable_writer_max_batch);
+			batch.assign(m_queued.begin(), m_queued.begin() + count);
+			m_queued.erase(m_queued.begin(), m_queued.begin() + count);
+		}
+
+		commit(batch);
+		++m_batches;
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_completed.insert(m_completed.end(), batch.begin(), batch.end());
+		}
+		uv_async_send(m_completed_async);
+		batch.clear();
+	}
+}
+
+static bool durable_writer_write_all(int fd, const std::string &data)
+{
+	const char *pch = data.c_str();
+	size_t left = data.size();
+	while (left != 0)
+	{
+		ssize_t written = ::write(fd, pch, left);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		pch += written;
+		left -= written;
+	}
+	return true;
+}
+
+static bool durable_writer_sync(int fd)
+{
+#ifdef __linux__
+	/* the data and the size, not the timestamps */
+	return fdatasync(fd) == 0;
+#else
+	return fsync(fd) == 0;
+#endif
+}
+
+void durable_writer_t::commit(std::vector<write_t *> &batch)
+{
+	for (write_t *pwrite : batch)
+	{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), m_next_temp++);
+		pwrite->temp = pwrite->path + suffix;
+
+		pwrite->fd = open(pwrite->temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (pwrite->fd == -1 || !durable_writer_write_all(pwrite->fd, pwrite->data))
+		{
+			dlog(log_error, "durable_writer_t : couldn't write %s (%s)\n", pwrite->temp.c_str(), strerror(errno));
+			pwrite->status = -1;
+		}
+	}
+
+	/* the group commit: the whole batch's syncs are in flight at once, so
+	 * the device sees them together instead of one flush after another */
+	std::vector<write_t *> written;
+	for (write_t *pwrite : batch)
+	{
+		if (pwrite->status == 0)
+			written.push_back(pwrite);
+	}
+
+	auto sync = [](write_t *pwrite) {
+		if (!durable_writer_sync(pwrite->fd))
+		{
+			dlog(log_error, "durable_writer_t : couldn't sync %s (%s)\n", pwrite->temp.c_str(), strerror(errno));
+			pwrite->status = -1;
+		}
+	};
+
+	if (written.size() == 1)
+	{
+		/* nothing to overlap with, skip the hand off */
+		sync(written[0]);
+	}
+	else
+	{
+		thread_pool_group_t syncs(m_pool);
+		for (write_t *pwrite : written)
+			syncs.submit([sync, pwrite]() { sync(pwrite); });
+		syncs.wait();
+	}
+
+	std::map<std::string, std::vector<write_t *>> by_directory;
+	for (write_t *pwrite : batch)
+	{
+		if (pwrite->fd != -1)
+		{
+			close(pwrite->fd);
+			pwrite->fd = -1;
+		}
+
+		if (pwrite->status == 0 && rename(pwrite->temp.c_str(), pwrite->path.c_str()) != 0)
+		{
+			dlog(log_error, "durable_writer_t : couldn't rename %s (%s)\n", pwrite->temp.c_str(), strerror(errno));
+			pwrite->status = -1;
+		}
+
+		if (pwrite->status != 0)
+		{
+			unlink(pwrite->temp.c_str());
+			continue;
+		}
+
+		std::string directory = directory_from_file_path(pwrite->path);
+		by_directory[directory.empty() ? "." : directory].push_back(pwrite);
+	}
+
+	/* and one fsync per directory makes the renames stick */
+	for (auto &directory : by_directory)
+	{
+		int dir_fd = open(directory.first.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		bool synced = (dir_fd != -1) && (fsync(dir_fd) == 0);
+		if (dir_fd != -1)
+			close(dir_fd);
+
+		if (!synced)
+		{
+			dlog(log_error, "durable_writer_t : couldn't sync %s\n", directory.first.c_str());
+			for (write_t *pwrite : directory.second)
+				pwrite->status = -1;
+		}
+	}
+}
+
+void durable_writer_t::deliver()
+{
+	std::vector<write_t *> completed;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		completed.swap(m_completed);
+	}
+
+	for (write_t *pwrite : completed)
+	{
+		assert(m_outstanding != 0);
+		if (--m_outstanding == 0)
+			uv_unref((uv_handle_t *)m_completed_async);
+
+		pwrite->callback(pwrite->status);
+		delete pwrite;
+	}
+}
+
+void durable_writer_t::on_completed(uv_async_t *handle, int status)
+{
+	static_cast<durable_writer_t *>(handle->data)->deliver();
+}
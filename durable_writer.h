@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <uv.h>
+#include "nocopy.h"
+#include "thread_pool.h"
+
+/* status is 0 once the file is durably in place, -1 otherwise */
+typedef std::function<void(int status)> durable_write_callback_t;
+
+/* atomic, durable file writes with group commit. each file is written to a
+ * temporary name beside its target, synced, renamed over the target, and
+ * the directory is synced. the writes go to a background thread, which takes
+ * everything queued since its last batch, syncs the batch's files all at
+ * once on pool and pays for one fsync per directory rather than one per
+ * file. callbacks run on the loop. */
+class durable_writer_t
+{
+public:
+	NOCOPY(durable_writer_t);
+	durable_writer_t(uv_loop_t *loop, thread_pool_t &pool = thread_pool_t::shared());
+
+	/* finishes what's queued and runs the outstanding callbacks */
+	~durable_writer_t();
+
+	/* call on the loop's thread */
+	void write(const std::string &path, std::string &&data, durable_write_callback_t &&callback);
+
+	/* batches committed so far, for judging how well writes are grouped */
+	uint64_t batches() const { return m_batches.load(std::memory_order_relaxed); }
+
+private:
+	struct write_t
+	{
+		std::string path;
+		std::string temp;
+		std::string data;
+		durable_write_callback_t callback;
+		int fd;
+		int status;
+	};
+
+	void writer_main();
+	void commit(std::vector<write_t *> &batch);
+	void deliver();
+	static void on_completed(uv_async_t *handle, int status);
+
+	uv_loop_t *m_loop;
+	thread_pool_t &m_pool;
+	uv_async_t *m_completed_async;
+
+	/* written but not yet called back, loop thread only */
+	size_t m_outstanding;
+	std::thread m_writer;
+
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::vector<write_t *> m_queued;
+	std::vector<write_t *> m_completed;
+	bool m_stopping;
+
+	/* writer thread only */
+	unsigned m_next_temp;
+	std::atomic<uint64_t> m_batches;
+};
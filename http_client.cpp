@@ -3,54 +3,168 @@
 #include <uv.h>
 #include <sstream>
 #include <assert.h>
+#include <string.h>
 #include <utility>
+#include <algorithm>
 #include "http.h"
 #include "logger_decls.h"
+#include "slog.h"
 #include "http_parser.h"
 #include "nodecpp_errors.h"
+#include "clock_source.h"
+#include "dns_cache.h"
+#include "tcp_connect.h"
+#include "unordered.h"
+#include "loop_monitor.h"
 
-struct http_fetch_op_t
+/* retries (and hedges) may add at most this fraction of extra load */
+const double retry_budget_ratio = 0.1;
+const double retry_budget_max = 10.0;
+
+/* latencies kept per host for the hedging p95 */
+const size_t latency_history_size = 256;
+const size_t latency_history_min = 20;
+
+static double retry_budget_tokens = retry_budget_max;
+
+static void retry_budget_deposit()
 {
-	http_fetch_op_t(const std::string &hostname, int port, const response_callback_t &&callback);
+	retry_budget_tokens = std::min(retry_budget_max, retry_budget_tokens + retry_budget_ratio);
+}
 
-private:
-	std::string hostname;
-	int port;
+static bool retry_budget_withdraw()
+{
+	if (retry_budget_tokens < 1.0)
+		return false;
+	retry_budget_tokens -= 1.0;
+	return true;
+}
+
+struct latency_history_t
+{
+	std::vector<uint64_t> samples;
+	size_t next = 0;
+
+	void record(uint64_t latency)
+	{
+		if (samples.size() < latency_history_size)
+			samples.push_back(latency);
+		else
+			samples[next] = latency;
+		next = (next + 1) % latency_history_size;
+	}
+
+	/* 0 until there is enough history to trust */
+	uint64_t p95() const
+	{
+		if (samples.size() < latency_history_min)
+			return 0;
+
+		std::vector<uint64_t> sorted(samples);
+		auto nth = sorted.begin() + (sorted.size() * 95) / 100;
+		std::nth_element(sorted.begin(), nth, sorted.end());
+		return *nth;
+	}
+};
+
+static unordered_map<std::string, latency_history_t> latency_histories;
+
+struct http_client_request_t;
+
+/* one attempt at a request over its own connection */
+struct http_fetch_op_t
+{
+	http_fetch_op_t(http_client_request_t *request, const dns_addresses_t &addresses);
+
+	void finish(http_client_error_t error);
+
+	http_client_request_t *request;
+	tcp_connect_race_t *connect_race = nullptr;
+	uv_tcp_t *tcp_handle = nullptr;
+	uv_timer_t timer;
+	int open_handles = 0;
+	bool finished = false;
+	bool message_complete = false;
+	bool parsing_header_value = false;
+	uint64_t start_time;
+	std::string request_blob;
 	http_parser parser;
 	http_client_response_t response;
-	response_callback_t callback;
+
+private:
+	void restart_timer(int timeout);
 
 	static void after_write(uv_write_t *write_req, int status);
 	static void on_close(uv_handle_t *handle);
+	static void on_tcp_close(uv_handle_t *handle);
 	static void on_read(uv_stream_t *tcp_handle, ssize_t nread, uv_buf_t buf);
 	static uv_buf_t on_alloc(uv_handle_t* handle, size_t suggested_size);
-	static void after_connect(uv_connect_t *connect_req, int status);
-	static void after_getaddrinfo(uv_getaddrinfo_t *gai_req, int status, struct addrinfo *ai);
+	static void after_connect(http_fetch_op_t *fetch_op, uv_tcp_t *tcp_handle);
+	static void on_timeout(uv_timer_t *timer, int status);
+};
+
+/* the logical request, owns the deadline and decides on retries and hedges */
+struct http_client_request_t
+{
+	http_client_request_t(const std::string &hostname, int port,
+			const http_client_options_t &options, response_callback_t &&callback);
+
+	void start(int status, const dns_addresses_t &addresses);
+	void launch_attempt();
+	void attempt_finished(http_fetch_op_t *attempt, http_client_error_t error);
+	void complete(const http_client_response_t &response);
 
-	friend void http_get(const std::string &hostname, int port, response_callback_t &&callback);
+	/* drops one of open_handles, deleting the request with the last */
+	void release();
+
+	std::string hostname;
+	int port;
+	http_client_options_t options;
+	response_callback_t callback;
+	dns_addresses_t addresses;
+	std::vector<http_fetch_op_t *> attempts;
+	int retries = 0;
+	bool done = false;
+
+	/* the two timers, and the resolve until it answers */
+	int open_handles = 0;
+	uv_timer_t deadline_timer;
+	uv_timer_t hedge_timer;
+
+	static void on_close(uv_handle_t *handle);
+	static void on_deadline(uv_timer_t *timer, int status);
+	static void on_hedge(uv_timer_t *timer, int status);
 };
 
 static int http_client_url(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	dslog(log_info, "%s : %s\n", __FUNCTION__, log_str(at, length));
 	return 0;
 }
 
 static int http_client_header_field(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	auto fetch_op = static_cast<http_fetch_op_t *>(parser->data);
+	auto &fields = fetch_op->response.fields;
+	if (fetch_op->parsing_header_value || fields.size() == 0)
+		fields.push_back(http_field_t());
+	fields.back().key.append(at, length);
+	fetch_op->parsing_header_value = false;
 	return 0;
 }
 
 static int http_client_header_value(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	auto fetch_op = static_cast<http_fetch_op_t *>(parser->data);
+	assert(fetch_op->response.fields.size() != 0);
+	fetch_op->response.fields.back().value.append(at, length);
+	fetch_op->parsing_header_value = true;
 	return 0;
 }
 
 static int http_client_body(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	static_cast<http_fetch_op_t *>(parser->data)->response.body.append(at, length);
 	return 0;
 }
 
@@ -71,14 +185,20 @@ static int http_client_headers_complete(http_parser *parser)
 {
 	dlog(log_info, "%s : HTTP/%d.%d status = %d\n", __FUNCTION__,
 			parser->http_major, parser->http_minor, parser->status_code);
-	// TODO: handle Transfer-Encoding: chunked
-	return (parser->content_length == 0) ? 1 : 0;
+
+	auto &response = static_cast<http_fetch_op_t *>(parser->data)->response;
+	std::stringstream ss;
+	ss << parser->http_major << "." << parser->http_minor;
+	response.version = ss.str();
+	response.code = parser->status_code;
+	return 0;
 }
 
 static int http_client_message_complete(http_parser *parser)
 {
 	dlog(log_info, "%s : HTTP/%d.%d status = %d\n", __FUNCTION__,
 			parser->http_major, parser->http_minor, parser->status_code);
+	static_cast<http_fetch_op_t *>(parser->data)->message_complete = true;
 	return 0;
 }
 
@@ -95,57 +215,132 @@ static const http_parser_settings parser_settings =
 };
 
 http_fetch_op_t::http_fetch_op_t(
-		const std::string &hostname,
-	   	int port,
-	   	const response_callback_t &&callback)
-: hostname(hostname), port(port), callback(callback)
+		http_client_request_t *request,
+		const dns_addresses_t &addresses)
+: request(request), start_time(clock_fast_ns())
 {
 	http_parser_init(&parser, HTTP_RESPONSE);
+	parser.data = this;
+
+	uv_timer_init(uv_default_loop(), &timer);
+	timer.data = this;
+	open_handles = 1;
+
+	std::stringstream ss;
+	ss << "GET " << request->options.path << " HTTP/1.0\r\n";
+	ss << "Host: " << request->hostname << "\r\n";
+	ss << "\r\n";
+	request_blob = ss.str();
+
+	/* the connect timeout covers the whole race, not each address */
+	restart_timer(request->options.connect_timeout);
+
+	connect_race = tcp_connect(addresses, [this](uv_tcp_t *tcp_handle) {
+		connect_race = nullptr;
+		after_connect(this, tcp_handle);
+	});
+}
+
+void http_fetch_op_t::restart_timer(int timeout)
+{
+	if (timeout > 0)
+		uv_timer_start(&timer, on_timeout, timeout, 0);
+	else
+		uv_timer_stop(&timer);
+}
+
+void http_fetch_op_t::on_timeout(uv_timer_t *timer, int status)
+{
+	auto fetch_op = static_cast<http_fetch_op_t *>(timer->data);
+	dlog(log_warning, "http_fetch_op_t : attempt timed out\n");
+	fetch_op->finish(http_client_timed_out);
+}
+
+void http_fetch_op_t::finish(http_client_error_t error)
+{
+	if (finished)
+		return;
+	finished = true;
+
+	/* the request may have moved on already (deadline, a hedge won) */
+	if (request != nullptr)
+		request->attempt_finished(this, error);
+
+	tcp_connect_cancel(connect_race);
+	connect_race = nullptr;
+
+	uv_timer_stop(&timer);
+	uv_close((uv_handle_t *)&timer, on_close);
+	if (tcp_handle != nullptr)
+		uv_close((uv_handle_t *)tcp_handle, on_tcp_close);
 }
 
 void http_fetch_op_t::after_write(uv_write_t *write_req, int status)
 {
+	loop_monitor_scope_t scope("http_fetch_op_t::after_write");
+	delete write_req;
 }
 
 void http_fetch_op_t::on_close(uv_handle_t *handle)
 {
-	free(handle);
+	auto fetch_op = static_cast<http_fetch_op_t *>(handle->data);
+	if (--fetch_op->open_handles == 0)
+		delete fetch_op;
+}
+
+void http_fetch_op_t::on_tcp_close(uv_handle_t *handle)
+{
+	on_close(handle);
+	delete (uv_tcp_t *)handle;
 }
 
 void http_fetch_op_t::on_read(uv_stream_t *tcp_handle, ssize_t nread, uv_buf_t buf)
 {
+	loop_monitor_scope_t scope("http_fetch_op_t::on_read");
 	auto &fetch_op = *static_cast<http_fetch_op_t *>(tcp_handle->data);
 
 	if (nread < 0)
 	{
 		if (uv_last_error(uv_default_loop()).code == UV_EOF)
 		{
-			/* No more data. Close the connection. */
-			uv_close((uv_handle_t *)tcp_handle, on_close);
-			fetch_op.callback(fetch_op.response);
+			/* No more data. An eof-delimited body ends here. */
+			http_parser_execute(&fetch_op.parser, &parser_settings, nullptr, 0);
+			fetch_op.finish(fetch_op.message_complete
+					? http_client_ok : http_client_io_failed);
 		}
 		else
 		{
 			log_uv_errors();
+			fetch_op.finish(http_client_io_failed);
 		}
 	}
 
-	if (nread > 0)
+	if (nread > 0 && !fetch_op.finished)
 	{
 		auto parsed_count = http_parser_execute(&fetch_op.parser, &parser_settings,
 				buf.base, nread);
 		if (nread != parsed_count)
 		{
 			log_http_errors(&fetch_op.parser);
-			dlog(log_error, "unexpected thing : http_parser_execute only parsed %d/%d bytes! (%s)\n",
+			dlog(log_error, "unexpected thing : http_parser_execute only parsed %zu/%zd bytes! (%s)\n",
 					parsed_count,
 					nread,
 					std::string(buf.base, nread).c_str());
+			fetch_op.finish(http_client_parse_failed);
+		}
+		else if (fetch_op.message_complete)
+		{
+			fetch_op.finish(http_client_ok);
+		}
+		else
+		{
+			fetch_op.restart_timer(fetch_op.request != nullptr
+					? fetch_op.request->options.read_timeout : 0);
 		}
 	}
 
-	dlog(log_info, "--- (freeing %ju)\n", (uintmax_t)(buf.base));
-	delete buf.base;
+	dslog(log_info, "--- (freeing %ju)\n", (uintmax_t)(buf.base));
+	delete[] buf.base;
 }
 
 uv_buf_t http_fetch_op_t::on_alloc(uv_handle_t* handle, size_t suggested_size)
@@ -153,114 +348,234 @@ uv_buf_t http_fetch_op_t::on_alloc(uv_handle_t* handle, size_t suggested_size)
 	uv_buf_t buf;
 	buf.base = new char[suggested_size];
 	buf.len = (buf.base != nullptr) ? suggested_size : 0;
-	dlog(log_info, "on_alloc (allocating %ju)\n", (uintmax_t)(buf.base));
+	dslog(log_info, "on_alloc (allocating %ju)\n", (uintmax_t)(buf.base));
 	return buf;
 }
 
-void http_fetch_op_t::after_connect(uv_connect_t *connect_req, int status)
+void http_fetch_op_t::after_connect(http_fetch_op_t *fetch_op, uv_tcp_t *tcp_handle)
 {
-	if (status < 0)
+	if (tcp_handle == nullptr)
 	{
-		auto fetch_op = static_cast<http_fetch_op_t *>(connect_req->data);
 		dlog(log_error, "connection to %s failed\n",
-				fetch_op->hostname.c_str());
+				fetch_op->request != nullptr ? fetch_op->request->hostname.c_str() : "?");
+		fetch_op->finish(http_client_connect_failed);
+		return;
+	}
 
-		delete fetch_op;
-		delete connect_req;
+	fetch_op->tcp_handle = tcp_handle;
+	tcp_handle->data = fetch_op;
+	++fetch_op->open_handles;
 
+	if (fetch_op->finished)
+	{
+		/* finish ran while the race was reporting in */
+		uv_close((uv_handle_t *)tcp_handle, on_tcp_close);
 		return;
 	}
 
 	uv_write_t *write_req = new uv_write_t;
-	write_req->data = connect_req->data;
-	std::stringstream ss;
-	ss << "GET / HTTP/1.0\r\n";
-	ss << "Host: " << static_cast<http_fetch_op_t *>(connect_req->data)->hostname.c_str();
-	ss << "\r\n\r\n";
-
-	std::string header = ss.str();
+	write_req->data = fetch_op;
 
+	/* request_blob lives as long as the op, which outlives the write */
 	uv_buf_t buf;
-	buf.base = new char[header.size()];
-	memcpy(buf.base, header.c_str(), header.size());
-	buf.len = header.size();
+	buf.base = const_cast<char *>(fetch_op->request_blob.c_str());
+	buf.len = fetch_op->request_blob.size();
 
-	uv_write(write_req, connect_req->handle, &buf, 1, after_write);
+	if (uv_write(write_req, (uv_stream_t *)tcp_handle, &buf, 1, after_write)
+			|| uv_read_start((uv_stream_t *)tcp_handle, on_alloc, on_read))
+	{
+		log_uv_errors();
+		fetch_op->finish(http_client_io_failed);
+		return;
+	}
 
-	delete buf.base;
+	fetch_op->restart_timer(fetch_op->request != nullptr
+			? fetch_op->request->options.read_timeout : 0);
+}
 
-	connect_req->handle->data = write_req->data;
+http_client_request_t::http_client_request_t(
+		const std::string &hostname,
+		int port,
+		const http_client_options_t &options,
+		response_callback_t &&callback)
+	: hostname(hostname), port(port), options(options), callback(std::move(callback))
+{
+	uv_timer_init(uv_default_loop(), &deadline_timer);
+	deadline_timer.data = this;
+	uv_timer_init(uv_default_loop(), &hedge_timer);
+	hedge_timer.data = this;
+	open_handles = 3;
 
-	uv_read_start(connect_req->handle, on_alloc, on_read);
+	if (options.deadline > 0)
+		uv_timer_start(&deadline_timer, on_deadline, options.deadline, 0);
 
-	delete connect_req;
+	retry_budget_deposit();
 }
 
-void http_fetch_op_t::after_getaddrinfo(
-		uv_getaddrinfo_t *gai_req,
-	   	int status,
-	   	struct addrinfo *ai)
+void http_client_request_t::start(int status, const dns_addresses_t &addresses)
 {
-	uv_tcp_t *tcp_handle;
-	uv_connect_t *connect_req;
+	/* the deadline may have completed the request while it resolved, in
+	 * which case this is the last reference. otherwise the timers are
+	 * still open and hold theirs. */
+	bool completed = done;
+	release();
+	if (completed)
+		return;
+
 	if (status < 0)
 	{
-		uv_freeaddrinfo(ai);
+		dlog(log_error, "resolving %s failed\n", hostname.c_str());
+		http_client_response_t response;
+		response.error = http_client_resolve_failed;
+		complete(response);
+		return;
+	}
 
-		auto fetch_op = static_cast<http_fetch_op_t *>(gai_req->data);
-		dlog(log_error, "getaddrinfo to %s failed\n",
-				fetch_op->hostname.c_str());
+	assert(addresses.size() != 0);
+	this->addresses = addresses;
+	launch_attempt();
 
-		delete fetch_op;
-		delete gai_req;
+	if (!done && options.hedge)
+	{
+		std::stringstream ss;
+		ss << hostname << ":" << port;
+		uint64_t p95 = latency_histories[ss.str()].p95();
+		if (p95 != 0)
+		{
+			/* round up to the timer's millisecond resolution */
+			uv_timer_start(&hedge_timer, on_hedge, (p95 + 999999) / 1000000, 0);
+		}
+	}
+}
+
+void http_client_request_t::launch_attempt()
+{
+	auto attempt = new http_fetch_op_t(this, addresses);
+	if (!attempt->finished)
+		attempts.push_back(attempt);
+}
+
+void http_client_request_t::attempt_finished(
+		http_fetch_op_t *attempt,
+		http_client_error_t error)
+{
+	attempt->request = nullptr;
+	auto iter = std::find(attempts.begin(), attempts.end(), attempt);
+	if (iter != attempts.end())
+		attempts.erase(iter);
+
+	if (done)
+		return;
+
+	bool server_error = (error == http_client_ok)
+		&& (attempt->response.code == 502
+				|| attempt->response.code == 503
+				|| attempt->response.code == 504);
 
+	if (error == http_client_ok && !server_error)
+	{
+		std::stringstream ss;
+		ss << hostname << ":" << port;
+		latency_histories[ss.str()].record(clock_fast_ns() - attempt->start_time);
+
+		complete(attempt->response);
 		return;
 	}
 
-	tcp_handle = new uv_tcp_t;
-	uv_tcp_init(uv_default_loop(), tcp_handle);
+	if (attempts.size() != 0)
+	{
+		/* a hedged twin is still in flight, let it have its chance */
+		return;
+	}
 
-	connect_req = new uv_connect_t;
-	connect_req->data = gai_req->data;
-	status = uv_tcp_connect(connect_req,
-			tcp_handle,
-			*(struct sockaddr_in *)ai->ai_addr,
-			after_connect);
-	if (status < 0)
+	if (retries < options.max_retries && retry_budget_withdraw())
 	{
-		// HACKHACK: should actually interpret sa_family and choose correct
-		// function in the first place
-		status = uv_tcp_connect(connect_req,
-				tcp_handle,
-				*(struct sockaddr_in *)ai->ai_addr,
-				after_connect);
-		if (status < 0)
-		{
-			dlog(log_error, "error %d in uv_tcp_connect\n", status);
-		}
+		dlog(log_warning, "http_get : retrying request to %s\n", hostname.c_str());
+		++retries;
+		launch_attempt();
+		return;
+	}
+
+	http_client_response_t response(attempt->response);
+	response.error = error;
+	complete(response);
+}
+
+void http_client_request_t::complete(const http_client_response_t &response)
+{
+	assert(!done);
+	done = true;
+
+	/* losing attempts finish on their own time, but must not call back */
+	auto losers = attempts;
+	attempts.clear();
+	for (auto attempt : losers)
+	{
+		attempt->request = nullptr;
+		attempt->finish(http_client_timed_out);
+	}
+
+	uv_timer_stop(&deadline_timer);
+	uv_timer_stop(&hedge_timer);
+
+	callback(response);
+
+	uv_close((uv_handle_t *)&deadline_timer, on_close);
+	uv_close((uv_handle_t *)&hedge_timer, on_close);
+}
+
+void http_client_request_t::release()
+{
+	if (--open_handles == 0)
+		delete this;
+}
+
+void http_client_request_t::on_close(uv_handle_t *handle)
+{
+	static_cast<http_client_request_t *>(handle->data)->release();
+}
+
+void http_client_request_t::on_deadline(uv_timer_t *timer, int status)
+{
+	auto request = static_cast<http_client_request_t *>(timer->data);
+	dlog(log_warning, "http_get : request to %s passed its deadline\n",
+			request->hostname.c_str());
+
+	http_client_response_t response;
+	response.error = http_client_timed_out;
+	request->complete(response);
+}
+
+void http_client_request_t::on_hedge(uv_timer_t *timer, int status)
+{
+	auto request = static_cast<http_client_request_t *>(timer->data);
+	if (request->done || request->attempts.size() != 1)
+		return;
+
+	if (retry_budget_withdraw())
+	{
+		dlog(log_info, "http_get : hedging request to %s\n", request->hostname.c_str());
+		request->launch_attempt();
 	}
-	delete gai_req;
-	uv_freeaddrinfo(ai);
 }
 
 void http_get(
 		const std::string &hostname,
 	   	int port,
-		std::function<void(const http_client_response_t &)> &&callback)
+		const http_client_options_t &options,
+		response_callback_t &&callback)
 {
-	http_fetch_op_t *http_fetch_op = new http_fetch_op_t(hostname, port, std::move(callback));
-
-	uv_getaddrinfo_t *gai_req = new uv_getaddrinfo_t;
-	gai_req->data = http_fetch_op;
+	auto request = new http_client_request_t(hostname, port, options, std::move(callback));
 
-	std::stringstream ss;
-	ss << port;
-
-	uv_getaddrinfo(uv_default_loop(),
-			gai_req,
-			http_fetch_op_t::after_getaddrinfo,
-			hostname.c_str(),
-			ss.str().c_str(),
-			NULL);
+	dns_resolve(hostname, port, [request](int status, const dns_addresses_t &addresses) {
+		request->start(status, addresses);
+	});
+}
 
+void http_get(
+		const std::string &hostname,
+	   	int port,
+		response_callback_t &&callback)
+{
+	http_get(hostname, port, http_client_options_t(), std::move(callback));
 }
@@ -3,22 +3,47 @@
 #include "http_request.h"
 #include <vector>
 
-struct http_field_t
+enum http_client_error_t
 {
-	std::string key;
-	std::string value;
+	http_client_ok = 0,
+	http_client_resolve_failed,
+	http_client_connect_failed,
+	http_client_io_failed,
+	http_client_parse_failed,
+	http_client_timed_out,
 };
 
 struct http_client_response_t
 {
 	std::string version;
-	int code;
+	int code = 0;
 	std::string reason;
 	std::vector<http_field_t> fields;
+	std::string body;
+
+	/* the callback is always called exactly once, check this first */
+	http_client_error_t error = http_client_ok;
+};
+
+struct http_client_options_t
+{
+	std::string path = "/";
+
+	/* all timeouts are in milliseconds, 0 disables them */
+	int connect_timeout = 2000;
+	int read_timeout = 10000;
+	int deadline = 30000;
+
+	/* retries are also bounded by a process-wide retry budget */
+	int max_retries = 2;
+
+	/* once the host has a latency history, send a duplicate request if the
+	 * first hasn't answered within its p95 and take whichever wins */
+	bool hedge = false;
 };
 
 using response_callback_t = std::function<void(const http_client_response_t &)>;
 
 /* nodecpp as client API */
 void http_get(const std::string &hostname, int port, response_callback_t &&callback);
-
+void http_get(const std::string &hostname, int port, const http_client_options_t &options, response_callback_t &&callback);
@@ -1,8 +1,10 @@
 #include "http_connection.h"
 #include "logger_decls.h"
+#include "slog.h"
 #include <assert.h>
 #include <uv.h>
 #include "nodecpp_errors.h"
+#include "clock_source.h"
 #include <sstream>
 #include "http_server.h"
 
@@ -18,10 +20,12 @@ http_connection_t::http_connection_t(uv_stream_t *client_handle) : client_handle
 
 std::shared_ptr<http_request_t> http_connection_t::pop_request()
 {
-	dlog(log_warning, "%s called on [%d]\n", __FUNCTION__, instance_id);
+	dlog(log_info, "%s called on [%d]\n", __FUNCTION__, instance_id);
 	reset_parser();
 	std::shared_ptr<http_request_t> top_request;
 	std::swap(top_request, request_being_created);
+	if (top_request != nullptr)
+		top_request->http_minor = parser.http_minor;
 	return top_request;
 }
 
@@ -31,10 +35,45 @@ void http_connection_t::reset_parser()
 	parser.data = this;
 }
 
+void http_connection_t::begin_message()
+{
+	message_start = clock_fast_ns();
+}
+
 void http_connection_t::start_request(http_method method, const std::string &target_uri)
 {
-	dlog(log_warning, "%s called on [%d]\n", __FUNCTION__, instance_id);
+	dlog(log_info, "%s called on [%d]\n", __FUNCTION__, instance_id);
 	request_being_created.reset(new http_request_t(method, target_uri));
+	request_being_created->start_time = message_start;
+	parsing_header_value = false;
+}
+
+void http_connection_t::add_header_field(const char *at, size_t length)
+{
+	assert(request_being_created != nullptr);
+
+	/* http_parser may hand us a field in several pieces */
+	auto &fields = request_being_created->fields;
+	if (parsing_header_value || fields.size() == 0)
+		fields.push_back(http_field_t());
+
+	fields.back().key.append(at, length);
+	parsing_header_value = false;
+}
+
+void http_connection_t::add_header_value(const char *at, size_t length)
+{
+	assert(request_being_created != nullptr);
+	assert(request_being_created->fields.size() != 0);
+
+	request_being_created->fields.back().value.append(at, length);
+	parsing_header_value = true;
+}
+
+void http_connection_t::add_body(const char *at, size_t length)
+{
+	assert(request_being_created != nullptr);
+	request_being_created->_body.append(at, length);
 }
 
 static int http_connection_url(http_parser *parser, const char *at, size_t length)
@@ -43,31 +82,35 @@ static int http_connection_url(http_parser *parser, const char *at, size_t lengt
 	connection->start_request((http_method)parser->method,
 			std::string(at, length));
 
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	dslog(log_info, "%s : %s\n", __FUNCTION__, log_str(at, length));
 	return 0;
 }
 
 static int http_connection_header_field(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	dslog(log_info, "%s : %s\n", __FUNCTION__, log_str(at, length));
+	((http_connection_t *)parser->data)->add_header_field(at, length);
 	return 0;
 }
 
 static int http_connection_header_value(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	dslog(log_info, "%s : %s\n", __FUNCTION__, log_str(at, length));
+	((http_connection_t *)parser->data)->add_header_value(at, length);
 	return 0;
 }
 
 static int http_connection_body(http_parser *parser, const char *at, size_t length)
 {
-	dlog(log_info, "%s : %s\n", __FUNCTION__, std::string(at, length).c_str());
+	dslog(log_info, "%s : %s\n", __FUNCTION__, log_str(at, length));
+	((http_connection_t *)parser->data)->add_body(at, length);
 	return 0;
 }
 
 static int http_connection_message_begin(http_parser *parser)
 {
 	dlog(log_info, "%s\n", __FUNCTION__);
+	((http_connection_t *)parser->data)->begin_message();
 	return 0;
 }
 
@@ -113,7 +156,7 @@ void http_connection_t::parse_http(const char *buf, int nread)
 	auto parsed_count = http_parser_execute(&parser, &parser_settings, buf, nread);
 	if (nread != parsed_count)
 	{
-		dlog(log_error, "unexpected thing : http_parser_execute only parsed %d/%d bytes! (%s)\n",
+		dlog(log_error, "unexpected thing : http_parser_execute only parsed %zu/%d bytes! (%s)\n",
 				parsed_count, nread, std::string(buf, nread).c_str());
 
 		/* avoid trying to read or write anything, this socket is messed up */
@@ -127,6 +170,25 @@ http_connection_t::~http_connection_t()
 	assert(client_handle == nullptr);
 }
 
+const std::string &http_connection_t::peer_name()
+{
+	if (!peer.empty() || client_handle == nullptr)
+		return peer;
+
+	sockaddr_storage addr;
+	int addr_len = sizeof(addr);
+	char name[INET6_ADDRSTRLEN] = "";
+	if (uv_tcp_getpeername((uv_tcp_t *)client_handle, (sockaddr *)&addr, &addr_len) == 0)
+	{
+		if (addr.ss_family == AF_INET6)
+			uv_ip6_name((sockaddr_in6 *)&addr, name, sizeof(name));
+		else
+			uv_ip4_name((sockaddr_in *)&addr, name, sizeof(name));
+	}
+	peer = name;
+	return peer;
+}
+
 struct http_connection_write_data_t
 {
 	NOCOPY(http_connection_write_data_t);
@@ -135,8 +197,10 @@ struct http_connection_write_data_t
 	http_connection_write_data_t(
 			const http_connection_ptr_t &connection,
 		   	const std::string &payload,
-			bool close_after_write)
-	   	: connection(connection), payload(payload), close_after_write(close_after_write)
+			bool close_after_write,
+			http_write_callback_t &&write_callback)
+	   	: connection(connection), payload(payload), close_after_write(close_after_write),
+		write_callback(std::move(write_callback))
 	{
 	}
 
@@ -147,6 +211,7 @@ struct http_connection_write_data_t
 	http_connection_ptr_t connection;
 	std::string payload;
 	bool close_after_write = false;
+	http_write_callback_t write_callback;
 };
 
 void http_connection_t::http_connection_write_cb(uv_write_t *req, int status)
@@ -171,13 +236,19 @@ void http_connection_t::http_connection_write_cb(uv_write_t *req, int status)
 
 	assert(connection != nullptr);
 
+	if (connection->last_write == write_data)
+		connection->last_write = nullptr;
+
+	if (write_data->write_callback != nullptr)
+		write_data->write_callback(status);
+
 	if ((connection->client_handle != nullptr)
 		   	&& !uv_is_closing((uv_handle_t *)connection->client_handle))
 	{
 		if (close_after_write)
 		{
 			/* we're done with this connection, make sure to close it */
-			dlog(log_warning, "%s closing socket %ju [%d] after writing %s\n",
+			dlog(log_info, "%s closing socket %ju [%d] after writing %s\n",
 					__FUNCTION__, uintmax_t(connection->client_handle),
 					(int)connection->instance_id,
 					ellipsis(write_data->payload, 10).c_str());
@@ -212,7 +283,7 @@ void http_connection_t::service_next_request()
 {
 	if (!request_queue.empty())
 	{
-		dlog(log_warning, "%s : request queue not empty\n", __FUNCTION__);
+		dlog(log_info, "%s : request queue not empty\n", __FUNCTION__);
 		auto request = request_queue.front();
 		request_queue.pop();
 		http_server_dispatch(shared_from_this(), request);
@@ -223,7 +294,7 @@ void http_connection_t::queue_request(const http_request_ptr_t &request)
 {
 	if (request_queue.empty())
 	{
-		dlog(log_warning, "%s : dispatching\n", __FUNCTION__);
+		dlog(log_info, "%s : dispatching\n", __FUNCTION__);
 		http_server_dispatch(shared_from_this(), request);
 	}
 	else
@@ -234,7 +305,8 @@ void http_connection_t::queue_request(const http_request_ptr_t &request)
 
 void http_connection_t::queue_write(
 		const std::string &write_blob,
-	   	bool close_after_write)
+	   	bool close_after_write,
+		http_write_callback_t &&write_callback)
 {
 	if (client_handle != nullptr)
 	{
@@ -244,7 +316,8 @@ void http_connection_t::queue_write(
 		uv_write_t *write_req = new uv_write_t;
 
 		/* create a new data nugget for the write request */
-		auto *write_data = new http_connection_write_data_t(shared_from_this(), write_blob, close_after_write);
+		auto *write_data = new http_connection_write_data_t(shared_from_this(), write_blob,
+				close_after_write, std::move(write_callback));
 		write_req->data = write_data;
 
 		/* create pointers to the data nugget */
@@ -256,12 +329,48 @@ void http_connection_t::queue_write(
 		if (uv_write(write_req, client_handle, &buf, 1 /*bufcnt*/,
 					http_connection_write_cb))
 		{
+			/* libuv won't call back for a write it refused */
 			log_uv_errors();
+			auto callback = std::move(write_data->write_callback);
+			delete write_data;
+			delete write_req;
+			if (callback != nullptr)
+				callback(-1);
+		}
+		else
+		{
+			last_write = write_data;
 		}
 	}
 	else
 	{
 		dlog(log_warning, "%s attempt to write to null client_handle\n", __FUNCTION__);
+		if (write_callback != nullptr)
+			write_callback(-1);
+	}
+}
+
+void http_connection_t::after_writes(http_write_callback_t &&callback)
+{
+	if (last_write == nullptr)
+	{
+		callback(0);
+		return;
+	}
+
+	/* writes complete in order, so riding on the last one covers them all */
+	if (last_write->write_callback == nullptr)
+	{
+		last_write->write_callback = std::move(callback);
+	}
+	else
+	{
+		auto first = std::move(last_write->write_callback);
+		auto then = std::move(callback);
+		last_write->write_callback = [first, then](int status) {
+			first(status);
+			then(status);
+		};
 	}
 }
 
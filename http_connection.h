@@ -7,6 +7,12 @@
 #include <uv.h>
 #include "utils.h"
 #include <queue>
+#include <functional>
+
+/* invoked once libuv is done with a queued write, status is 0 on success */
+using http_write_callback_t = std::function<void(int status)>;
+
+struct http_connection_write_data_t;
 
 /* a server/client connection - in memory on the server */
 struct http_connection_t : public std::enable_shared_from_this<http_connection_t>, public static_count<http_connection_t>
@@ -16,22 +22,39 @@ struct http_connection_t : public std::enable_shared_from_this<http_connection_t
 	~http_connection_t();
 
 	/* request API */
+	void begin_message();
 	void start_request(http_method method, const std::string &target_uri);
+	void add_header_field(const char *at, size_t length);
+	void add_header_value(const char *at, size_t length);
+	void add_body(const char *at, size_t length);
 	void parse_http(const char *buf, int nread);
 	http_request_ptr_t pop_request();
 
 	uv_stream_t *client_handle;
 
+	/* the client's address, looked up once per connection */
+	const std::string &peer_name();
+
 	void request_completed();
 	void queue_request(const http_request_ptr_t &request);
-	void queue_write(const std::string &write_blob, bool close_after_write);
+	void queue_write(const std::string &write_blob, bool close_after_write,
+			http_write_callback_t &&write_callback = nullptr);
+	/* runs callback once every write queued so far has completed, with the
+	 * status of the last one. if nothing is in flight it runs right away */
+	void after_writes(http_write_callback_t &&callback);
 
 private:
 	http_parser parser;
 
 	/* request is currently being built up */
 	http_request_ptr_t request_being_created;
+	bool parsing_header_value = false;
+	uint64_t message_start = 0;
 	std::queue<http_request_ptr_t> request_queue;
+	std::string peer;
+
+	/* the most recently queued write until libuv finishes it */
+	http_connection_write_data_t *last_write = nullptr;
 
 	void reset_parser();
 	void service_next_request();
@@ -0,0 +1,302 @@
+#include "http_metrics.h"
+#include "http_server.h"
+#include "clock_cache.h"
+#include "logger_decls.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <memory>
+
+/* bucket i < 8 holds i ns. above that, bucket (e - 2) * 8 + s holds the
+ * values whose top bit is 2^e and next three bits are s. latencies are
+ * capped at 2^40ns, about 18 minutes. */
+const int http_metrics_max_exponent = 40;
+const size_t http_metrics_buckets = (http_metrics_max_exponent - 2) * 8 + 8;
+
+/* 1xx to 5xx, and anything else */
+const size_t http_metrics_classes = 6;
+static const char *http_metrics_class_names[http_metrics_classes] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+
+static inline size_t http_metrics_bucket(uint64_t ns)
+{
+	if (ns < 8)
+		return (size_t)ns;
+
+	int exponent = 63 - __builtin_clzll(ns);
+	if (exponent > http_metrics_max_exponent)
+		return http_metrics_buckets - 1;
+	return (exponent - 2) * 8 + ((ns >> (exponent - 3)) & 7);
+}
+
+/* the smallest value that lands in the bucket after this one */
+static uint64_t http_metrics_bucket_end(size_t bucket)
+{
+	if (bucket < 8)
+		return bucket + 1;
+
+	int exponent = (int)(bucket / 8) + 2;
+	uint64_t sub_bucket = bucket % 8;
+	return ((uint64_t)1 << exponent) + ((sub_bucket + 1) << (exponent - 3));
+}
+
+/* one thread's view of one route and status class. only the owning thread
+ * writes, scrapes read, so counters are bumped with a relaxed load and
+ * store rather than a locked add. */
+struct http_metrics_counts_t
+{
+	std::atomic<uint64_t> requests;
+	std::atomic<uint64_t> latency_ns;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> buckets[http_metrics_buckets];
+};
+
+static inline void http_metrics_bump(std::atomic<uint64_t> &counter, uint64_t amount)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+struct http_metrics_shard_t
+{
+	/* made the first time the thread records against them */
+	std::atomic<http_metrics_counts_t *> counts[http_metrics_max_routes][http_metrics_classes];
+};
+
+/* shards are kept after their threads exit, so nothing recorded is lost */
+static std::mutex s_http_metrics_lock;
+static std::vector<http_metrics_shard_t *> s_http_metrics_shards;
+static std::vector<std::string> s_http_metrics_routes = { "(unmatched)" };
+static thread_local http_metrics_shard_t *t_http_metrics_shard = nullptr;
+
+unsigned http_metrics_route_id(const std::string &path)
+{
+	std::lock_guard<std::mutex> guard(s_http_metrics_lock);
+	for (unsigned route_id = 0; route_id < s_http_metrics_routes.size(); ++route_id)
+	{
+		if (s_http_metrics_routes[route_id] == path)
+			return route_id;
+	}
+
+	if (s_http_metrics_routes.size() == http_metrics_max_routes - 1)
+		s_http_metrics_routes.push_back("(other)");
+	if (s_http_metrics_routes.size() == http_metrics_max_routes)
+	{
+		dlog(log_warning, "http_metrics_route_id : %s is counted as (other)\n", path.c_str());
+		return http_metrics_max_routes - 1;
+	}
+
+	s_http_metrics_routes.push_back(path);
+	return (unsigned)s_http_metrics_routes.size() - 1;
+}
+
+static http_metrics_shard_t *http_metrics_shard_create()
+{
+	http_metrics_shard_t *shard = new http_metrics_shard_t();
+	for (auto &route : shard->counts)
+	{
+		for (auto &counts : route)
+			counts.store(nullptr, std::memory_order_relaxed);
+	}
+
+	std::lock_guard<std::mutex> guard(s_http_metrics_lock);
+	s_http_metrics_shards.push_back(shard);
+	t_http_metrics_shard = shard;
+	return shard;
+}
+
+void http_metrics_record(unsigned route_id, int status, uint64_t latency_ns, uint64_t bytes)
+{
+	http_metrics_shard_t *shard = t_http_metrics_shard;
+	if (shard == nullptr)
+		shard = http_metrics_shard_create();
+
+	size_t status_class = (status >= 100 && status < 600) ? status / 100 : 0;
+	auto &slot = shard->counts[route_id < http_metrics_max_routes ? route_id : http_metrics_max_routes - 1][status_class];
+	http_metrics_counts_t *counts = slot.load(std::memory_order_relaxed);
+	if (counts == nullptr)
+	{
+		counts = new http_metrics_counts_t();
+		slot.store(counts, std::memory_order_release);
+	}
+
+	http_metrics_bump(counts->requests, 1);
+	http_metrics_bump(counts->latency_ns, latency_ns);
+	http_metrics_bump(counts->bytes, bytes);
+	http_metrics_bump(counts->buckets[http_metrics_bucket(latency_ns)], 1);
+}
+
+/* every shard's counts for one route and status class added up */
+struct http_metrics_merged_t
+{
+	uint64_t requests = 0;
+	uint64_t latency_ns = 0;
+	uint64_t bytes = 0;
+	std::vector<uint64_t> buckets = std::vector<uint64_t>(http_metrics_buckets);
+};
+
+/* the upper end of the bucket holding the quantile'th request */
+static uint64_t http_metrics_quantile(const http_metrics_merged_t &merged, double quantile)
+{
+	uint64_t rank = (uint64_t)(quantile * (merged.requests - 1));
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < http_metrics_buckets; ++bucket)
+	{
+		seen += merged.buckets[bucket];
+		if (seen > rank)
+			return http_metrics_bucket_end(bucket) - 1;
+	}
+	return http_metrics_bucket_end(http_metrics_buckets - 1) - 1;
+}
+
+/* the Prometheus buckets, in seconds */
+static const double http_metrics_le[] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+static const double http_metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void http_metrics_append(std::string &text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void http_metrics_append(std::string &text, const char *format, ...)
+{
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length > 0)
+		text.append(line, std::min((size_t)length, sizeof(line) - 1));
+}
+
+std::string http_metrics_render()
+{
+	std::vector<std::string> routes;
+	std::vector<http_metrics_shard_t *> shards;
+	{
+		std::lock_guard<std::mutex> guard(s_http_metrics_lock);
+		routes = s_http_metrics_routes;
+		shards = s_http_metrics_shards;
+	}
+
+	std::vector<http_metrics_merged_t> merged(routes.size() * http_metrics_classes);
+	for (auto shard : shards)
+	{
+		for (size_t route_id = 0; route_id < routes.size(); ++route_id)
+		{
+			for (size_t status_class = 0; status_class < http_metrics_classes; ++status_class)
+			{
+				const http_metrics_counts_t *counts =
+					shard->counts[route_id][status_class].load(std::memory_order_acquire);
+				if (counts == nullptr)
+					continue;
+
+				auto &into = merged[route_id * http_metrics_classes + status_class];
+				into.requests += counts->requests.load(std::memory_order_relaxed);
+				into.latency_ns += counts->latency_ns.load(std::memory_order_relaxed);
+				into.bytes += counts->bytes.load(std::memory_order_relaxed);
+				for (size_t bucket = 0; bucket < http_metrics_buckets; ++bucket)
+					into.buckets[bucket] += counts->buckets[bucket].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	std::string text;
+	text += "# HELP http_requests_total Requests answered, by route and status class.\n"
+		"# TYPE http_requests_total counter\n";
+	for (size_t i = 0; i < merged.size(); ++i)
+	{
+		if (merged[i].requests == 0)
+			continue;
+		http_metrics_append(text, "http_requests_total{route=\"%s\",status=\"%s\"} %llu\n",
+				routes[i / http_metrics_classes].c_str(), http_metrics_class_names[i % http_metrics_classes],
+				(unsigned long long)merged[i].requests);
+	}
+
+	text += "# HELP http_response_bytes_total Response body bytes written, by route and status class.\n"
+		"# TYPE http_response_bytes_total counter\n";
+	for (size_t i = 0; i < merged.size(); ++i)
+	{
+		if (merged[i].requests == 0)
+			continue;
+		http_metrics_append(text, "http_response_bytes_total{route=\"%s\",status=\"%s\"} %llu\n",
+				routes[i / http_metrics_classes].c_str(), http_metrics_class_names[i % http_metrics_classes],
+				(unsigned long long)merged[i].bytes);
+	}
+
+	/* a request counts towards every le at or above the top of its bucket,
+	 * so the figures are exact to within a bucket's 12.5% */
+	text += "# HELP http_request_duration_seconds From the first byte of a request parsed to the last byte of its response written.\n"
+		"# TYPE http_request_duration_seconds histogram\n";
+	for (size_t i = 0; i < merged.size(); ++i)
+	{
+		auto &entry = merged[i];
+		if (entry.requests == 0)
+			continue;
+
+		const char *route = routes[i / http_metrics_classes].c_str();
+		const char *status_class = http_metrics_class_names[i % http_metrics_classes];
+		uint64_t cumulative = 0;
+		size_t bucket = 0;
+		for (double le : http_metrics_le)
+		{
+			uint64_t le_ns = (uint64_t)(le * 1e9);
+			for (; bucket < http_metrics_buckets && http_metrics_bucket_end(bucket) - 1 <= le_ns; ++bucket)
+				cumulative += entry.buckets[bucket];
+			http_metrics_append(text, "http_request_duration_seconds_bucket{route=\"%s\",status=\"%s\",le=\"%g\"} %llu\n",
+					route, status_class, le, (unsigned long long)cumulative);
+		}
+		http_metrics_append(text, "http_request_duration_seconds_bucket{route=\"%s\",status=\"%s\",le=\"+Inf\"} %llu\n",
+				route, status_class, (unsigned long long)entry.requests);
+		http_metrics_append(text, "http_request_duration_seconds_sum{route=\"%s\",status=\"%s\"} %.9f\n",
+				route, status_class, entry.latency_ns / 1e9);
+		http_metrics_append(text, "http_request_duration_seconds_count{route=\"%s\",status=\"%s\"} %llu\n",
+				route, status_class, (unsigned long long)entry.requests);
+	}
+
+	text += "# HELP http_request_latency_seconds Latency quantiles from the same histograms.\n"
+		"# TYPE http_request_latency_seconds summary\n";
+	for (size_t i = 0; i < merged.size(); ++i)
+	{
+		auto &entry = merged[i];
+		if (entry.requests == 0)
+			continue;
+
+		const char *route = routes[i / http_metrics_classes].c_str();
+		const char *status_class = http_metrics_class_names[i % http_metrics_classes];
+		for (double quantile : http_metrics_quantiles)
+		{
+			http_metrics_append(text, "http_request_latency_seconds{route=\"%s\",status=\"%s\",quantile=\"%g\"} %.9f\n",
+					route, status_class, quantile, http_metrics_quantile(entry, quantile) / 1e9);
+		}
+		http_metrics_append(text, "http_request_latency_seconds_sum{route=\"%s\",status=\"%s\"} %.9f\n",
+				route, status_class, entry.latency_ns / 1e9);
+		http_metrics_append(text, "http_request_latency_seconds_count{route=\"%s\",status=\"%s\"} %llu\n",
+				route, status_class, (unsigned long long)entry.requests);
+	}
+	return text;
+}
+
+void http_metrics_serve(const std::string &path)
+{
+	struct rendered_t
+	{
+		std::string text;
+		uint64_t rendered_ns = 0;
+		bool valid = false;
+	};
+	auto rendered = std::make_shared<rendered_t>();
+
+	http_use_route(path, HTTP_GET, [rendered](const http_request_ptr_t &request, const http_response_ptr_t &response) {
+		uint64_t now_ns = clock_cache_monotonic_ns();
+		if (!rendered->valid || now_ns - rendered->rendered_ns >= http_metrics_render_ms * 1000000ull)
+		{
+			rendered->text = http_metrics_render();
+			rendered->rendered_ns = now_ns;
+			rendered->valid = true;
+		}
+
+		response->set_response(200, "OK", "text/plain; version=0.0.4");
+		response->send(rendered->text);
+		response->end();
+	});
+}
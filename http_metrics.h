@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+/* request counts and latency histograms per route and status class, kept
+ * per thread and merged when scraped.
+ *
+ * latencies go into log-linear buckets, HDR style: exact below 8ns, then 8
+ * linear steps per power of two, so any bucket is within 12.5% of the
+ * values in it. each recording thread has its own counters, which only it
+ * writes, so recording is a handful of plain loads and stores. */
+
+/* the id to record requests against path under, registered on first use.
+ * past http_metrics_max_routes routes, the rest share one id. */
+const unsigned http_metrics_max_routes = 64;
+unsigned http_metrics_route_id(const std::string &path);
+
+/* for requests that didn't match a route */
+const unsigned http_metrics_unmatched = 0;
+
+void http_metrics_record(unsigned route_id, int status, uint64_t latency_ns, uint64_t bytes);
+
+/* everything recorded so far, in the Prometheus text format */
+std::string http_metrics_render();
+
+/* serves http_metrics_render at path. the rendered text is kept and reused
+ * for http_metrics_render_ms, so frequent scrapes don't redo the merge. */
+const int http_metrics_render_ms = 1000;
+void http_metrics_serve(const std::string &path);
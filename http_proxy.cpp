@@ -0,0 +1,793 @@
+#include "http_proxy.h"
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sstream>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "http_connection.h"
+#include "logger_decls.h"
+#include "nodecpp_errors.h"
+#include "access_log.h"
+#include "clock_source.h"
+#include "http_metrics.h"
+#include "loop_monitor.h"
+
+const size_t proxy_buffer_size = 64 * 1024;
+const size_t proxy_max_pooled_buffers = 256;
+const size_t proxy_max_pending_writes = 16;
+const size_t proxy_max_head_size = 64 * 1024;
+const int proxy_splice_rounds = 16;
+
+static std::vector<char *> proxy_buffer_pool;
+
+static char *proxy_buffer_get()
+{
+	if (proxy_buffer_pool.size() == 0)
+		return new char[proxy_buffer_size];
+
+	char *buffer = proxy_buffer_pool.back();
+	proxy_buffer_pool.pop_back();
+	return buffer;
+}
+
+static void proxy_buffer_put(char *buffer)
+{
+	if (buffer == nullptr)
+		return;
+
+	if (proxy_buffer_pool.size() < proxy_max_pooled_buffers)
+		proxy_buffer_pool.push_back(buffer);
+	else
+		delete[] buffer;
+}
+
+/* libuv 0.10 has no uv_fileno, on unix the descriptor lives in the io watcher */
+static int proxy_stream_fd(uv_stream_t *stream)
+{
+	return stream->io_watcher.fd;
+}
+
+static bool proxy_hop_by_hop(const std::string &key)
+{
+	static const char *hop_by_hop[] =
+	{
+		"Connection",
+		"Keep-Alive",
+		"Proxy-Connection",
+		"Proxy-Authenticate",
+		"Proxy-Authorization",
+		"TE",
+		"Trailer",
+		"Upgrade",
+	};
+
+	for (auto name : hop_by_hop)
+	{
+		if (strcasecmp(key.c_str(), name) == 0)
+			return true;
+	}
+	return false;
+}
+
+struct http_proxy_op_t;
+
+struct proxy_poll_t
+{
+	uv_poll_t handle;
+	int fd;
+};
+
+struct proxy_write_t
+{
+	uv_write_t req;
+	char *buffer;
+	http_proxy_op_t *op;
+};
+
+struct http_proxy_op_t
+{
+	NOCOPY(http_proxy_op_t);
+	http_proxy_op_t(
+			const http_connection_ptr_t &connection,
+			const http_request_ptr_t &request,
+			const upstream_pool_ptr_t &pool);
+
+	void start(uv_tcp_t *tcp_handle);
+	void parse_head();
+	void relay_body(char *buffer, size_t length);
+	void upstream_ended(bool eof);
+	void abort(const char *why);
+	void maybe_finish();
+
+	bool splice_start();
+	void splice_pump();
+	void splice_wait(proxy_poll_t *&poll, int fd, int events);
+	void splice_stop();
+
+	http_connection_ptr_t connection;
+	http_request_ptr_t request;
+	upstream_pool_ptr_t pool;
+	uv_tcp_t *upstream = nullptr;
+	/* until the pool hands over a connection */
+	upstream_connect_t *connecting = nullptr;
+
+	http_parser parser;
+	std::string response_head;
+	std::vector<http_field_t> response_fields;
+	bool parsing_header_value = false;
+	bool head_sent = false;
+	bool head_relayed = false;
+	bool body_complete = false;
+	bool done_reading = false;
+	bool failed = false;
+	bool reading_paused = false;
+	bool client_keep_alive = false;
+	bool upstream_keep_alive = false;
+	size_t pending_writes = 0;
+	uint64_t body_bytes = 0;
+
+	/* splice state */
+	uint64_t remaining = 0;
+	size_t in_pipe = 0;
+	bool spliced_any = false;
+	int pipe_fds[2];
+	proxy_poll_t *upstream_poll = nullptr;
+	proxy_poll_t *client_poll = nullptr;
+};
+
+static int proxy_header_field(http_parser *parser, const char *at, size_t length)
+{
+	auto op = static_cast<http_proxy_op_t *>(parser->data);
+	if (op->parsing_header_value || op->response_fields.size() == 0)
+		op->response_fields.push_back(http_field_t());
+	op->response_fields.back().key.append(at, length);
+	op->parsing_header_value = false;
+	return 0;
+}
+
+static int proxy_header_value(http_parser *parser, const char *at, size_t length)
+{
+	auto op = static_cast<http_proxy_op_t *>(parser->data);
+	assert(op->response_fields.size() != 0);
+	op->response_fields.back().value.append(at, length);
+	op->parsing_header_value = true;
+	return 0;
+}
+
+static int proxy_headers_complete(http_parser *parser)
+{
+	auto op = static_cast<http_proxy_op_t *>(parser->data);
+
+	/* responses to HEAD carry framing headers but no body */
+	return (op->request->method == HTTP_HEAD) ? 1 : 0;
+}
+
+static int proxy_message_complete(http_parser *parser)
+{
+	static_cast<http_proxy_op_t *>(parser->data)->body_complete = true;
+	return 0;
+}
+
+static const http_parser_settings proxy_parser_settings =
+{
+	nullptr /*on_message_begin*/,
+	nullptr /*on_url*/,
+	nullptr /*on_status_complete*/,
+	proxy_header_field,
+	proxy_header_value,
+	proxy_headers_complete,
+	nullptr /*on_body*/,
+	proxy_message_complete,
+};
+
+http_proxy_op_t::http_proxy_op_t(
+		const http_connection_ptr_t &connection,
+		const http_request_ptr_t &request,
+		const upstream_pool_ptr_t &pool)
+	: connection(connection), request(request), pool(pool)
+{
+	http_parser_init(&parser, HTTP_RESPONSE);
+	parser.data = this;
+	pipe_fds[0] = -1;
+	pipe_fds[1] = -1;
+	client_keep_alive = request->keep_alive();
+}
+
+static uv_buf_t proxy_alloc(uv_handle_t *handle, size_t suggested_size)
+{
+	uv_buf_t buf;
+	buf.base = proxy_buffer_get();
+	buf.len = proxy_buffer_size;
+	return buf;
+}
+
+static void proxy_upstream_read(uv_stream_t *stream, ssize_t nread, uv_buf_t buf)
+{
+	loop_monitor_scope_t scope("proxy_upstream_read");
+	auto op = static_cast<http_proxy_op_t *>(stream->data);
+
+	if (nread < 0)
+	{
+		proxy_buffer_put(buf.base);
+		bool eof = (uv_last_error(uv_default_loop()).code == UV_EOF);
+		if (!eof)
+			log_uv_errors();
+		op->upstream_ended(eof);
+		return;
+	}
+
+	if (nread == 0)
+	{
+		proxy_buffer_put(buf.base);
+		return;
+	}
+
+	if (!op->head_sent)
+	{
+		op->response_head.append(buf.base, nread);
+		proxy_buffer_put(buf.base);
+		op->parse_head();
+	}
+	else
+	{
+		op->relay_body(buf.base, nread);
+	}
+}
+
+static void proxy_upstream_write_cb(uv_write_t *req, int status)
+{
+	loop_monitor_scope_t scope("proxy_upstream_write_cb");
+	auto payload = static_cast<std::string *>(req->data);
+	delete payload;
+	delete req;
+
+	/* failures surface again as a read error on the same handle */
+	if (status != 0)
+		dlog(log_warning, "http_proxy : writing request upstream failed with %d\n", status);
+}
+
+void http_proxy_op_t::start(uv_tcp_t *tcp_handle)
+{
+	if (tcp_handle == nullptr)
+	{
+		abort("no upstream connection");
+		return;
+	}
+
+	upstream = tcp_handle;
+	upstream->data = this;
+
+	std::stringstream ss;
+	ss << http_method_str(request->method) << " " << request->uri() << " HTTP/1.1\r\n";
+	for (auto &field : request->fields)
+	{
+		if (proxy_hop_by_hop(field.key)
+				|| strcasecmp(field.key.c_str(), "Host") == 0
+				|| strcasecmp(field.key.c_str(), "Content-Length") == 0
+				|| strcasecmp(field.key.c_str(), "Transfer-Encoding") == 0)
+		{
+			continue;
+		}
+		ss << field.key << ": " << field.value << "\r\n";
+	}
+	ss << "Host: " << pool->hostname << "\r\n";
+	ss << "Connection: keep-alive\r\n";
+
+	/* the request body has already been de-chunked by our parser. any
+	 * method may carry one (DELETE, PATCH), POST and PUT always get a length */
+	if (request->method == HTTP_POST || request->method == HTTP_PUT
+			|| !request->body().empty())
+	{
+		auto &body = request->body();
+		ss << "Content-Length: " << body.size() << "\r\n";
+		ss << "\r\n";
+		ss.write(body.c_str(), body.size());
+	}
+	else
+	{
+		ss << "\r\n";
+	}
+
+	auto payload = new std::string(ss.str());
+	uv_write_t *write_req = new uv_write_t;
+	write_req->data = payload;
+
+	uv_buf_t buf;
+	buf.base = const_cast<char *>(payload->c_str());
+	buf.len = payload->size();
+	if (uv_write(write_req, (uv_stream_t *)upstream, &buf, 1, proxy_upstream_write_cb)
+			|| uv_read_start((uv_stream_t *)upstream, proxy_alloc, proxy_upstream_read))
+	{
+		log_uv_errors();
+		abort("couldn't talk to upstream");
+	}
+}
+
+void http_proxy_op_t::parse_head()
+{
+	auto head_end = response_head.find("\r\n\r\n");
+	if (head_end == std::string::npos)
+	{
+		if (response_head.size() > proxy_max_head_size)
+			abort("upstream response head too large");
+		return;
+	}
+	head_end += 4;
+
+	auto parsed_count = http_parser_execute(&parser, &proxy_parser_settings,
+			response_head.c_str(), response_head.size());
+	if (parsed_count != response_head.size())
+	{
+		log_http_errors(&parser);
+		abort("couldn't parse upstream response");
+		return;
+	}
+
+	upstream_keep_alive = http_should_keep_alive(&parser);
+
+	bool chunked = false;
+	bool has_length = false;
+	uint64_t content_length = 0;
+	for (auto &field : response_fields)
+	{
+		if (strcasecmp(field.key.c_str(), "Content-Length") == 0)
+		{
+			has_length = true;
+			content_length = strtoull(field.value.c_str(), nullptr, 10);
+		}
+		else if (strcasecmp(field.key.c_str(), "Transfer-Encoding") == 0)
+		{
+			chunked = true;
+		}
+	}
+
+	bool no_body = (request->method == HTTP_HEAD)
+		|| (parser.status_code == 204)
+		|| (parser.status_code == 304);
+
+	/* bodies that end when upstream hangs up can't be kept alive downstream */
+	if (!no_body && !chunked && !has_length)
+	{
+		client_keep_alive = false;
+		upstream_keep_alive = false;
+	}
+
+	std::stringstream ss;
+	ss.write(response_head.c_str(), response_head.find("\r\n") + 2);
+	for (auto &field : response_fields)
+	{
+		if (!proxy_hop_by_hop(field.key))
+			ss << field.key << ": " << field.value << "\r\n";
+	}
+	ss << (client_keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+	ss << "\r\n";
+
+	/* whatever came in behind the head is the start of the body */
+	size_t leftover = response_head.size() - head_end;
+	ss.write(response_head.c_str() + head_end, leftover);
+	response_head.clear();
+	head_sent = true;
+	head_relayed = true;
+	body_bytes += leftover;
+
+	bool can_splice = false;
+#ifdef __linux__
+	can_splice = !no_body && !chunked && has_length
+		&& !body_complete && leftover < content_length;
+#endif
+
+	if (body_complete || can_splice)
+	{
+		uv_read_stop((uv_stream_t *)upstream);
+		remaining = content_length - std::min<uint64_t>(leftover, content_length);
+	}
+
+	++pending_writes;
+	connection->queue_write(ss.str(), false /*close_after_write*/,
+			[this, can_splice](int status) {
+		--pending_writes;
+		if (status != 0)
+		{
+			abort("writing response head failed");
+			return;
+		}
+
+		/* the upstream may have failed while the head was being written */
+		if (failed)
+		{
+			maybe_finish();
+			return;
+		}
+
+		if (can_splice)
+		{
+			if (!splice_start())
+			{
+				/* no splice for this pair of sockets, relay through buffers */
+				uv_read_start((uv_stream_t *)upstream, proxy_alloc, proxy_upstream_read);
+			}
+			return;
+		}
+
+		if (body_complete)
+			done_reading = true;
+		maybe_finish();
+	});
+}
+
+static void proxy_client_write_cb(uv_write_t *req, int status)
+{
+	loop_monitor_scope_t scope("proxy_client_write_cb");
+	auto write = (proxy_write_t *)req;
+	auto op = write->op;
+
+	proxy_buffer_put(write->buffer);
+	delete write;
+
+	--op->pending_writes;
+	if (status != 0)
+	{
+		op->abort("writing to client failed");
+		return;
+	}
+
+	if (op->reading_paused && !op->done_reading
+			&& op->pending_writes < proxy_max_pending_writes / 2)
+	{
+		op->reading_paused = false;
+		uv_read_start((uv_stream_t *)op->upstream, proxy_alloc, proxy_upstream_read);
+	}
+
+	op->maybe_finish();
+}
+
+void http_proxy_op_t::relay_body(char *buffer, size_t length)
+{
+	auto parsed_count = http_parser_execute(&parser, &proxy_parser_settings,
+			buffer, length);
+	if (parsed_count != length)
+	{
+		proxy_buffer_put(buffer);
+		log_http_errors(&parser);
+		abort("couldn't parse upstream response body");
+		return;
+	}
+
+	if (connection->client_handle == nullptr)
+	{
+		proxy_buffer_put(buffer);
+		abort("client went away");
+		return;
+	}
+
+	auto write = new proxy_write_t;
+	write->buffer = buffer;
+	write->op = this;
+	body_bytes += length;
+
+	uv_buf_t buf;
+	buf.base = buffer;
+	buf.len = length;
+	++pending_writes;
+	if (uv_write(&write->req, connection->client_handle, &buf, 1, proxy_client_write_cb))
+	{
+		--pending_writes;
+		proxy_buffer_put(buffer);
+		delete write;
+		log_uv_errors();
+		abort("couldn't write to client");
+		return;
+	}
+
+	if (body_complete)
+	{
+		uv_read_stop((uv_stream_t *)upstream);
+		done_reading = true;
+	}
+	else if (pending_writes >= proxy_max_pending_writes)
+	{
+		/* the client is slower than upstream, stop reading until it drains */
+		uv_read_stop((uv_stream_t *)upstream);
+		reading_paused = true;
+	}
+}
+
+void http_proxy_op_t::upstream_ended(bool eof)
+{
+	if (!head_sent || !eof)
+	{
+		abort("upstream connection ended early");
+		return;
+	}
+
+	/* let the parser see the end of an eof-delimited body */
+	http_parser_execute(&parser, &proxy_parser_settings, nullptr, 0);
+	if (!body_complete)
+	{
+		abort("upstream response was truncated");
+		return;
+	}
+
+	upstream_keep_alive = false;
+	uv_read_stop((uv_stream_t *)upstream);
+	done_reading = true;
+	maybe_finish();
+}
+
+void http_proxy_op_t::abort(const char *why)
+{
+	if (failed)
+	{
+		maybe_finish();
+		return;
+	}
+
+	dlog(log_error, "http_proxy : %s (%s)\n", why, pool->hostname.c_str());
+	failed = true;
+	done_reading = true;
+	splice_stop();
+
+	pool->cancel(connecting);
+	connecting = nullptr;
+
+	if (upstream != nullptr)
+	{
+		uv_read_stop((uv_stream_t *)upstream);
+		pool->release(upstream, false /*reusable*/);
+		upstream = nullptr;
+	}
+
+	if (!head_sent)
+	{
+		head_sent = true;
+		http_response_ptr_t response(new http_response_t(connection, request));
+		response->set_response(502, "Bad Gateway", "text/html");
+		response->send("<html><body>Bad gateway</body></html>");
+		response->end();
+	}
+	else if (connection->client_handle != nullptr
+			&& !uv_is_closing((uv_handle_t *)connection->client_handle))
+	{
+		/* the client has a partial response, all we can do is hang up */
+		uv_close((uv_handle_t *)connection->client_handle, http_server_connection_close);
+	}
+
+	maybe_finish();
+}
+
+void http_proxy_op_t::maybe_finish()
+{
+	if (!done_reading || pending_writes != 0 || upstream_poll != nullptr
+			|| client_poll != nullptr)
+	{
+		return;
+	}
+
+	if (head_relayed)
+	{
+		http_metrics_record(request->metrics_route, parser.status_code,
+				clock_fast_ns() - request->start_time, body_bytes);
+		access_log_request(connection.get(), *request, parser.status_code, body_bytes);
+	}
+
+	if (!failed)
+	{
+		if (upstream != nullptr)
+			pool->release(upstream, upstream_keep_alive);
+
+		if (client_keep_alive)
+		{
+			connection->request_completed();
+		}
+		else if (connection->client_handle != nullptr
+				&& !uv_is_closing((uv_handle_t *)connection->client_handle))
+		{
+			uv_close((uv_handle_t *)connection->client_handle, http_server_connection_close);
+		}
+	}
+
+	delete this;
+}
+
+static void proxy_poll_close(uv_handle_t *handle)
+{
+	auto poll = (proxy_poll_t *)handle;
+	close(poll->fd);
+	delete poll;
+}
+
+static void proxy_poll_cb(uv_poll_t *handle, int status, int events)
+{
+	loop_monitor_scope_t scope("proxy_poll_cb");
+	auto op = static_cast<http_proxy_op_t *>(handle->data);
+	uv_poll_stop(handle);
+	if (status < 0)
+	{
+		log_uv_errors();
+		op->abort("polling while splicing failed");
+		return;
+	}
+	op->splice_pump();
+}
+
+bool http_proxy_op_t::splice_start()
+{
+#ifdef __linux__
+	if (connection->client_handle == nullptr)
+	{
+		abort("client went away");
+		return true;
+	}
+
+	if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		pipe_fds[0] = pipe_fds[1] = -1;
+		return false;
+	}
+
+	splice_pump();
+	return true;
+#else
+	return false;
+#endif
+}
+
+void http_proxy_op_t::splice_wait(proxy_poll_t *&poll, int fd, int events)
+{
+	if (poll == nullptr)
+	{
+		/* poll a duplicate so we don't fight libuv over the watcher of the
+		 * descriptor it already owns */
+		poll = new proxy_poll_t;
+		poll->fd = dup(fd);
+		if (poll->fd < 0 || uv_poll_init(uv_default_loop(), &poll->handle, poll->fd) != 0)
+		{
+			if (poll->fd >= 0)
+				close(poll->fd);
+			delete poll;
+			poll = nullptr;
+			abort("couldn't poll while splicing");
+			return;
+		}
+		poll->handle.data = this;
+	}
+	uv_poll_start(&poll->handle, events, proxy_poll_cb);
+}
+
+void http_proxy_op_t::splice_pump()
+{
+#ifdef __linux__
+	if (failed)
+		return;
+
+	if (connection->client_handle == nullptr)
+	{
+		abort("client went away");
+		return;
+	}
+
+	int upstream_fd = proxy_stream_fd((uv_stream_t *)upstream);
+	int client_fd = proxy_stream_fd(connection->client_handle);
+
+	for (int round = 0; ; ++round)
+	{
+		if (in_pipe == 0 && remaining == 0)
+		{
+			splice_stop();
+			done_reading = true;
+			maybe_finish();
+			return;
+		}
+
+		if (round == proxy_splice_rounds)
+		{
+			/* yield to the rest of the loop. a partial write leaves bytes in
+			 * the pipe that only the client can take, and a keep-alive
+			 * upstream that has sent everything won't turn readable again */
+			if (in_pipe != 0)
+				splice_wait(client_poll, client_fd, UV_WRITABLE);
+			else
+				splice_wait(upstream_poll, upstream_fd, UV_READABLE);
+			return;
+		}
+
+		if (in_pipe == 0)
+		{
+			ssize_t moved = splice(upstream_fd, nullptr, pipe_fds[1], nullptr,
+					std::min<uint64_t>(remaining, proxy_buffer_size),
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (moved == 0)
+			{
+				abort("upstream hung up mid-body");
+				return;
+			}
+			if (moved < 0)
+			{
+				if (errno == EAGAIN)
+				{
+					splice_wait(upstream_poll, upstream_fd, UV_READABLE);
+					return;
+				}
+				if (errno == EINVAL && !spliced_any)
+				{
+					dlog(log_warning, "http_proxy : splice unsupported, falling back\n");
+					splice_stop();
+					uv_read_start((uv_stream_t *)upstream, proxy_alloc, proxy_upstream_read);
+					return;
+				}
+				abort("splicing from upstream failed");
+				return;
+			}
+			spliced_any = true;
+			in_pipe += moved;
+			remaining -= moved;
+		}
+
+		ssize_t moved = splice(pipe_fds[0], nullptr, client_fd, nullptr, in_pipe,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				splice_wait(client_poll, client_fd, UV_WRITABLE);
+				return;
+			}
+			abort("splicing to client failed");
+			return;
+		}
+		in_pipe -= moved;
+		body_bytes += moved;
+	}
+#endif
+}
+
+void http_proxy_op_t::splice_stop()
+{
+	if (upstream_poll != nullptr)
+	{
+		uv_poll_stop(&upstream_poll->handle);
+		uv_close((uv_handle_t *)&upstream_poll->handle, proxy_poll_close);
+		upstream_poll = nullptr;
+	}
+	if (client_poll != nullptr)
+	{
+		uv_poll_stop(&client_poll->handle);
+		uv_close((uv_handle_t *)&client_poll->handle, proxy_poll_close);
+		client_poll = nullptr;
+	}
+	for (auto &fd : pipe_fds)
+	{
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+}
+
+void http_proxy_route(const std::string &path, const upstream_pool_ptr_t &upstream_pool)
+{
+	static const http_method methods[] = { HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_PUT, HTTP_DELETE, HTTP_PATCH, HTTP_OPTIONS };
+	for (auto method : methods)
+	{
+		http_use_route(path, method, [upstream_pool](const http_request_ptr_t &request, const http_response_ptr_t &response) {
+			auto connection = response->connection();
+			if (connection == nullptr)
+				return;
+
+			auto op = new http_proxy_op_t(connection, request, upstream_pool);
+			auto connect = upstream_pool->acquire([op](uv_tcp_t *tcp_handle) {
+				op->connecting = nullptr;
+				op->start(tcp_handle);
+			});
+
+			/* nullptr if start already ran, and op may be gone with it */
+			if (connect != nullptr)
+				op->connecting = connect;
+		});
+	}
+}
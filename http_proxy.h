@@ -0,0 +1,10 @@
+#pragma once
+#include <string>
+#include "http_server.h"
+#include "upstream_pool.h"
+
+/* relays every request made against path to a connection from upstream_pool.
+ * Response bodies of known length move socket to socket through a pipe with
+ * splice() on Linux; everything else is relayed through pooled buffers.
+ * splice() can't be told MSG_NOSIGNAL, so the process should ignore SIGPIPE. */
+void http_proxy_route(const std::string &path, const upstream_pool_ptr_t &upstream_pool);
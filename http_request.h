@@ -5,10 +5,18 @@
 #include <assert.h>
 #include "nocopy.h"
 #include <memory>
+#include <vector>
 #include "utils.h"
+#include "http_metrics.h"
 
 struct http_connection_t;
 
+struct http_field_t
+{
+	std::string key;
+	std::string value;
+};
+
 /* http_request_t informs the server handler what the client is asking for */
 struct http_request_t : static_count<http_request_t>
 {
@@ -19,12 +27,22 @@ struct http_request_t : static_count<http_request_t>
 
 	http_method method;
 	unordered_map<std::string, std::string> query_params;
+	std::vector<http_field_t> fields;
 
 	std::string uri_path() const;
-	const std::string &body() const { assert(method == HTTP_POST); return _body; }
+	const std::string &uri() const { return target_uri; }
+	/* empty unless the request carried a body, whatever its method */
+	const std::string &body() const { return _body; }
 
 	bool keep_alive() const;
 
+	/* clock_fast_ns when the first byte of the request was parsed */
+	uint64_t start_time = 0;
+
+	/* the route it was dispatched to, for http_metrics_record */
+	unsigned metrics_route = http_metrics_unmatched;
+	unsigned short http_minor = 1;
+
 private:
 	http_parser parser;
 	std::string target_uri;
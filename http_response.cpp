@@ -3,9 +3,13 @@
 #include "logger_decls.h"
 #include <sstream>
 #include "http_connection.h"
+#include "clock_cache.h"
+#include "access_log.h"
+#include "clock_source.h"
+#include "http_metrics.h"
 
-http_response_t::http_response_t(const http_connection_ptr_t &connection, bool keep_alive)
-	: weak_connection(connection), keep_alive(keep_alive)
+http_response_t::http_response_t(const http_connection_ptr_t &connection, const http_request_ptr_t &request)
+	: weak_connection(connection), request(request), keep_alive(request->keep_alive())
 {
 }
 
@@ -53,6 +57,12 @@ void http_response_t::send(
 		if (!sent_headers)
 		{
 			ss << "HTTP/" << (keep_alive ? "1.1 ": "1.0 ") << code << " " << reason << "\r\n";
+			if (fields.find("Date") == fields.end())
+			{
+				ss << "Date: ";
+				ss.write(clock_cache_http_date(), clock_http_date_length);
+				ss << "\r\n";
+			}
 			for (auto &field_pair : fields)
 			{
 				ss << field_pair.first << ": " << field_pair.second << "\r\n";
@@ -72,8 +82,29 @@ void http_response_t::send(
 		ss.write(payload.c_str(), payload.size());
 		//ss << "\r\n";
 
-		if (payload.size() != 0 || close_after_write)
+		body_bytes += payload.size();
+
+		if (content_complete)
+		{
+			/* metrics and the access log entry are taken once the last of the
+			 * response is written */
+			int code = this->code;
+			uint64_t bytes = body_bytes;
+			auto request = this->request;
+			auto log_request = [connection, request, code, bytes](int status) {
+				http_metrics_record(request->metrics_route, code, clock_fast_ns() - request->start_time, bytes);
+				access_log_request(connection.get(), *request, code, bytes);
+			};
+
+			if (payload.size() != 0 || close_after_write)
+				connection->queue_write(ss.str(), close_after_write, log_request);
+			else
+				connection->after_writes(std::move(log_request));
+		}
+		else if (payload.size() != 0 || close_after_write)
+		{
 			connection->queue_write(ss.str(), close_after_write);
+		}
 
 		sent_headers = true;
 
@@ -85,7 +116,7 @@ void http_response_t::send(
 	}
 	else
 	{
-		dlog(log_warning, "%s bailed out on send\n");
+		dlog(log_warning, "%s bailed out on send\n", __FUNCTION__);
 	}
 }
 
@@ -3,6 +3,7 @@
 #include <unordered_map>
 #include <memory>
 #include "nocopy.h"
+#include "http_request.h"
 
 struct http_connection_t;
 typedef std::shared_ptr<http_connection_t> http_connection_ptr_t;
@@ -11,21 +12,25 @@ typedef std::weak_ptr<http_connection_t> http_connection_weak_ptr_t;
 struct http_response_t : public std::enable_shared_from_this<http_response_t>
 {
 	NOCOPY(http_response_t);
-	http_response_t(const http_connection_ptr_t &connection, bool keep_alive);
+	http_response_t(const http_connection_ptr_t &connection, const http_request_ptr_t &request);
 
 	void set_response(int code, const std::string &reason, const std::string &content_type);
 	void set_header(const std::string &key, const std::string &value);
 	void send(const std::string &payload, bool content_complete = false, bool close_after_write = false);
 	void end(bool close_connection = false);
 
+	http_connection_ptr_t connection() const { return weak_connection.lock(); }
+
 private:
 	http_connection_weak_ptr_t weak_connection;
+	http_request_ptr_t request;
 
 	bool keep_alive;
 	bool sent_headers = false;
 	int code = 200;
 	std::string reason = "OK";
 	std::string content_type;
+	uint64_t body_bytes = 0;
 	std::unordered_map<std::string, std::string> fields;
 
 };
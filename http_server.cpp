@@ -1,4 +1,6 @@
 #include "logger_decls.h"
+#include "slog.h"
+#include "log_limit.h"
 #include "http.h"
 #include "nodecpp_errors.h"
 #include <assert.h>
@@ -10,17 +12,20 @@
 #include <uv.h>
 #include "http_connection.h"
 #include "utils.h"
+#include "loop_monitor.h"
 
 using std::shared_ptr;
 
 struct route_info_t
 {
 	NOCOPY(route_info_t);
-	route_info_t(http_route_handler_t &&handler) : handler(std::move(handler))
+	route_info_t(http_route_handler_t &&handler, unsigned metrics_route)
+		: handler(std::move(handler)), metrics_route(metrics_route)
 	{
 	}
 
 	http_route_handler_t handler;
+	unsigned metrics_route;
 };
 
 using route_info_ptr_t = shared_ptr<route_info_t>;
@@ -33,7 +38,7 @@ void http_use_route(
 	   	http_method method,
 	   	http_route_handler_t &&handler)
 {
-	route_info_ptr_t route_info(new route_info_t(std::move(handler)));
+	route_info_ptr_t route_info(new route_info_t(std::move(handler), http_metrics_route_id(path)));
 	dlog(log_info, "installing http_use_route handler for \"%s\"\n", path.c_str());
 	http_server_methods_routes[method][path] = route_info;
 }
@@ -45,7 +50,7 @@ void http_server_connection_close(uv_handle_t *handle)
 	if (connection != nullptr)
 	{
 		assert(*connection != nullptr);
-		dlog(log_warning, "%s deleting connection %ju [%d]\n",
+		dlog(log_info, "%s deleting connection %ju [%d]\n",
 				__FUNCTION__, uintmax_t((*connection)->client_handle),
 				(int)(*connection)->instance_id);
 		/* prevent the connection from accessing this handle anymore */
@@ -80,7 +85,7 @@ void dump_routes()
 template <typename Request, typename Response>
 void http_server_error(Request &request, Response &response)
 {
-	dlog(log_error, "no handler registered for request path %s",
+	log_limited(log_error, 10, "no handler registered for request path %s\n",
 		request->uri_path().c_str());
 	response->set_response(404, "OK", "text/html");
 	std::stringstream ss;
@@ -100,16 +105,17 @@ void http_server_dispatch(
 	auto iter = http_server_routes.find(request->uri_path());
 	if (iter == http_server_routes.end())
 	{
-		http_response_ptr_t response(new http_response_t(connection, request->keep_alive()));
+		loop_monitor_attribute("(unmatched)");
+		http_response_ptr_t response(new http_response_t(connection, request));
 		http_server_error(request, response);
 
 		// TODO handle 404?
-		dlog(log_info, "route not found for \"%s\"\n",
+		log_sampled(log_info, 100, "route not found for \"%s\"\n",
 				request->uri_path().c_str());
 
 		if (!uv_is_closing((uv_handle_t *)connection->client_handle))
 		{
-			dlog(log_warning, "%s closing socket %ju [%d]\n",
+			dlog(log_info, "%s closing socket %ju [%d]\n",
 					__FUNCTION__, uintmax_t(connection->client_handle),
 					connection->instance_id);
 
@@ -119,12 +125,14 @@ void http_server_dispatch(
 	}
 	else
 	{
-		dlog(log_warning, "%s routing to handler for connection %ju [%d]\n",
+		dlog(log_info, "%s routing to handler for connection %ju [%d]\n",
 				__FUNCTION__, uintmax_t(connection->client_handle),
 				connection->instance_id);
 
-		http_response_ptr_t response(new http_response_t(connection, request->keep_alive()));
 		auto &route_info = iter->second;
+		loop_monitor_attribute(iter->first.c_str());
+		request->metrics_route = route_info->metrics_route;
+		http_response_ptr_t response(new http_response_t(connection, request));
 		route_info->handler(request, response);
 	}
 }
@@ -135,12 +143,13 @@ static uv_buf_t http_server_alloc(uv_handle_t *handle, size_t suggested_size)
 	uv_buf_t buf;
 	buf.base = new char[suggested_size];
 	buf.len = (buf.base != nullptr) ? suggested_size : 0;
-	dlog(log_info, "http_server_alloc (allocating %ju)\n", (uintmax_t)(buf.base));
+	dslog(log_info, "http_server_alloc (allocating %ju)\n", (uintmax_t)(buf.base));
 	return buf;
 }
 
 static void http_server_read(uv_stream_t *client_handle, ssize_t nread, uv_buf_t buf)
 {
+	loop_monitor_scope_t scope("http_server_read");
 	http_connection_ptr_t *connection_ptr = (http_connection_ptr_t *)client_handle->data;
 	assert(client_handle == (*connection_ptr)->client_handle);
 	assert(connection_ptr != nullptr);
@@ -149,7 +158,7 @@ static void http_server_read(uv_stream_t *client_handle, ssize_t nread, uv_buf_t
 	{
 		if (uv_last_error(uv_default_loop()).code == UV_EOF)
 		{
-			dlog(log_warning, "end of socket encountered\n");
+			dlog(log_info, "end of socket encountered\n");
 
 			/* No more data. Close the connection. */
 			uv_close((uv_handle_t *)client_handle, http_server_connection_close);
@@ -165,13 +174,14 @@ static void http_server_read(uv_stream_t *client_handle, ssize_t nread, uv_buf_t
 		connection->parse_http(buf.base, nread);
 	}
 
-	dlog(log_info, "--- (freeing %ju)\n", (uintmax_t)(buf.base));
+	dslog(log_info, "--- (freeing %ju)\n", (uintmax_t)(buf.base));
 	delete buf.base;
 }
 
 
 static void http_connection(uv_stream_t *server, int status)
 {
+	loop_monitor_scope_t scope("http_connection");
 	dlog(log_info, "client connection created\n");
 	uv_tcp_t *client_handle = new uv_tcp_t();
 	uv_tcp_init(uv_default_loop(), client_handle);
@@ -0,0 +1,140 @@
+#include "line_index.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "logger_decls.h"
+#include "mapped_file.h"
+
+/* how many files' indexes are kept around */
+const size_t line_index_cache_entries = 16;
+
+/* how much of a file is mapped at once while indexing it */
+const size_t line_index_window = 256 * 1024 * 1024;
+
+#ifdef __APPLE__
+#define LINE_INDEX_MTIME(st) ((st).st_mtimespec)
+#else
+#define LINE_INDEX_MTIME(st) ((st).st_mtim)
+#endif
+
+struct line_index_cache_entry_t
+{
+	std::shared_ptr<const line_index_t> index;
+	uint64_t last_used;
+};
+
+static std::mutex line_index_cache_lock;
+static std::map<std::string, line_index_cache_entry_t> line_index_cache;
+static uint64_t line_index_cache_clock = 0;
+
+void line_index_t::scan(const char *data, size_t size, size_t base)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	/* 16 bytes per compare, then one push per newline found */
+	const __m128i newlines = _mm_set1_epi8('\n');
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+		while (mask != 0)
+		{
+			m_line_starts.push_back(base + i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < size; ++i)
+	{
+		const char *newline = (const char *)memchr(data + i, '\n', size - i);
+		if (newline == NULL)
+			break;
+		i = newline - data;
+		m_line_starts.push_back(base + i + 1);
+	}
+}
+
+bool line_index_t::build(const std::string &path)
+{
+	mapped_file_t file;
+	struct stat st;
+	if (!file.open(path, mapped_file_read, mapped_file_sequential | mapped_file_willneed) || !file.stat(st))
+		return false;
+
+	m_size = file.file_size();
+	m_mtime = LINE_INDEX_MTIME(st);
+	m_line_starts.clear();
+	m_line_starts.push_back(0);
+
+	for (uint64_t offset = 0; offset < m_size; offset += line_index_window)
+	{
+		if (!file.map(offset, line_index_window))
+			return false;
+		scan(file.begin(), file.size(), offset);
+	}
+
+	m_line_starts.shrink_to_fit();
+	return true;
+}
+
+std::shared_ptr<const line_index_t> line_index_t::get(const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(line_index_cache_lock);
+		auto found = line_index_cache.find(path);
+		if (found != line_index_cache.end())
+		{
+			const line_index_t &index = *found->second.index;
+			const timespec &mtime = LINE_INDEX_MTIME(st);
+			if (index.m_size == (size_t)st.st_size && index.m_mtime.tv_sec == mtime.tv_sec
+					&& index.m_mtime.tv_nsec == mtime.tv_nsec)
+			{
+				found->second.last_used = ++line_index_cache_clock;
+				return found->second.index;
+			}
+		}
+	}
+
+	/* build outside the lock, a big file takes a while */
+	std::shared_ptr<line_index_t> index(new line_index_t);
+	if (!index->build(path))
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(line_index_cache_lock);
+	if (line_index_cache.size() >= line_index_cache_entries && line_index_cache.count(path) == 0)
+	{
+		auto oldest = std::min_element(line_index_cache.begin(), line_index_cache.end(),
+			[](const std::pair<const std::string, line_index_cache_entry_t> &a,
+				const std::pair<const std::string, line_index_cache_entry_t> &b) {
+				return a.second.last_used < b.second.last_used;
+			});
+		line_index_cache.erase(oldest);
+	}
+
+	line_index_cache_entry_t &entry = line_index_cache[path];
+	entry.index = index;
+	entry.last_used = ++line_index_cache_clock;
+	return index;
+}
+
+bool line_index_t::locate(size_t offset, size_t &line, size_t &col) const
+{
+	if (offset > m_size)
+		return false;
+
+	/* the lines that start at or before offset */
+	auto next = std::upper_bound(m_line_starts.begin(), m_line_starts.end(), offset);
+	line = next - m_line_starts.begin();
+	col = offset - *(next - 1) + 1;
+	return true;
+}
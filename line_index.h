@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <time.h>
+#include "nocopy.h"
+
+/* where each line of a file starts, so that byte offsets can be turned into
+ * line and column numbers with a binary search. built from a mapping of the
+ * file, a window at a time, and cached per path until the file's mtime or
+ * size changes. */
+class line_index_t
+{
+public:
+	NOCOPY(line_index_t);
+	line_index_t() : m_size(0) {}
+
+	/* nullptr if path can't be opened or mapped */
+	static std::shared_ptr<const line_index_t> get(const std::string &path);
+
+	/* both 1 based. false if offset is past the end of the file */
+	bool locate(size_t offset, size_t &line, size_t &col) const;
+
+	size_t lines() const { return m_line_starts.size(); }
+	size_t size() const { return m_size; }
+
+private:
+	bool build(const std::string &path);
+	void scan(const char *data, size_t size, size_t base);
+
+	std::vector<size_t> m_line_starts;
+	size_t m_size;
+	timespec m_mtime;
+};
@@ -0,0 +1,124 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include "logger_decls.h"
+
+/* per call site throttling for log lines that can storm.
+ *
+ *   log_limited(log_error, 10, "no handler for %s\n", path);   // 10 per second
+ *   log_sampled(log_info, 100, "route not found %s\n", path);  // 1 in 100
+ *
+ * the site state is a constant initialized static, so there is no guard or
+ * registration on the hot path. lines that are held back are counted, and a
+ * "suppressed N messages" summary is logged at most once a second, either
+ * ahead of the next line the site lets through or by the async writer. */
+struct log_limit_t
+{
+	constexpr log_limit_t(const char *file, int line, int64_t interval, int64_t tolerance, uint64_t one_in)
+		: file(file), line(line), interval(interval), tolerance(tolerance), one_in(one_in),
+		next_allowed(0), count(0), suppressed(0), reported(0), registered(false), next_site(nullptr)
+	{
+	}
+
+	/* true when this occurrence should be logged */
+	bool admit()
+	{
+		return (one_in != 0) ? admit_sample() : admit_rate(log_limit_now());
+	}
+
+	/* logs the suppressed count if a summary is due */
+	void report()
+	{
+		if (suppressed.load(std::memory_order_relaxed) != 0)
+			report_suppressed();
+	}
+
+	/* swaps out the suppressed count, or returns 0 if the last summary was
+	 * less than a second ago */
+	uint64_t take_suppressed(int64_t now);
+
+	static int64_t log_limit_now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool admit_rate(int64_t now)
+	{
+		/* generic cell rate algorithm: a token bucket kept as the time the
+		 * next line is due, so one atomic holds the whole bucket */
+		int64_t due = next_allowed.load(std::memory_order_relaxed);
+		while (true)
+		{
+			if (now < due - tolerance)
+			{
+				held_back();
+				return false;
+			}
+			int64_t next = ((due > now) ? due : now) + interval;
+			if (next_allowed.compare_exchange_weak(due, next, std::memory_order_relaxed))
+				return true;
+		}
+	}
+
+	bool admit_sample()
+	{
+		if (count.fetch_add(1, std::memory_order_relaxed) % one_in == 0)
+			return true;
+		held_back();
+		return false;
+	}
+
+	void held_back()
+	{
+		suppressed.fetch_add(1, std::memory_order_relaxed);
+		if (!registered.load(std::memory_order_relaxed))
+			enlist();
+	}
+
+	void enlist();
+	void report_suppressed();
+
+	const char * const file;
+	const int line;
+	const int64_t interval;
+	const int64_t tolerance;
+	const uint64_t one_in;
+
+	std::atomic<int64_t> next_allowed;
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> suppressed;
+	std::atomic<int64_t> reported;
+	std::atomic<bool> registered;
+
+	/* sites that have ever held a line back, walked by the async writer */
+	log_limit_t *next_site;
+	static std::atomic<log_limit_t *> s_sites;
+};
+
+const int64_t log_limit_second = 1000000000;
+
+/* allows bursts of up to a second's worth of lines */
+#define log_limit_rate(per_second) \
+	(log_limit_second / (per_second)), (log_limit_second - log_limit_second / (per_second)), 0
+
+#define log_limited(level, per_second, format, params...) \
+	do { \
+		static log_limit_t _log_limit(__FILE__, __LINE__, log_limit_rate(per_second)); \
+		if (log_compiled(level) && (logger_level & (level)) && _log_limit.admit()) \
+		{ \
+			_log_limit.report(); \
+			log(level, format, ##params); \
+		} \
+	} while (0)
+
+#define log_sampled(level, one_in, format, params...) \
+	do { \
+		static log_limit_t _log_limit(__FILE__, __LINE__, 0, 0, one_in); \
+		if (log_compiled(level) && (logger_level & (level)) && _log_limit.admit()) \
+		{ \
+			_log_limit.report(); \
+			log(level, format, ##params); \
+		} \
+	} while (0)
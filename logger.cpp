@@ -6,16 +6,39 @@
 #include <string.h>
 #include <iomanip>
 #include <sstream>
+#include <chrono>
+#include <algorithm>
 #include "disk.h"
 #include "utils.h"
+#include "slog.h"
+#include "log_limit.h"
+#include "clock_cache.h"
 #ifdef DEBUG
 #include <execinfo.h>
 #endif
 
 const int max_log_entries_per_file = 100000;
 
+/* how long the writer thread naps when every ring is empty */
+const int log_writer_min_nap_ms = 1;
+const int log_writer_max_nap_ms = 32;
+
+/* how often the writer logs suppressed counts for throttled sites */
+const int log_summary_interval_ms = 1000;
+
 int logger_level = log_info | log_warning | log_error;
 
+std::atomic<log_limit_t *> log_limit_t::s_sites(nullptr);
+
+#ifdef DEBUG
+/* error backtraces are throttled too, a storm of errors shouldn't turn into
+ * a storm of stack dumps */
+static log_limit_t log_backtrace_limit("backtraces", 0, log_limit_rate(5));
+
+/* marks records that carry raw return addresses instead of text */
+static const log_site_t log_backtrace_site = { log_error, "", __FILE__, __LINE__ };
+#endif
+
 void log_enable(int log_level)
 {
 	logger_level = log_level;
@@ -23,7 +46,10 @@ void log_enable(int log_level)
 
 logger *logger::s_plogger = NULL;
 
-logger::logger(const std::string &name, const std::string &root_file_path) : m_name(name), m_fp(NULL), m_entries(0)
+logger::logger(const std::string &name, const std::string &root_file_path)
+	: m_name(name), m_fp(NULL), m_entries(0), m_async(false), m_stopping(false),
+	m_overflow(log_overflow_drop), m_ring_records(0), m_generation(0),
+	m_flush_requested(0), m_flush_completed(0), m_dropped(0), m_dropped_reported(0)
 {
 	m_root_file_path = root_file_path;
 	if (m_root_file_path[m_root_file_path.size() - 1] != '/')
@@ -170,6 +196,10 @@ void log(log_level_t level, const char *format, ...)
 	va_end(args);
 
 #ifdef DEBUG
+	/* the writer thread echoes async records itself */
+	if (logger::s_plogger->m_async.load(std::memory_order_relaxed))
+		return;
+
 	if (level != log_direct)
 	{
 		fprintf(stderr, "%s", logstr(level));
@@ -196,12 +226,26 @@ void log_flush()
 
 void logger::flush()
 {
+	if (m_async.load(std::memory_order_acquire))
+	{
+		/* wait for the writer to make a full pass that finds nothing left */
+		std::unique_lock<std::mutex> lock(m_wake_lock);
+		uint64_t target = ++m_flush_requested;
+		m_wake.notify_one();
+		m_flushed.wait(lock, [this, target]() { return m_flush_completed >= target; });
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_file_lock);
 	if (m_fp != NULL)
 		fflush(m_fp);
 }
 
 void logger::call_logging_function(void (*func)(FILE *))
 {
+	flush();
+
+	std::lock_guard<std::mutex> lock(m_file_lock);
 	if (m_fp != NULL)
 		func(m_fp);
 }
@@ -222,6 +266,16 @@ void logger::logv(log_level_t level, const char *format, va_list args)
 	if (mask(logger_level, level) == 0)
 		return;
 
+	if (m_async.load(std::memory_order_acquire))
+	{
+		push_async(level, format, args);
+		return;
+	}
+
+	/* pool workers and background writers log too, keep them off each
+	 * other's lines and out of the middle of a rotation */
+	std::lock_guard<std::mutex> lock(m_file_lock);
+
 	FILE *fp = m_fp;
 	if (fp != NULL)
 	{
@@ -244,14 +298,12 @@ void logger::logv(log_level_t level, const char *format, va_list args)
 	}
 	else
 	{
-		std::stringstream ss;
-		time_now(ss, true /*exact*/, true /*for_humans*/);
-		fprintf(fp, "%s\t%s", ss.str().c_str(), logstr(level));
+		fprintf(fp, "%s\t%s", clock_cache_log_stamp(clock_cache_now()), logstr(level));
 		vfprintf(fp, format, args);
 	}
 
 #ifdef DEBUG
-	if (level == log_error)
+	if (level == log_error && log_backtrace_limit.admit())
 	{
 		void *callstack[128];
 		int frames = backtrace(callstack, 128);
@@ -270,6 +322,501 @@ void logger::logv(log_level_t level, const char *format, va_list args)
 	fflush(fp);
 }
 
+log_ring_t *logger::thread_ring()
+{
+	struct thread_ring_t
+	{
+		const logger *owner = nullptr;
+		unsigned generation = 0;
+		std::shared_ptr<log_ring_t> ring;
+
+		~thread_ring_t()
+		{
+			/* everything this thread logged is published by now */
+			if (ring != nullptr)
+				ring->orphaned.store(true, std::memory_order_release);
+		}
+	};
+	static thread_local thread_ring_t t_ring;
+
+	if (t_ring.owner != this || t_ring.generation != m_generation)
+	{
+		/* first record from this thread, register a ring for it */
+		t_ring.owner = this;
+		t_ring.generation = m_generation;
+		t_ring.ring = std::make_shared<log_ring_t>(m_ring_records);
+
+		std::lock_guard<std::mutex> lock(m_rings_lock);
+		m_rings.push_back(t_ring.ring);
+	}
+	return t_ring.ring.get();
+}
+
+void logger::push_async(log_level_t level, const char *format, va_list args)
+{
+	log_ring_t *ring = thread_ring();
+
+	log_record_t *record = ring->claim();
+	while (record == nullptr)
+	{
+		if (m_overflow == log_overflow_drop)
+		{
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		m_wake.notify_one();
+		std::this_thread::yield();
+		record = ring->claim();
+	}
+
+	record->level = level;
+	record->site = nullptr;
+	record->time = clock_cache_now();
+	int length = vsnprintf(record->text, sizeof(record->text), format, args);
+	if (length < 0)
+		length = 0;
+	if (length >= (int)sizeof(record->text))
+	{
+		/* mark the truncation but keep the line break */
+		length = sizeof(record->text) - 1;
+		memcpy(record->text + length - 4, "...\n", 4);
+	}
+	record->length = length;
+	ring->publish();
+
+#ifdef DEBUG
+	if (level == log_error && log_backtrace_limit.admit())
+		push_backtrace(ring);
+#endif
+}
+
+#ifdef DEBUG
+void logger::push_backtrace(log_ring_t *ring)
+{
+	/* only the raw addresses are captured here, the writer symbolizes them */
+	log_record_t *record = ring->claim();
+	if (record == nullptr)
+	{
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	const int max_frames = sizeof(record->text) / sizeof(void *);
+	void *callstack[max_frames];
+	int frames = backtrace(callstack, max_frames);
+	record->level = log_error;
+	record->site = &log_backtrace_site;
+	record->time = clock_cache_now();
+	memcpy(record->text, callstack, frames * sizeof(void *));
+	record->length = frames * sizeof(void *);
+	ring->publish();
+}
+
+static void log_symbolize(const log_record_t *record, std::string &text)
+{
+	void *callstack[sizeof(record->text) / sizeof(void *)];
+	int frames = record->length / sizeof(void *);
+	memcpy(callstack, record->text, frames * sizeof(void *));
+
+	char **strs = backtrace_symbols(callstack, frames);
+	if (strs == NULL)
+		return;
+	for (int i = 0; i < frames; ++i)
+	{
+		text.append(strs[i]);
+		text.push_back('\n');
+	}
+	free(strs);
+}
+#endif
+
+void logger::push_structured(const log_site_t *site, const char *args, size_t length)
+{
+	log_ring_t *ring = thread_ring();
+
+	log_record_t *record = ring->claim();
+	while (record == nullptr)
+	{
+		if (m_overflow == log_overflow_drop)
+		{
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		m_wake.notify_one();
+		std::this_thread::yield();
+		record = ring->claim();
+	}
+
+	assert(length <= sizeof(record->text));
+	record->level = site->level;
+	record->site = site;
+	record->time = clock_cache_now();
+	memcpy(record->text, args, length);
+	record->length = length;
+	ring->publish();
+}
+
+void log_structured_commit(const log_site_t *site, const char *args, size_t length)
+{
+	logger *plogger = logger::s_plogger;
+	if (plogger != NULL && plogger->m_async.load(std::memory_order_acquire))
+	{
+		plogger->push_structured(site, args, length);
+		return;
+	}
+
+	/* synchronous loggers just format on the spot */
+	std::string text;
+	log_structured_format(site, args, length, text);
+	log(site->level, "%s", text.c_str());
+}
+
+template <typename T>
+static bool log_read_arg(const char *&args, const char *end, T &value)
+{
+	if (args + sizeof(value) > end)
+		return false;
+	memcpy(&value, args, sizeof(value));
+	args += sizeof(value);
+	return true;
+}
+
+void log_structured_format(const log_site_t *site, const char *args, size_t length, std::string &text)
+{
+	const char *end = args + length;
+	const char *pch = site->format;
+	char buffer[256];
+
+	while (*pch != '\0')
+	{
+		const char *percent = strchr(pch, '%');
+		if (percent == NULL)
+		{
+			text.append(pch);
+			break;
+		}
+		text.append(pch, percent - pch);
+		pch = percent + 1;
+
+		if (*pch == '%')
+		{
+			text.push_back('%');
+			++pch;
+			continue;
+		}
+
+		/* keep flags, width and precision, rebuild the length modifier
+		 * to match what was captured */
+		std::string spec("%");
+		while (*pch != '\0' && strchr("-+ #0123456789.", *pch) != NULL)
+			spec.push_back(*pch++);
+		while (*pch != '\0' && strchr("hlLqjzt", *pch) != NULL)
+			++pch;
+		char conversion = *pch;
+		if (conversion == '\0')
+			break;
+		++pch;
+
+		if (args >= end)
+		{
+			text.append("<?>");
+			continue;
+		}
+
+		char tag = *args++;
+		switch (tag)
+		{
+		case log_arg_int:
+		case log_arg_uint:
+			{
+				int64_t value;
+				if (!log_read_arg(args, end, value))
+					break;
+				if (conversion == 'c')
+					snprintf(buffer, sizeof(buffer), (spec + "c").c_str(), (int)value);
+				else if (strchr("diouxX", conversion) != NULL)
+					snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(), (long long)value);
+				else
+					snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+				text.append(buffer);
+			}
+			break;
+		case log_arg_double:
+			{
+				double value;
+				if (!log_read_arg(args, end, value))
+					break;
+				if (strchr("eEfFgGaA", conversion) == NULL)
+					conversion = 'g';
+				snprintf(buffer, sizeof(buffer), (spec + conversion).c_str(), value);
+				text.append(buffer);
+			}
+			break;
+		case log_arg_pointer:
+			{
+				const void *value;
+				if (!log_read_arg(args, end, value))
+					break;
+				snprintf(buffer, sizeof(buffer), "%p", value);
+				text.append(buffer);
+			}
+			break;
+		case log_arg_string:
+			{
+				uint16_t size;
+				if (!log_read_arg(args, end, size) || args + size > end)
+					break;
+				text.append(args, size);
+				args += size;
+			}
+			break;
+		default:
+			/* corrupt record, don't try to make sense of the rest */
+			args = end;
+			text.append("<?>");
+			break;
+		}
+	}
+}
+
+size_t logger::drain_rings(std::string &batch)
+{
+	std::vector<std::shared_ptr<log_ring_t>> rings;
+	{
+		std::lock_guard<std::mutex> lock(m_rings_lock);
+		rings = m_rings;
+	}
+	bool any_orphaned = false;
+
+	/* records stay in order per thread; across threads they interleave at
+	 * batch granularity */
+	size_t drained = 0;
+	std::string text;
+	for (auto &ring : rings)
+	{
+		/* checked before draining, so an orphan that's empty after it
+		 * can't be sent anything more */
+		bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+		any_orphaned |= orphaned;
+
+		const log_record_t *record;
+		while ((record = ring->front()) != nullptr)
+		{
+#ifdef DEBUG
+			if (record->site == &log_backtrace_site)
+			{
+				text.clear();
+				log_symbolize(record, text);
+				batch.append(text);
+				fwrite(text.c_str(), 1, text.size(), stderr);
+				ring->release();
+				++drained;
+				continue;
+			}
+#endif
+			if (record->level != log_direct)
+			{
+				batch.append(clock_cache_log_stamp(record->time), clock_log_stamp_length);
+				batch.push_back('\t');
+				batch.append(logstr(record->level));
+			}
+			if (record->site != nullptr)
+			{
+				text.clear();
+				log_structured_format(record->site, record->text, record->length, text);
+				batch.append(text);
+#ifdef DEBUG
+				fwrite(text.c_str(), 1, text.size(), stderr);
+#endif
+			}
+			else
+			{
+				batch.append(record->text, record->length);
+#ifdef DEBUG
+				fwrite(record->text, 1, record->length, stderr);
+#endif
+			}
+			ring->release();
+			++drained;
+		}
+	}
+
+	if (any_orphaned)
+	{
+		/* threads that have exited, and whose records are all written */
+		std::lock_guard<std::mutex> lock(m_rings_lock);
+		m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(),
+				[](const std::shared_ptr<log_ring_t> &ring) {
+					return ring->orphaned.load(std::memory_order_acquire) && ring->empty();
+				}),
+				m_rings.end());
+	}
+	return drained;
+}
+
+void logger::append_summaries(std::string &batch)
+{
+	int64_t now = log_limit_t::log_limit_now();
+	double now_time = clock_cache_now();
+	for (log_limit_t *site = log_limit_t::s_sites.load(std::memory_order_acquire);
+			site != nullptr;
+			site = site->next_site)
+	{
+		uint64_t suppressed = site->take_suppressed(now);
+		if (suppressed == 0)
+			continue;
+
+		std::stringstream ss;
+		ss << clock_cache_log_stamp(now_time) << '\t' << logstr(log_warning) << site->file;
+		if (site->line != 0)
+			ss << ':' << site->line;
+		ss << " : suppressed " << suppressed << " messages\n";
+		batch.append(ss.str());
+	}
+}
+
+void logger::writer_main()
+{
+	std::string batch;
+	int nap_ms = log_writer_min_nap_ms;
+	auto last_summary = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		uint64_t flush_target;
+		{
+			std::lock_guard<std::mutex> lock(m_wake_lock);
+			flush_target = m_flush_requested;
+		}
+		bool stopping = m_stopping.load(std::memory_order_acquire);
+
+		batch.clear();
+		size_t drained = drain_rings(batch);
+
+		uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+		if (dropped != m_dropped_reported)
+		{
+			std::stringstream ss;
+			ss << clock_cache_log_stamp(clock_cache_now()) << '\t' << logstr(log_warning) << "logger : dropped "
+				<< (dropped - m_dropped_reported) << " records, rings were full\n";
+			batch.append(ss.str());
+			m_dropped_reported = dropped;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_summary >= std::chrono::milliseconds(log_summary_interval_ms))
+		{
+			append_summaries(batch);
+			last_summary = now;
+		}
+
+		if (batch.size() != 0)
+		{
+			std::lock_guard<std::mutex> lock(m_file_lock);
+			m_entries += drained;
+			if (m_fp != NULL && m_entries >= max_log_entries_per_file)
+			{
+				close();
+				open();
+			}
+
+			FILE *fp = (m_fp != NULL) ? m_fp : stderr;
+			fwrite(batch.c_str(), 1, batch.size(), fp);
+			fflush(fp);
+		}
+
+		if (drained == 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_wake_lock);
+				if (m_flush_completed < flush_target)
+				{
+					m_flush_completed = flush_target;
+					m_flushed.notify_all();
+				}
+			}
+
+			if (stopping)
+				break;
+
+			std::unique_lock<std::mutex> lock(m_wake_lock);
+			m_wake.wait_for(lock, std::chrono::milliseconds(nap_ms));
+			nap_ms = std::min(nap_ms * 2, log_writer_max_nap_ms);
+		}
+		else
+		{
+			nap_ms = log_writer_min_nap_ms;
+		}
+	}
+}
+
+void logger::start_async(log_overflow_t overflow, size_t ring_records)
+{
+	if (m_async.load())
+		return;
+
+	m_overflow = overflow;
+	m_ring_records = ring_records;
+	++m_generation;
+	m_stopping.store(false);
+	m_async.store(true, std::memory_order_release);
+	m_writer = std::thread(&logger::writer_main, this);
+}
+
+void logger::stop_async()
+{
+	if (!m_async.load())
+		return;
+
+	/* records other threads push from here on are never written */
+	m_async.store(false, std::memory_order_release);
+	m_stopping.store(true, std::memory_order_release);
+	m_wake.notify_one();
+	m_writer.join();
+
+	/* threads still holding a ring free it when they exit or log again */
+	std::lock_guard<std::mutex> lock(m_rings_lock);
+	m_rings.clear();
+
+	/* flushes that raced the shutdown have nothing left to wait for */
+	std::lock_guard<std::mutex> wake_lock(m_wake_lock);
+	m_flush_completed = m_flush_requested;
+	m_flushed.notify_all();
+}
+
+void log_limit_t::enlist()
+{
+	bool expected = false;
+	if (!registered.compare_exchange_strong(expected, true))
+		return;
+
+	/* sites are statics, so the list is only ever pushed to */
+	log_limit_t *head = s_sites.load(std::memory_order_relaxed);
+	do
+	{
+		next_site = head;
+	} while (!s_sites.compare_exchange_weak(head, this, std::memory_order_release, std::memory_order_relaxed));
+}
+
+uint64_t log_limit_t::take_suppressed(int64_t now)
+{
+	int64_t last = reported.load(std::memory_order_relaxed);
+	if (now - last < log_summary_interval_ms * (log_limit_second / 1000))
+		return 0;
+	if (!reported.compare_exchange_strong(last, now, std::memory_order_relaxed))
+		return 0;
+	return suppressed.exchange(0, std::memory_order_relaxed);
+}
+
+void log_limit_t::report_suppressed()
+{
+	uint64_t count = take_suppressed(log_limit_now());
+	if (count != 0)
+		log(log_warning, "%s:%d : suppressed %llu messages\n", file, line, (unsigned long long)count);
+}
+
 void logger::close()
 {
 	if (m_fp != NULL)
@@ -279,6 +826,7 @@ void logger::close()
 
 logger::~logger()
 {
+	stop_async();
 	close();
 }
 
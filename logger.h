@@ -1,31 +1,74 @@
 #pragma once
 #include <string>
 #include <stdio.h>
+#include <stdint.h>
 #include <iosfwd>
 #include <ostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "logger_decls.h"
+#include "spsc_ring.h"
 
 const char *logstr(log_level_t ll);
 void time_now(std::ostream &os, bool exact, bool for_humans);
 void append_time(std::ostream &os, double time_exact, bool exact, bool for_humans, const char sep = '\t');
 
-// single-threaded logger is not safe to use in a multi-threaded app
+/* what a producer does when its ring is full */
+enum log_overflow_t
+{
+	log_overflow_drop,
+	log_overflow_block,
+};
+
+struct log_site_t;
+
+/* one log line waiting for the writer thread. structured records carry
+ * their call site and the raw encoded arguments instead of text */
+struct log_record_t
+{
+	log_level_t level;
+	const log_site_t *site;
+	double time;
+	uint16_t length;
+	char text[480];
+};
+
+/* one producer thread's ring. the thread marks it orphaned as it exits,
+ * and the writer frees it once it has drained */
+struct log_ring_t : public spsc_ring_t<log_record_t>
+{
+	log_ring_t(size_t capacity) : spsc_ring_t<log_record_t>(capacity), orphaned(false) {}
+	std::atomic<bool> orphaned;
+};
+
+// synchronous by default. once start_async is called, any thread may log:
+// each producer thread pushes into its own lock-free ring, and a background
+// thread writes the rings out in batches.
 class logger
 {
 public:
 	logger(const std::string &name, const std::string &root_file_path);
 	~logger();
 
-	void logv(log_level_t level, const char *format, va_list args);
-	void log(log_level_t level, const char *format, ...);
+	void logv(log_level_t level, const char *format, va_list args) LOG_PRINTF(3, 0);
+	void log(log_level_t level, const char *format, ...) LOG_PRINTF(3, 4);
 	void close();
 	void open();
 	void flush();
 	void call_logging_function(void (*func)(FILE *));
 
+	void start_async(log_overflow_t overflow = log_overflow_drop, size_t ring_records = 4096);
+	void stop_async();
+	uint64_t dropped_records() const { return m_dropped.load(std::memory_order_relaxed); }
+
 	friend void log(log_level_t level, const char *format, ...);
 	friend void log(void (*func)(FILE *));
 	friend void log_flush();
+	friend void log_structured_commit(const log_site_t *site, const char *args, size_t length);
 
 private:
 	static logger *s_plogger;
@@ -34,5 +77,36 @@ private:
 	std::string m_current_logfile;
 	FILE *m_fp;
 	int m_entries;
-};
 
+	void push_async(log_level_t level, const char *format, va_list args) LOG_PRINTF(3, 0);
+	void push_structured(const log_site_t *site, const char *args, size_t length);
+	void push_backtrace(log_ring_t *ring);
+	void append_summaries(std::string &batch);
+	log_ring_t *thread_ring();
+	size_t drain_rings(std::string &batch);
+	void writer_main();
+
+	std::atomic<bool> m_async;
+	std::atomic<bool> m_stopping;
+	log_overflow_t m_overflow;
+	size_t m_ring_records;
+	unsigned m_generation;
+	std::thread m_writer;
+
+	/* guards m_rings (registration and retirement only, never the hot
+	 * path). a ring is shared with its thread, so either can let go first */
+	std::mutex m_rings_lock;
+	std::vector<std::shared_ptr<log_ring_t>> m_rings;
+
+	/* guards the file for sync logging, the writer and call_logging_function */
+	std::mutex m_file_lock;
+
+	std::mutex m_wake_lock;
+	std::condition_variable m_wake;
+	std::condition_variable m_flushed;
+	uint64_t m_flush_requested;
+	uint64_t m_flush_completed;
+
+	std::atomic<uint64_t> m_dropped;
+	uint64_t m_dropped_reported;
+};
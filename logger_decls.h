@@ -10,16 +10,42 @@ enum log_level_t
 	log_error = 4,
 };
 
+#define LOG_PRINTF(format_index, first_arg) __attribute__((format(printf, format_index, first_arg)))
+
 void log_enable(int log_level);
-void log(log_level_t level, const char *format, ...);
+void log(log_level_t level, const char *format, ...) LOG_PRINTF(2, 3);
 void log(void (*func)(FILE *));
 void log_flush();
 
+extern int logger_level;
+
+/* levels below LOG_MIN_LEVEL are compiled out of dlog/slog sites entirely.
+ * override with -DLOG_MIN_LEVEL=log_error (or make LOG_MIN_LEVEL=...) */
+#ifndef LOG_MIN_LEVEL
+#ifdef DEBUG
+#define LOG_MIN_LEVEL log_info
+#else
+#define LOG_MIN_LEVEL log_warning
+#endif
+#endif
+
+constexpr bool log_compiled(log_level_t level)
+{
+	return (level == log_direct) || (level >= LOG_MIN_LEVEL);
+}
+
+/* both tests happen before any of the arguments are evaluated, so a disabled
+ * site costs a load and a branch, and a compiled out one costs nothing */
+#define log_at(level, params...) \
+	do { \
+		if (log_compiled(level) && (logger_level & (level))) \
+			log(level, params); \
+	} while (0)
+
+#define dlog(params...) log_at(params)
+
 #ifdef DEBUG
-#define dlog(params...) log(params)
 #define dlog_assert(expr, params...) do { if (!(expr)) log(log_error, params); } while (0)
 #else
-#define dlog(params...)
 #define dlog_assert(expr, params...)
 #endif
-
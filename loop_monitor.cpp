@@ -0,0 +1,225 @@
+#include "loop_monitor.h"
+#include "clock_source.h"
+#include "http_server.h"
+#include "log_limit.h"
+#include "logger_decls.h"
+#include "utils.h"
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+static thread_local loop_monitor_t *t_loop_monitor = nullptr;
+
+loop_monitor_t::loop_monitor_t(uv_loop_t *loop, uint64_t slow_tick_ns)
+	: m_loop(loop), m_slow_tick_ns(slow_tick_ns), m_prepare_ns(0), m_check_ns(0), m_first_callback_ns(0),
+	  m_tick_busy_ns(0), m_tick_poll_ns(0), m_polling(false), m_scope_depth(0), m_scope_start_ns(0),
+	  m_scope_name(nullptr), m_longest_ns(0), m_longest_name(nullptr), m_lag_expected_ns(0), m_slow_ticks(loop_monitor_slow_tick_history), m_slow_tick_next(0)
+{
+	m_prepare = new uv_prepare_t;
+	uv_prepare_init(m_loop, m_prepare);
+	m_prepare->data = this;
+	uv_prepare_start(m_prepare, on_prepare);
+	uv_unref((uv_handle_t *)m_prepare);
+
+	m_check = new uv_check_t;
+	uv_check_init(m_loop, m_check);
+	m_check->data = this;
+	uv_check_start(m_check, on_check);
+	uv_unref((uv_handle_t *)m_check);
+
+	m_lag_timer = new uv_timer_t;
+	uv_timer_init(m_loop, m_lag_timer);
+	m_lag_timer->data = this;
+	uv_timer_start(m_lag_timer, on_lag_timer, loop_monitor_lag_interval_ms, loop_monitor_lag_interval_ms);
+	uv_unref((uv_handle_t *)m_lag_timer);
+
+	t_loop_monitor = this;
+}
+
+static void loop_monitor_prepare_close(uv_handle_t *handle)
+{
+	delete (uv_prepare_t *)handle;
+}
+
+static void loop_monitor_check_close(uv_handle_t *handle)
+{
+	delete (uv_check_t *)handle;
+}
+
+static void loop_monitor_timer_close(uv_handle_t *handle)
+{
+	delete (uv_timer_t *)handle;
+}
+
+loop_monitor_t::~loop_monitor_t()
+{
+	if (t_loop_monitor == this)
+		t_loop_monitor = nullptr;
+
+	uv_prepare_stop(m_prepare);
+	uv_close((uv_handle_t *)m_prepare, loop_monitor_prepare_close);
+	uv_check_stop(m_check);
+	uv_close((uv_handle_t *)m_check, loop_monitor_check_close);
+	uv_timer_stop(m_lag_timer);
+	uv_close((uv_handle_t *)m_lag_timer, loop_monitor_timer_close);
+}
+
+loop_monitor_t *loop_monitor_t::current()
+{
+	return t_loop_monitor;
+}
+
+void loop_monitor_t::on_prepare(uv_prepare_t *handle, int status)
+{
+	loop_monitor_t *monitor = (loop_monitor_t *)handle->data;
+	uint64_t now_ns = clock_fast_ns();
+
+	/* timers, idles and closes since the check all count as busy */
+	if (monitor->m_check_ns != 0)
+	{
+		monitor->m_tick_busy_ns += now_ns - monitor->m_check_ns;
+		monitor->end_tick(now_ns);
+	}
+
+	monitor->m_prepare_ns = now_ns;
+	monitor->m_first_callback_ns = 0;
+	monitor->m_polling = true;
+}
+
+void loop_monitor_t::on_check(uv_check_t *handle, int status)
+{
+	loop_monitor_t *monitor = (loop_monitor_t *)handle->data;
+	uint64_t now_ns = clock_fast_ns();
+	if (monitor->m_prepare_ns == 0)
+		return;
+
+	uint64_t poll_end_ns = monitor->m_first_callback_ns ? monitor->m_first_callback_ns : now_ns;
+	monitor->m_tick_poll_ns += poll_end_ns - monitor->m_prepare_ns;
+	monitor->m_tick_busy_ns += now_ns - poll_end_ns;
+	monitor->m_check_ns = now_ns;
+	monitor->m_polling = false;
+}
+
+void loop_monitor_t::on_lag_timer(uv_timer_t *handle, int status)
+{
+	loop_monitor_t *monitor = (loop_monitor_t *)handle->data;
+	uint64_t now_ns = clock_fast_ns();
+	if (monitor->m_lag_expected_ns != 0)
+	{
+		uint64_t lag_ns = (now_ns > monitor->m_lag_expected_ns) ? now_ns - monitor->m_lag_expected_ns : 0;
+		auto &stats = monitor->m_stats;
+		++stats.lag_samples;
+		stats.lag_last_ns = lag_ns;
+		stats.lag_total_ns += lag_ns;
+		stats.lag_max_ns = std::max(stats.lag_max_ns, lag_ns);
+	}
+	monitor->m_lag_expected_ns = now_ns + loop_monitor_lag_interval_ms * 1000000ull;
+}
+
+void loop_monitor_t::end_tick(uint64_t now_ns)
+{
+	m_stats.ticks++;
+	m_stats.busy_ns += m_tick_busy_ns;
+	m_stats.poll_ns += m_tick_poll_ns;
+	m_stats.max_busy_ns = std::max(m_stats.max_busy_ns, m_tick_busy_ns);
+
+	if (m_tick_busy_ns >= m_slow_tick_ns)
+	{
+		m_stats.slow_ticks++;
+		loop_slow_tick_t &slow_tick = m_slow_ticks[m_slow_tick_next % m_slow_ticks.size()];
+		++m_slow_tick_next;
+		slow_tick.time = get_current_time();
+		slow_tick.busy_ns = m_tick_busy_ns;
+		slow_tick.poll_ns = m_tick_poll_ns;
+		slow_tick.callback_ns = m_longest_ns;
+		snprintf(slow_tick.callback, sizeof(slow_tick.callback), "%s",
+				m_longest_name ? m_longest_name : "(unscoped)");
+
+		log_limited(log_warning, 1, "loop_monitor_t : %.1f ms tick, longest callback %s took %.1f ms\n",
+				m_tick_busy_ns / 1e6, slow_tick.callback, m_longest_ns / 1e6);
+	}
+
+	m_tick_busy_ns = 0;
+	m_tick_poll_ns = 0;
+	m_longest_ns = 0;
+	m_longest_name = nullptr;
+}
+
+std::vector<loop_slow_tick_t> loop_monitor_t::slow_ticks() const
+{
+	std::vector<loop_slow_tick_t> slow_ticks;
+	size_t count = std::min(m_slow_tick_next, m_slow_ticks.size());
+	for (size_t i = m_slow_tick_next - count; i < m_slow_tick_next; ++i)
+		slow_ticks.push_back(m_slow_ticks[i % m_slow_ticks.size()]);
+	return slow_ticks;
+}
+
+std::string loop_monitor_t::report_json() const
+{
+	char buffer[512];
+	snprintf(buffer, sizeof(buffer),
+			"{\"ticks\":%llu,\"busy_ms\":%.3f,\"poll_ms\":%.3f,\"max_busy_ms\":%.3f,\"slow_ticks\":%llu,"
+			"\"lag_last_ms\":%.3f,\"lag_max_ms\":%.3f,\"lag_mean_ms\":%.3f,\"slow\":[",
+			(unsigned long long)m_stats.ticks, m_stats.busy_ns / 1e6, m_stats.poll_ns / 1e6,
+			m_stats.max_busy_ns / 1e6, (unsigned long long)m_stats.slow_ticks,
+			m_stats.lag_last_ns / 1e6, m_stats.lag_max_ns / 1e6,
+			m_stats.lag_samples ? m_stats.lag_total_ns / 1e6 / m_stats.lag_samples : 0.0);
+	std::string json = buffer;
+
+	const char *separator = "";
+	for (auto &slow_tick : slow_ticks())
+	{
+		/* route names come from the server's own routes, no escaping needed */
+		snprintf(buffer, sizeof(buffer),
+				"%s{\"time\":%.3f,\"busy_ms\":%.3f,\"poll_ms\":%.3f,\"callback\":\"%s\",\"callback_ms\":%.3f}",
+				separator, slow_tick.time, slow_tick.busy_ns / 1e6, slow_tick.poll_ns / 1e6,
+				slow_tick.callback, slow_tick.callback_ns / 1e6);
+		json += buffer;
+		separator = ",";
+	}
+	json += "]}";
+	return json;
+}
+
+loop_monitor_scope_t::loop_monitor_scope_t(const char *name)
+	: m_monitor(t_loop_monitor)
+{
+	if (m_monitor == nullptr || m_monitor->m_scope_depth++ != 0)
+		return;
+
+	uint64_t now_ns = clock_fast_ns();
+	m_monitor->m_scope_start_ns = now_ns;
+	m_monitor->m_scope_name = name;
+	if (m_monitor->m_polling && m_monitor->m_first_callback_ns == 0)
+		m_monitor->m_first_callback_ns = now_ns;
+}
+
+loop_monitor_scope_t::~loop_monitor_scope_t()
+{
+	if (m_monitor == nullptr || --m_monitor->m_scope_depth != 0)
+		return;
+
+	uint64_t elapsed_ns = clock_fast_ns() - m_monitor->m_scope_start_ns;
+	if (elapsed_ns > m_monitor->m_longest_ns)
+	{
+		m_monitor->m_longest_ns = elapsed_ns;
+		m_monitor->m_longest_name = m_monitor->m_scope_name;
+	}
+}
+
+void loop_monitor_attribute(const char *name)
+{
+	loop_monitor_t *monitor = t_loop_monitor;
+	if (monitor != nullptr && monitor->m_scope_depth != 0)
+		monitor->m_scope_name = name;
+}
+
+void loop_monitor_serve(const std::string &path)
+{
+	http_use_route(path, HTTP_GET, [](const http_request_ptr_t &request, const http_response_ptr_t &response) {
+		loop_monitor_t *monitor = loop_monitor_t::current();
+		response->set_response(200, "OK", "application/json");
+		response->send(monitor ? monitor->report_json() : std::string("{}"));
+		response->end();
+	});
+}
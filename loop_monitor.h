@@ -0,0 +1,126 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <uv.h>
+#include "nocopy.h"
+
+/* a tick that spent longer than the threshold outside the poll */
+struct loop_slow_tick_t
+{
+	double time;		/* wall clock seconds when it ended */
+	uint64_t busy_ns;
+	uint64_t poll_ns;
+
+	/* the longest scoped callback in the tick, named by its route when one
+	 * was attributed */
+	uint64_t callback_ns;
+	char callback[64];
+};
+
+struct loop_monitor_stats_t
+{
+	uint64_t ticks = 0;
+	uint64_t busy_ns = 0;
+	uint64_t poll_ns = 0;
+	uint64_t max_busy_ns = 0;
+	uint64_t slow_ticks = 0;
+
+	/* how late the lag timer fires */
+	uint64_t lag_samples = 0;
+	uint64_t lag_last_ns = 0;
+	uint64_t lag_max_ns = 0;
+	uint64_t lag_total_ns = 0;
+};
+
+const int loop_monitor_slow_tick_ms = 50;
+const int loop_monitor_lag_interval_ms = 100;
+const size_t loop_monitor_slow_tick_history = 64;
+
+/* watches one loop's iterations. a prepare handle runs just before the loop
+ * polls and a check handle just after, so prepare to check is the poll and
+ * check to the next prepare is timers, closes and the like. io callbacks
+ * run inside the poll though, so every io callback of the server, proxy,
+ * client, dns, connect and file layers opens a loop_monitor_scope_t: the
+ * poll is taken to end where the first of them starts, and the rest of the
+ * tick counts as busy. prepare callbacks run before the poll, so they
+ * mustn't open one. a repeating timer measures scheduling lag. (no idle
+ * handle: an active one stops the loop from ever blocking in the poll.)
+ *
+ * create it on the loop's thread, which it then belongs to. its handles
+ * are unreferenced, so it doesn't keep the loop alive. */
+class loop_monitor_t
+{
+public:
+	NOCOPY(loop_monitor_t);
+	loop_monitor_t(uv_loop_t *loop, uint64_t slow_tick_ns = loop_monitor_slow_tick_ms * 1000000ull);
+	~loop_monitor_t();
+
+	const loop_monitor_stats_t &stats() const { return m_stats; }
+
+	/* the most recent slow ticks, oldest first */
+	std::vector<loop_slow_tick_t> slow_ticks() const;
+
+	std::string report_json() const;
+
+	/* the monitor on the calling thread, nullptr if there isn't one */
+	static loop_monitor_t *current();
+
+private:
+	friend class loop_monitor_scope_t;
+	friend void loop_monitor_attribute(const char *name);
+
+	static void on_prepare(uv_prepare_t *handle, int status);
+	static void on_check(uv_check_t *handle, int status);
+	static void on_lag_timer(uv_timer_t *handle, int status);
+	void end_tick(uint64_t now_ns);
+
+	uv_loop_t *m_loop;
+	uv_prepare_t *m_prepare;
+	uv_check_t *m_check;
+	uv_timer_t *m_lag_timer;
+	uint64_t m_slow_tick_ns;
+
+	/* the tick under way */
+	uint64_t m_prepare_ns;
+	uint64_t m_check_ns;
+	uint64_t m_first_callback_ns;
+	uint64_t m_tick_busy_ns;
+	uint64_t m_tick_poll_ns;
+	bool m_polling;
+
+	/* the outermost open scope, and the longest this tick. names aren't
+	 * copied until a tick turns out to be slow. */
+	int m_scope_depth;
+	uint64_t m_scope_start_ns;
+	const char *m_scope_name;
+	uint64_t m_longest_ns;
+	const char *m_longest_name;
+
+	uint64_t m_lag_expected_ns;
+
+	loop_monitor_stats_t m_stats;
+	std::vector<loop_slow_tick_t> m_slow_ticks;
+	size_t m_slow_tick_next;
+};
+
+/* times a callback on the current thread's loop monitor, if there is one.
+ * scopes opened inside another only count towards the outermost. */
+class loop_monitor_scope_t
+{
+public:
+	NOCOPY(loop_monitor_scope_t);
+	/* name has to outlast the tick */
+	explicit loop_monitor_scope_t(const char *name);
+	~loop_monitor_scope_t();
+
+private:
+	loop_monitor_t *m_monitor;
+};
+
+/* renames the outermost open scope, e.g. with the route it dispatched to.
+ * name has to outlast the tick. */
+void loop_monitor_attribute(const char *name);
+
+/* serves the current thread's monitor's report_json at path */
+void loop_monitor_serve(const std::string &path);
@@ -0,0 +1,134 @@
+#include "mapped_file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logger_decls.h"
+
+mapped_file_t::mapped_file_t()
+	: m_fd(-1), m_mode(mapped_file_read), m_hints(0), m_file_size(0),
+	m_base(MAP_FAILED), m_base_length(0), m_begin(nullptr), m_length(0), m_offset(0)
+{
+}
+
+mapped_file_t::~mapped_file_t()
+{
+	close();
+}
+
+bool mapped_file_t::open(const std::string &path, mapped_file_mode_t mode, int hints)
+{
+	close();
+
+	int flags = ((mode == mapped_file_read_write) ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+	m_fd = ::open(path.c_str(), flags);
+	if (m_fd == -1)
+	{
+		dlog(log_info, "mapped_file_t : couldn't open %s (%s)\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+	{
+		close();
+		return false;
+	}
+
+	m_mode = mode;
+	m_hints = hints;
+	m_file_size = st.st_size;
+	return true;
+}
+
+void mapped_file_t::close()
+{
+	unmap();
+	if (m_fd != -1)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_file_size = 0;
+}
+
+bool mapped_file_t::map(uint64_t offset, size_t length)
+{
+	unmap();
+	if (m_fd == -1 || offset > m_file_size)
+		return false;
+
+	if (length == 0 || length > m_file_size - offset)
+		length = m_file_size - offset;
+
+	m_offset = offset;
+	if (length == 0)
+		return true;
+
+	/* mmap wants a page aligned offset, the slack is hidden from callers */
+	static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t base_offset = offset - (offset % page_size);
+	size_t slack = offset - base_offset;
+
+	int prot = PROT_READ | ((m_mode == mapped_file_read_write) ? PROT_WRITE : 0);
+	int flags = (m_mode == mapped_file_read_write) ? MAP_SHARED : MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	if (m_hints & mapped_file_populate)
+		flags |= MAP_POPULATE;
+#endif
+
+	m_base = mmap(NULL, length + slack, prot, flags, m_fd, base_offset);
+	if (m_base == MAP_FAILED)
+	{
+		dlog(log_info, "mapped_file_t : mmap of %zu bytes failed (%s)\n", length + slack, strerror(errno));
+		return false;
+	}
+	m_base_length = length + slack;
+	m_begin = (char *)m_base + slack;
+	m_length = length;
+
+	if (m_hints & mapped_file_sequential)
+		madvise(m_base, m_base_length, MADV_SEQUENTIAL);
+	if (m_hints & mapped_file_random)
+		madvise(m_base, m_base_length, MADV_RANDOM);
+	if (m_hints & mapped_file_willneed)
+		madvise(m_base, m_base_length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	if (m_hints & mapped_file_huge_pages)
+		madvise(m_base, m_base_length, MADV_HUGEPAGE);
+#endif
+	return true;
+}
+
+void mapped_file_t::unmap()
+{
+	if (m_base != MAP_FAILED)
+	{
+		munmap(m_base, m_base_length);
+		m_base = MAP_FAILED;
+	}
+	m_base_length = 0;
+	m_begin = nullptr;
+	m_length = 0;
+	m_offset = 0;
+}
+
+bool mapped_file_t::map_file(const std::string &path, mapped_file_mode_t mode, int hints)
+{
+	return open(path, mode, hints) && map();
+}
+
+bool mapped_file_t::stat(struct stat &st) const
+{
+	return (m_fd != -1) && (fstat(m_fd, &st) == 0);
+}
+
+bool mapped_file_t::flush(bool sync)
+{
+	if (m_base == MAP_FAILED || m_mode != mapped_file_read_write)
+		return true;
+
+	return msync(m_base, m_base_length, sync ? MS_SYNC : MS_ASYNC) == 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include "nocopy.h"
+
+enum mapped_file_mode_t
+{
+	mapped_file_read,
+	mapped_file_read_write,
+};
+
+/* advice for the mappings, combine with | */
+enum mapped_file_hint_t
+{
+	mapped_file_sequential = 1,	/* MADV_SEQUENTIAL, aggressive readahead */
+	mapped_file_willneed = 2,	/* MADV_WILLNEED, start reading now */
+	mapped_file_populate = 4,	/* MAP_POPULATE, fault everything in up front */
+	mapped_file_huge_pages = 8,	/* MADV_HUGEPAGE, where the filesystem allows it */
+	mapped_file_random = 16,	/* MADV_RANDOM, no readahead */
+};
+
+/* an open file and a mapping of some or all of it. files larger than
+ * you'd like in the address space at once can be walked a window at a
+ * time by calling map again, which replaces the previous mapping. writes
+ * through a read_write mapping land in the file; the file isn't resized. */
+class mapped_file_t
+{
+public:
+	NOCOPY(mapped_file_t);
+	mapped_file_t();
+	~mapped_file_t();
+
+	bool open(const std::string &path, mapped_file_mode_t mode = mapped_file_read,
+			int hints = mapped_file_sequential);
+	void close();
+
+	/* maps length bytes from offset (0 means up to the end of the file).
+	 * offset needn't be page aligned. */
+	bool map(uint64_t offset = 0, size_t length = 0);
+	void unmap();
+
+	/* open and map the whole file */
+	bool map_file(const std::string &path, mapped_file_mode_t mode = mapped_file_read,
+			int hints = mapped_file_sequential);
+
+	bool is_open() const { return m_fd != -1; }
+	bool stat(struct stat &st) const;
+	uint64_t file_size() const { return m_file_size; }
+
+	/* the mapped range, which starts at offset() in the file */
+	const char *begin() const { return m_begin; }
+	const char *end() const { return m_begin + m_length; }
+	char *data() const { return m_begin; }
+	size_t size() const { return m_length; }
+	uint64_t offset() const { return m_offset; }
+
+	/* msync for read_write mappings, waits for the writes when sync */
+	bool flush(bool sync = true);
+
+private:
+	int m_fd;
+	mapped_file_mode_t m_mode;
+	int m_hints;
+	uint64_t m_file_size;
+
+	/* what mmap returned, from a page boundary */
+	void *m_base;
+	size_t m_base_length;
+
+	char *m_begin;
+	size_t m_length;
+	uint64_t m_offset;
+};
@@ -0,0 +1,123 @@
+#include "multi_search.h"
+#include <assert.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+multi_search_t::multi_search_t(const std::vector<search_pattern_t> &patterns)
+	: m_use_simd(false), m_by_first_byte(256)
+{
+	for (auto &pattern : patterns)
+	{
+		/* an empty pattern would match everywhere without advancing */
+		if (pattern.bytes.size() == 0)
+			continue;
+
+		m_patterns.push_back(pattern);
+		if (m_patterns.back().alignment == 0)
+			m_patterns.back().alignment = 1;
+	}
+
+	for (size_t i = 0; i < m_patterns.size(); ++i)
+	{
+		const std::string &bytes = m_patterns[i].bytes;
+		m_by_first_byte[(uint8_t)bytes[0]].push_back(i);
+
+		prefix_t prefix;
+		prefix.first = bytes[0];
+		prefix.has_second = bytes.size() > 1;
+		prefix.second = prefix.has_second ? bytes[1] : 0;
+
+		bool seen = false;
+		for (auto &existing : m_prefixes)
+		{
+			if (existing.first == prefix.first && existing.has_second == prefix.has_second
+					&& existing.second == prefix.second)
+			{
+				seen = true;
+				break;
+			}
+		}
+		if (!seen)
+			m_prefixes.push_back(prefix);
+	}
+
+#if defined(__SSE2__)
+	m_use_simd = (m_prefixes.size() != 0) && (m_prefixes.size() <= multi_search_simd_patterns);
+#endif
+}
+
+bool multi_search_t::check(size_t index, const char *pch_base, const char *pch, const char *pch_end) const
+{
+	const search_pattern_t &pattern = m_patterns[index];
+	return ((size_t)(pch_end - pch) >= pattern.bytes.size())
+		&& (((pch - pch_base) % pattern.alignment) == 0)
+		&& (memcmp(pch, pattern.bytes.c_str(), pattern.bytes.size()) == 0);
+}
+
+bool multi_search_t::match_at(const char *pch_base, const char *pch, const char *pch_end, size_t &pattern) const
+{
+	bool found = false;
+	for (uint16_t index : m_by_first_byte[(uint8_t)*pch])
+	{
+		if (check(index, pch_base, pch, pch_end)
+				&& (!found || m_patterns[index].bytes.size() > m_patterns[pattern].bytes.size()))
+		{
+			pattern = index;
+			found = true;
+		}
+	}
+	return found;
+}
+
+const char *multi_search_t::find(const char *pch_base, const char *pch, const char *pch_end, size_t &pattern) const
+{
+	if (m_patterns.size() == 0)
+		return nullptr;
+
+#if defined(__SSE2__)
+	if (m_use_simd)
+	{
+		__m128i firsts[multi_search_simd_patterns];
+		__m128i seconds[multi_search_simd_patterns];
+		size_t prefixes = m_prefixes.size();
+		for (size_t i = 0; i < prefixes; ++i)
+		{
+			firsts[i] = _mm_set1_epi8(m_prefixes[i].first);
+			seconds[i] = _mm_set1_epi8(m_prefixes[i].second);
+		}
+
+		/* the second load reads one byte past the block */
+		for (; pch + 17 <= pch_end; pch += 16)
+		{
+			__m128i block = _mm_loadu_si128((const __m128i *)pch);
+			__m128i next = _mm_loadu_si128((const __m128i *)(pch + 1));
+
+			unsigned mask = 0;
+			for (size_t i = 0; i < prefixes; ++i)
+			{
+				__m128i hits = _mm_cmpeq_epi8(block, firsts[i]);
+				if (m_prefixes[i].has_second)
+					hits = _mm_and_si128(hits, _mm_cmpeq_epi8(next, seconds[i]));
+				mask |= _mm_movemask_epi8(hits);
+			}
+
+			while (mask != 0)
+			{
+				const char *candidate = pch + __builtin_ctz(mask);
+				if (match_at(pch_base, candidate, pch_end, pattern))
+					return candidate;
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+
+	for (; pch < pch_end; ++pch)
+	{
+		if (m_by_first_byte[(uint8_t)*pch].size() != 0 && match_at(pch_base, pch, pch_end, pattern))
+			return pch;
+	}
+	return nullptr;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct search_pattern_t
+{
+	std::string bytes;
+
+	/* matches must start at a multiple of this from the start of the
+	 * buffer, 2 for UTF-16 code units */
+	unsigned alignment;
+};
+
+/* finds any of a set of byte patterns in a single pass. with up to
+ * multi_search_simd_patterns patterns, each 16 byte block is screened with
+ * SSE2 compares against every pattern's first two bytes (a cut down Teddy),
+ * and only the positions that pass are compared in full. larger sets fall
+ * back to a first byte table. */
+class multi_search_t
+{
+public:
+	explicit multi_search_t(const std::vector<search_pattern_t> &patterns);
+
+	/* the leftmost match at or after pch, the longest pattern when several
+	 * start at the same place. nullptr if there is none. pch_base is where
+	 * the buffer starts, for alignment. */
+	const char *find(const char *pch_base, const char *pch, const char *pch_end, size_t &pattern) const;
+
+	const search_pattern_t &pattern(size_t index) const { return m_patterns[index]; }
+	size_t size() const { return m_patterns.size(); }
+
+private:
+	bool match_at(const char *pch_base, const char *pch, const char *pch_end, size_t &pattern) const;
+	bool check(size_t index, const char *pch_base, const char *pch, const char *pch_end) const;
+
+	std::vector<search_pattern_t> m_patterns;
+
+	/* the distinct leading byte pairs, for the SSE2 screen */
+	struct prefix_t
+	{
+		uint8_t first;
+		uint8_t second;
+		bool has_second;
+	};
+	std::vector<prefix_t> m_prefixes;
+	bool m_use_simd;
+
+	/* the patterns starting with each byte, for the scalar path */
+	std::vector<std::vector<uint16_t>> m_by_first_byte;
+};
+
+const size_t multi_search_simd_patterns = 8;
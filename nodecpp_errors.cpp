@@ -1,5 +1,6 @@
 #include "nodecpp_errors.h"
 #include "logger_decls.h"
+#include "log_limit.h"
 #include <uv.h>
 #include "utils.h"
 
@@ -8,7 +9,7 @@ void log_uv_errors()
 	auto uv_error = uv_last_error(uv_default_loop());
 	if (uv_error.code != UV_OK)
 	{
-		log(log_error, "uv errored with %d (see UV_ERRNO_MAP)\n", uv_error);
+		log_limited(log_error, 10, "uv errored with %d (see UV_ERRNO_MAP)\n", uv_error.code);
 	}
 	else
 	{
@@ -0,0 +1,66 @@
+#include "object_census.h"
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+
+static std::atomic<object_census_entry_t *> s_object_census_head(nullptr);
+
+object_census_entry_t::object_census_entry_t(const std::type_info &type, size_t object_size)
+	: type(type), object_size(object_size), live(0), peak(0), total(0), next_instance_id(0), next(nullptr)
+{
+	next = s_object_census_head.load(std::memory_order_relaxed);
+	while (!s_object_census_head.compare_exchange_weak(next, this,
+				std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+static std::string object_census_name(const std::type_info &type)
+{
+	int status = 0;
+	char *demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+	std::string name = (status == 0 && demangled != nullptr) ? demangled : type.name();
+	free(demangled);
+	return name;
+}
+
+std::vector<object_census_count_t> object_census()
+{
+	std::vector<object_census_count_t> counts;
+	for (object_census_entry_t *entry = s_object_census_head.load(std::memory_order_acquire);
+			entry != nullptr; entry = entry->next)
+	{
+		counts.push_back({
+				object_census_name(entry->type),
+				entry->object_size,
+				entry->live.load(std::memory_order_relaxed),
+				entry->peak.load(std::memory_order_relaxed),
+				entry->total.load(std::memory_order_relaxed) });
+	}
+
+	std::sort(counts.begin(), counts.end(),
+			[](const object_census_count_t &a, const object_census_count_t &b) { return a.name < b.name; });
+	return counts;
+}
+
+std::string object_census_json()
+{
+	std::stringstream ss;
+	ss << "[";
+	const char *separator = "";
+	for (auto &count : object_census())
+	{
+		/* type names have no quotes or backslashes to escape */
+		ss << separator << "{\"type\":\"" << count.name << "\""
+			<< ",\"size\":" << count.object_size
+			<< ",\"live\":" << count.live
+			<< ",\"peak\":" << count.peak
+			<< ",\"total\":" << count.total
+			<< ",\"live_bytes\":" << count.live_bytes()
+			<< ",\"peak_bytes\":" << count.peak_bytes() << "}";
+		separator = ",";
+	}
+	ss << "]";
+	return ss.str();
+}
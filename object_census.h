@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <stdint.h>
+#include "logger_decls.h"
+
+/* live, peak and total objects of each counted type. every type gets one
+ * entry, registered the first time one of its objects is made, and the
+ * entries are only ever added to, so they can be read from any thread while
+ * objects come and go. the counters are relaxed atomics: a reading is a
+ * consistent picture of each counter, not of all of them at once. */
+struct object_census_entry_t
+{
+	object_census_entry_t(const std::type_info &type, size_t object_size);
+
+	void created()
+	{
+		uint64_t now_live = live.fetch_add(1, std::memory_order_relaxed) + 1;
+		total.fetch_add(1, std::memory_order_relaxed);
+		uint64_t seen_peak = peak.load(std::memory_order_relaxed);
+		while (now_live > seen_peak
+				&& !peak.compare_exchange_weak(seen_peak, now_live, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void destroyed()
+	{
+		live.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	const std::type_info &type;
+	size_t object_size;
+	std::atomic<uint64_t> live;
+	std::atomic<uint64_t> peak;
+	std::atomic<uint64_t> total;
+	std::atomic<unsigned> next_instance_id;
+	object_census_entry_t *next;
+};
+
+struct object_census_count_t
+{
+	std::string name;
+	size_t object_size;
+	uint64_t live;
+	uint64_t peak;
+	uint64_t total;
+
+	/* live and peak in bytes of the objects themselves, not of whatever
+	 * they point at */
+	uint64_t live_bytes() const { return live * object_size; }
+	uint64_t peak_bytes() const { return peak * object_size; }
+};
+
+/* every counted type, by name */
+std::vector<object_census_count_t> object_census();
+
+/* object_census as a JSON array, for an admin endpoint */
+std::string object_census_json();
+
+/* mix in to have a type counted. T_Max, if set, is how many objects are
+ * expected at most, and going over is logged in debug builds. */
+template <class T, unsigned int T_Max = 0>
+class static_count
+{
+protected:
+	static object_census_entry_t &census()
+	{
+		static object_census_entry_t entry(typeid(T), sizeof(T));
+		return entry;
+	}
+
+	static_count() : instance_id(census().next_instance_id.fetch_add(1, std::memory_order_relaxed) + 1)
+	{
+		census().created();
+#ifdef DEBUG
+		if ((int)T_Max > 0 && class_instance_count() > T_Max)
+			dlog(log_info, "%s : unexpected : too many objects exist.\n", __PRETTY_FUNCTION__);
+#endif
+	}
+
+	static_count(const static_count &) : static_count()
+	{
+	}
+
+	~static_count()
+	{
+		census().destroyed();
+	}
+
+public:
+	static unsigned int class_instance_count()
+	{
+		return (unsigned int)census().live.load(std::memory_order_relaxed);
+	}
+
+	unsigned int instance_id;
+};
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -9,20 +10,78 @@
 #include "cmd_options.h"
 #include "disk.h"
 #include "utils.h"
+#include "object_census.h"
+#include "http_metrics.h"
+#include "loop_monitor.h"
 #include <uv.h>
 #include <functional>
 #include <assert.h>
 #include "http.h"
+#include "dns_cache.h"
+#include "http_proxy.h"
+#include "clock_cache.h"
+#include "clock_source.h"
+#include "access_log.h"
+#include "async_fs.h"
 
 const char *option_get = "GET";
 const char *option_verbose = "verbose";
+const char *option_hosts = "hosts-file";
+const char *option_upstream = "upstream";
+const char *option_access_log = "access-log";
+const char *option_read_bench = "read-bench";
 
 cmd_option_t cmd_options[] =
 {
 	{ option_get, "-g" /*opt*/, false /*mandatory*/, true /*has_data*/ },
 	{ option_verbose, "-v" /*opt*/, false /*mandatory*/, false /*has_data*/ },
+	{ option_hosts, "-H" /*opt*/, false /*mandatory*/, true /*has_data*/ },
+	{ option_upstream, "-u" /*opt*/, false /*mandatory*/, true /*has_data*/ },
+	{ option_access_log, "-a" /*opt*/, false /*mandatory*/, true /*has_data*/ },
+	{ option_read_bench, "-F" /*opt*/, false /*mandatory*/, true /*has_data*/ },
 };
 
+/* reads every file in dir at once, on the threadpool and then through io_uring */
+static void bench_async_reads(const std::string &dir)
+{
+	std::vector<std::string> leaf_names;
+	async_fs_readdir(dir, [&leaf_names](int status, std::vector<std::string> &&names) {
+		if (status != 0)
+			log(log_error, "couldn't read directory\n");
+		leaf_names = std::move(names);
+	});
+	uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+	const async_fs_backend_t backends[] = { async_fs_threadpool, async_fs_uring };
+	for (auto requested : backends)
+	{
+		if (async_fs_init(uv_default_loop(), requested) != requested)
+		{
+			log(log_error, "io_uring isn't available here\n");
+			continue;
+		}
+
+		size_t files = 0, failed = 0, bytes = 0;
+		uint64_t start = clock_fast_ns();
+		for (auto &leaf_name : leaf_names)
+		{
+			async_fs_read_file(dir + "/" + leaf_name, [&](int status, std::string &&data) {
+				if (status != 0)
+					++failed;
+				++files;
+				bytes += data.size();
+			});
+		}
+		uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+		uint64_t elapsed = clock_fast_ns() - start;
+
+		log(log_direct, "%s: %zu files (%zu failed), %zu bytes in %.3f ms\n",
+				(requested == async_fs_uring) ? "io_uring" : "threadpool",
+				files, failed, bytes, elapsed / 1e6);
+	}
+	async_fs_init(uv_default_loop(), async_fs_threadpool);
+}
+
 int main(int argc, char *argv[])
 {
 	cmd_options_t options;
@@ -34,13 +93,35 @@ int main(int argc, char *argv[])
 	else
 		log_enable(log_error);
 
+	/* a client hanging up mid-write must not take the process down */
+	signal(SIGPIPE, SIG_IGN);
+
 	uv_default_loop();
+	clock_cache_bind(uv_default_loop());
+	clock_tsc_calibrate();
 
+	std::string hosts_file;
+	if (get_option(options, option_hosts, hosts_file))
+		dns_cache_load_hosts_file(hosts_file);
+
+	access_log_t *access_log = nullptr;
+	loop_monitor_t *loop_monitor = nullptr;
 	std::string url;
-	if (get_option(options, option_get, url))
+	std::string bench_dir;
+	if (get_option(options, option_read_bench, bench_dir))
+	{
+		bench_async_reads(bench_dir);
+	}
+	else if (get_option(options, option_get, url))
 	{
 		/* issue a GET request */
 		http_get(url, 8080 /*port*/, [](const http_client_response_t &res) {
+			if (res.error != http_client_ok)
+			{
+				log(log_error, "http_get failed with error %d\n", (int)res.error);
+				return;
+			}
+
 			for (auto &field : res.fields)
 			{
 				dlog(log_info, "%s: %s\n", field.key.c_str(),
@@ -59,20 +140,39 @@ int main(int argc, char *argv[])
 			response->end();
 		});
 
+		/* live, peak and total counts of the types that keep a census */
 		http_use_route("/objects", HTTP_GET, [](const http_request_ptr_t &request, const http_response_ptr_t &response) {
 			dlog(log_info, "received get against \"%s\"\n",
 				request->uri_path().c_str());
-			response->set_response(200, "OK", "text/html");
-			std::stringstream ss;
-			ss << "<code>report<br/>test</code>";
-			response->send(ss.str());
+			response->set_response(200, "OK", "application/json");
+			response->send(object_census_json());
 			response->end();
 		});
 
+		http_metrics_serve("/metrics");
+		loop_monitor = new loop_monitor_t(uv_default_loop());
+		loop_monitor_serve("/loop");
+
+		std::string upstream;
+		if (get_option(options, option_upstream, upstream))
+		{
+			/* relay /proxy to upstream, given as host:port */
+			auto colon = upstream.rfind(':');
+			int port = (colon != std::string::npos) ? atoi(upstream.c_str() + colon + 1) : 80;
+			upstream_pool_ptr_t pool(new upstream_pool_t(upstream.substr(0, colon), port));
+			http_proxy_route("/proxy", pool);
+		}
+
+		std::string access_log_path;
+		if (get_option(options, option_access_log, access_log_path))
+			access_log = new access_log_t(access_log_path);
+
 		/* Consider consulting ulimit -aH as a signpost for what's a good backlog? */
 		http_listen(8000 /*port*/, 6000 /*backlog*/);
 	}
 	uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+	delete loop_monitor;
+	delete access_log;
 
 	return EXIT_SUCCESS;
 }
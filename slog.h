@@ -0,0 +1,252 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include "logger_decls.h"
+
+/* structured logging: the call site's format string is a static whose
+ * address is its id, and the arguments are captured raw into a compact
+ * binary record. formatting is deferred to the writer thread when the logger
+ * is async, so the calling thread never runs printf.
+ *
+ *   slog(log_info, "%s : %s\n", __FUNCTION__, log_str(at, length));
+ *
+ * strings are copied (truncated to keep the record small), so pointers to
+ * temporaries are fine. log_str wraps a pointer/length pair without building
+ * a std::string. */
+
+struct log_site_t
+{
+	log_level_t level;
+	const char *format;
+	const char *file;
+	int line;
+};
+
+struct log_str_t
+{
+	const char *data;
+	size_t length;
+};
+
+inline log_str_t log_str(const char *data, size_t length)
+{
+	log_str_t str = { data, length };
+	return str;
+}
+
+enum log_arg_tag_t
+{
+	log_arg_int = 'i',
+	log_arg_uint = 'u',
+	log_arg_double = 'd',
+	log_arg_string = 's',
+	log_arg_pointer = 'p',
+};
+
+struct log_args_t
+{
+	char buffer[472];
+	size_t length = 0;
+
+	void put(char tag, const void *data, size_t size)
+	{
+		if (length + 1 + size > sizeof(buffer))
+			return;
+		buffer[length++] = tag;
+		memcpy(buffer + length, data, size);
+		length += size;
+	}
+
+	void put_string(const char *data, size_t size)
+	{
+		const size_t max_string = 128;
+		uint16_t clipped = (uint16_t)(size < max_string ? size : max_string);
+		if (length + 1 + sizeof(clipped) + clipped > sizeof(buffer))
+			clipped = 0;
+		put(log_arg_string, &clipped, sizeof(clipped));
+		if (length + clipped <= sizeof(buffer))
+		{
+			memcpy(buffer + length, data, clipped);
+			length += clipped;
+		}
+	}
+};
+
+inline void log_encode_one(log_args_t &args, const char *value)
+{
+	if (value == nullptr)
+		value = "(null)";
+	args.put_string(value, strlen(value));
+}
+
+inline void log_encode_one(log_args_t &args, char *value)
+{
+	log_encode_one(args, (const char *)value);
+}
+
+inline void log_encode_one(log_args_t &args, const log_str_t &value)
+{
+	args.put_string(value.data, value.length);
+}
+
+inline void log_encode_one(log_args_t &args, const std::string &value)
+{
+	args.put_string(value.c_str(), value.size());
+}
+
+inline void log_encode_one(log_args_t &args, double value)
+{
+	args.put(log_arg_double, &value, sizeof(value));
+}
+
+template <typename T>
+inline void log_encode_one(log_args_t &args, T *value)
+{
+	const void *pointer = value;
+	args.put(log_arg_pointer, &pointer, sizeof(pointer));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+log_encode_one(log_args_t &args, T value)
+{
+	if (std::is_signed<T>::value || std::is_enum<T>::value)
+	{
+		int64_t widened = (int64_t)value;
+		args.put(log_arg_int, &widened, sizeof(widened));
+	}
+	else
+	{
+		uint64_t widened = (uint64_t)value;
+		args.put(log_arg_uint, &widened, sizeof(widened));
+	}
+}
+
+inline void log_encode(log_args_t &args)
+{
+}
+
+template <typename T, typename... Rest>
+inline void log_encode(log_args_t &args, const T &value, const Rest &... rest)
+{
+	log_encode_one(args, value);
+	log_encode(args, rest...);
+}
+
+/* hands the encoded record to the logger (defined in logger.cpp) */
+void log_structured_commit(const log_site_t *site, const char *args, size_t length);
+
+/* renders a record back into text, used by the writer */
+void log_structured_format(const log_site_t *site, const char *args, size_t length, std::string &text);
+
+template <typename... Args>
+inline void log_structured(const log_site_t *site, const Args &... args)
+{
+	log_args_t encoded;
+	log_encode(encoded, args...);
+	log_structured_commit(site, encoded.buffer, encoded.length);
+}
+
+
+/* compile time format checking. slog arguments aren't plain printf arguments
+ * (log_str_t, std::string), so instead of the printf attribute the format
+ * literal is walked by constexpr functions against the argument types, which
+ * come from an unevaluated decltype. */
+template <typename... Args>
+struct log_types_t
+{
+};
+
+template <typename... Args>
+log_types_t<typename std::decay<Args>::type...> log_format_signature(const Args &...);
+
+enum log_arg_kind_t
+{
+	log_kind_int,
+	log_kind_double,
+	log_kind_string,
+	log_kind_pointer,
+	log_kind_other,
+};
+
+template <typename T>
+constexpr log_arg_kind_t log_arg_kind()
+{
+	return (std::is_integral<T>::value || std::is_enum<T>::value) ? log_kind_int
+		: std::is_floating_point<T>::value ? log_kind_double
+		: (std::is_same<T, const char *>::value || std::is_same<T, char *>::value
+				|| std::is_same<T, log_str_t>::value || std::is_same<T, std::string>::value) ? log_kind_string
+		: std::is_pointer<T>::value ? log_kind_pointer
+		: log_kind_other;
+}
+
+constexpr bool log_format_one_of(char c, const char *set)
+{
+	return (*set != '\0') && ((*set == c) || log_format_one_of(c, set + 1));
+}
+
+constexpr int log_format_spec_end(const char *format, int i)
+{
+	return log_format_one_of(format[i], "-+ #0123456789.hlLqjzt") ? log_format_spec_end(format, i + 1) : i;
+}
+
+/* index of the next conversion character at or after i, or -1 */
+constexpr int log_format_next(const char *format, int i)
+{
+	return (format[i] == '\0') ? -1
+		: (format[i] != '%') ? log_format_next(format, i + 1)
+		: (format[i + 1] == '%') ? log_format_next(format, i + 2)
+		: log_format_spec_end(format, i + 1);
+}
+
+constexpr bool log_format_accepts(char conversion, log_arg_kind_t kind)
+{
+	return log_format_one_of(conversion, "diouxXc") ? (kind == log_kind_int)
+		: log_format_one_of(conversion, "eEfFgGaA") ? (kind == log_kind_double)
+		: (conversion == 's') ? (kind == log_kind_string)
+		: (conversion == 'p') ? (kind == log_kind_pointer || kind == log_kind_string)
+		: false;
+}
+
+template <typename... Args>
+struct log_format_checker;
+
+template <>
+struct log_format_checker<>
+{
+	static constexpr bool check(const char *format, int i)
+	{
+		return log_format_next(format, i) == -1;
+	}
+};
+
+template <typename T, typename... Rest>
+struct log_format_checker<T, Rest...>
+{
+	static constexpr bool check(const char *format, int i)
+	{
+		return (log_format_next(format, i) != -1)
+			&& log_format_accepts(format[log_format_next(format, i)], log_arg_kind<T>())
+			&& log_format_checker<Rest...>::check(format, log_format_next(format, i) + 1);
+	}
+};
+
+template <typename... Args>
+constexpr bool log_format_valid(const char *format, log_types_t<Args...>)
+{
+	return log_format_checker<Args...>::check(format, 0);
+}
+
+#define slog(level, format, params...) \
+	do { \
+		static_assert(log_format_valid(format, decltype(log_format_signature(params))()), \
+				"slog format doesn't match its arguments"); \
+		static const log_site_t _slog_site = { level, format, __FILE__, __LINE__ }; \
+		if (log_compiled(level) && (logger_level & (level))) \
+			log_structured(&_slog_site, ##params); \
+	} while (0)
+
+/* same thing, kept to mirror dlog. both are filtered by LOG_MIN_LEVEL */
+#define dslog(level, format, params...) slog(level, format, ##params)
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <assert.h>
+#include "nocopy.h"
+
+/* bounded single-producer single-consumer ring. the producer claims a slot,
+ * fills it in place and publishes it; the consumer reads the front slot in
+ * place and releases it. neither side ever blocks or takes a lock. */
+template <typename T>
+class spsc_ring_t
+{
+public:
+	NOCOPY(spsc_ring_t);
+	spsc_ring_t(size_t capacity)
+		: m_slots(round_up(capacity)), m_mask(round_up(capacity) - 1), m_head(0), m_tail(0), m_cached_head(0)
+	{
+	}
+
+	/* producer side */
+	T *claim()
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_cached_head > m_mask)
+		{
+			/* only look at the consumer's index when we appear to be full */
+			m_cached_head = m_head.load(std::memory_order_acquire);
+			if (tail - m_cached_head > m_mask)
+				return nullptr;
+		}
+		return &m_slots[tail & m_mask];
+	}
+
+	void publish()
+	{
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/* consumer side */
+	const T *front() const
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &m_slots[head & m_mask];
+	}
+
+	void release()
+	{
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool empty() const
+	{
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	}
+
+private:
+	static size_t round_up(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		return size;
+	}
+
+	std::vector<T> m_slots;
+	const size_t m_mask;
+
+	/* keep the indices on separate cache lines */
+	char m_pad0[64];
+	std::atomic<size_t> m_head;
+	char m_pad1[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> m_tail;
+	size_t m_cached_head;
+};
@@ -0,0 +1,198 @@
+#include "tcp_connect.h"
+#include <assert.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "logger_decls.h"
+#include "loop_monitor.h"
+
+struct tcp_connect_attempt_t
+{
+	uv_connect_t connect_req;
+	uv_tcp_t *tcp_handle;
+	tcp_connect_race_t *race;
+};
+
+struct tcp_connect_race_t
+{
+	dns_addresses_t addresses;
+	size_t next = 0;
+	int attempt_delay;
+	tcp_connect_callback_t callback;
+	std::vector<tcp_connect_attempt_t *> in_flight;
+	uv_timer_t timer;
+	bool done = false;
+	bool timer_closed = false;
+
+	void start_next();
+	void finish(uv_tcp_t *winner);
+	void maybe_delete();
+};
+
+static void tcp_connect_on_close(uv_handle_t *handle)
+{
+	delete (uv_tcp_t *)handle;
+}
+
+static void tcp_connect_timer_close(uv_handle_t *handle)
+{
+	auto race = static_cast<tcp_connect_race_t *>(handle->data);
+	race->timer_closed = true;
+	race->maybe_delete();
+}
+
+static void tcp_connect_close_attempt(tcp_connect_attempt_t *attempt)
+{
+	if (!uv_is_closing((uv_handle_t *)attempt->tcp_handle))
+		uv_close((uv_handle_t *)attempt->tcp_handle, tcp_connect_on_close);
+}
+
+static void tcp_connect_on_timer(uv_timer_t *timer, int status)
+{
+	static_cast<tcp_connect_race_t *>(timer->data)->start_next();
+}
+
+static void tcp_connect_after_connect(uv_connect_t *connect_req, int status)
+{
+	loop_monitor_scope_t scope("tcp_connect_after_connect");
+	auto attempt = (tcp_connect_attempt_t *)connect_req;
+	auto race = attempt->race;
+
+	auto iter = std::find(race->in_flight.begin(), race->in_flight.end(), attempt);
+	assert(iter != race->in_flight.end());
+	race->in_flight.erase(iter);
+
+	if (race->done)
+	{
+		/* lost the race, or the race was cancelled */
+		tcp_connect_close_attempt(attempt);
+		delete attempt;
+		race->maybe_delete();
+		return;
+	}
+
+	if (status < 0)
+	{
+		dlog(log_info, "tcp_connect : attempt failed, trying the next address\n");
+		tcp_connect_close_attempt(attempt);
+		delete attempt;
+		race->start_next();
+		return;
+	}
+
+	uv_tcp_t *winner = attempt->tcp_handle;
+	delete attempt;
+	race->finish(winner);
+}
+
+void tcp_connect_race_t::start_next()
+{
+	uv_timer_stop(&timer);
+
+	while (next < addresses.size())
+	{
+		auto &address = addresses[next++];
+
+		auto attempt = new tcp_connect_attempt_t;
+		attempt->race = this;
+		attempt->tcp_handle = new uv_tcp_t;
+		uv_tcp_init(uv_default_loop(), attempt->tcp_handle);
+
+		int status;
+		if (address.family == AF_INET6)
+		{
+			status = uv_tcp_connect6(&attempt->connect_req, attempt->tcp_handle,
+					*(const struct sockaddr_in6 *)&address.addr, tcp_connect_after_connect);
+		}
+		else
+		{
+			status = uv_tcp_connect(&attempt->connect_req, attempt->tcp_handle,
+					*(const struct sockaddr_in *)&address.addr, tcp_connect_after_connect);
+		}
+
+		if (status < 0)
+		{
+			/* e.g. no route for this family at all, move straight on */
+			tcp_connect_close_attempt(attempt);
+			delete attempt;
+			continue;
+		}
+
+		in_flight.push_back(attempt);
+		if (next < addresses.size())
+			uv_timer_start(&timer, tcp_connect_on_timer, attempt_delay, 0);
+		return;
+	}
+
+	if (in_flight.size() == 0)
+	{
+		dlog(log_error, "tcp_connect : every address failed\n");
+		finish(nullptr);
+	}
+}
+
+void tcp_connect_race_t::finish(uv_tcp_t *winner)
+{
+	assert(!done);
+	done = true;
+
+	uv_timer_stop(&timer);
+	for (auto attempt : in_flight)
+		tcp_connect_close_attempt(attempt);
+
+	callback(winner);
+
+	uv_close((uv_handle_t *)&timer, tcp_connect_timer_close);
+}
+
+void tcp_connect_race_t::maybe_delete()
+{
+	if (done && timer_closed && in_flight.size() == 0)
+		delete this;
+}
+
+tcp_connect_race_t *tcp_connect(
+		const dns_addresses_t &addresses,
+		tcp_connect_callback_t &&callback,
+		int attempt_delay)
+{
+	auto race = new tcp_connect_race_t;
+	race->callback = std::move(callback);
+	race->attempt_delay = attempt_delay;
+	uv_timer_init(uv_default_loop(), &race->timer);
+	race->timer.data = race;
+
+	/* interleave families, starting with whichever the resolver put first */
+	dns_addresses_t preferred, other;
+	for (auto &address : addresses)
+	{
+		if (address.family == addresses[0].family)
+			preferred.push_back(address);
+		else
+			other.push_back(address);
+	}
+	for (size_t i = 0; i < std::max(preferred.size(), other.size()); ++i)
+	{
+		if (i < preferred.size())
+			race->addresses.push_back(preferred[i]);
+		if (i < other.size())
+			race->addresses.push_back(other[i]);
+	}
+
+	/* the callback may already have run (and the race be on its way out)
+	 * by the time this returns */
+	race->start_next();
+	return race->done ? nullptr : race;
+}
+
+void tcp_connect_cancel(tcp_connect_race_t *race)
+{
+	if (race == nullptr || race->done)
+		return;
+
+	race->done = true;
+	uv_timer_stop(&race->timer);
+	for (auto attempt : race->in_flight)
+		tcp_connect_close_attempt(attempt);
+	uv_close((uv_handle_t *)&race->timer, tcp_connect_timer_close);
+}
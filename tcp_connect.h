@@ -0,0 +1,25 @@
+#pragma once
+#include <functional>
+#include <uv.h>
+#include "dns_cache.h"
+
+/* RFC 8305 recommends 250ms between connection attempts */
+const int tcp_connect_attempt_delay = 250;
+
+/* handed the connected handle of the winning attempt, or nullptr if every
+ * address failed. The handle is allocated with new and is the callee's to
+ * uv_close and delete. */
+using tcp_connect_callback_t = std::function<void(uv_tcp_t *tcp_handle)>;
+
+struct tcp_connect_race_t;
+
+/* happy eyeballs: races connection attempts across all addresses,
+ * interleaving address families and starting the next attempt whenever the
+ * previous one fails or has been pending for attempt_delay milliseconds */
+tcp_connect_race_t *tcp_connect(
+		const dns_addresses_t &addresses,
+		tcp_connect_callback_t &&callback,
+		int attempt_delay = tcp_connect_attempt_delay);
+
+/* abandons a race whose callback hasn't run yet, the callback never will */
+void tcp_connect_cancel(tcp_connect_race_t *race);
@@ -0,0 +1,219 @@
+#include "text_encoding.h"
+#include <string.h>
+#include <algorithm>
+
+/* how much of a buffer the nul byte heuristic looks at */
+const size_t text_encoding_sample = 4096;
+
+text_encoding_t detect_text_encoding(const char *pch_begin, const char *pch_end, size_t &bom_length)
+{
+	const unsigned char *pb = (const unsigned char *)pch_begin;
+	size_t size = pch_end - pch_begin;
+
+	bom_length = 0;
+	if (size >= 3 && pb[0] == 0xef && pb[1] == 0xbb && pb[2] == 0xbf)
+	{
+		bom_length = 3;
+		return text_encoding_utf8;
+	}
+	if (size >= 2 && pb[0] == 0xff && pb[1] == 0xfe)
+	{
+		bom_length = 2;
+		return text_encoding_utf16le;
+	}
+	if (size >= 2 && pb[0] == 0xfe && pb[1] == 0xff)
+	{
+		bom_length = 2;
+		return text_encoding_utf16be;
+	}
+
+	size_t sample = std::min(size, text_encoding_sample) & ~(size_t)1;
+	if (sample == 0)
+		return text_encoding_utf8;
+
+	size_t even_nuls = 0;
+	size_t odd_nuls = 0;
+	for (size_t i = 0; i < sample; i += 2)
+	{
+		even_nuls += (pb[i] == 0);
+		odd_nuls += (pb[i + 1] == 0);
+	}
+
+	/* at least a third of the code units look latin, and the other half of
+	 * each pair is almost never nul */
+	size_t pairs = sample / 2;
+	if (odd_nuls * 3 >= pairs && even_nuls * 20 < pairs)
+		return text_encoding_utf16le;
+	if (even_nuls * 3 >= pairs && odd_nuls * 20 < pairs)
+		return text_encoding_utf16be;
+	return text_encoding_utf8;
+}
+
+const char *text_encoding_name(text_encoding_t encoding)
+{
+	switch (encoding)
+	{
+	case text_encoding_utf8:
+		return "UTF-8";
+	case text_encoding_utf16le:
+		return "UTF-16LE";
+	case text_encoding_utf16be:
+		return "UTF-16BE";
+	}
+	return "unknown";
+}
+
+/* the next code point, or -1 when pch doesn't start a valid sequence */
+static long utf8_decode(const unsigned char *&pch, const unsigned char *pch_end)
+{
+	unsigned char lead = *pch;
+	size_t length;
+	long code_point;
+	if (lead < 0x80)
+	{
+		++pch;
+		return lead;
+	}
+	else if ((lead & 0xe0) == 0xc0)
+	{
+		length = 2;
+		code_point = lead & 0x1f;
+	}
+	else if ((lead & 0xf0) == 0xe0)
+	{
+		length = 3;
+		code_point = lead & 0x0f;
+	}
+	else if ((lead & 0xf8) == 0xf0)
+	{
+		length = 4;
+		code_point = lead & 0x07;
+	}
+	else
+	{
+		return -1;
+	}
+
+	if ((size_t)(pch_end - pch) < length)
+		return -1;
+	for (size_t i = 1; i < length; ++i)
+	{
+		if ((pch[i] & 0xc0) != 0x80)
+			return -1;
+		code_point = (code_point << 6) | (pch[i] & 0x3f);
+	}
+
+	static const long smallest[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	if (code_point < smallest[length] || code_point > 0x10ffff
+			|| (code_point >= 0xd800 && code_point <= 0xdfff))
+	{
+		return -1;
+	}
+
+	pch += length;
+	return code_point;
+}
+
+bool valid_utf8(const std::string &text)
+{
+	const unsigned char *pch = (const unsigned char *)text.c_str();
+	const unsigned char *pch_end = pch + text.size();
+	while (pch < pch_end)
+	{
+		if (utf8_decode(pch, pch_end) < 0)
+			return false;
+	}
+	return true;
+}
+
+static void utf16_append(std::string &out, uint16_t unit, text_encoding_t encoding)
+{
+	unit = utf16_unit(unit, encoding);
+	out.append((const char *)&unit, sizeof(unit));
+}
+
+std::string encode_text(const std::string &utf8, text_encoding_t encoding)
+{
+	if (encoding == text_encoding_utf8)
+		return utf8;
+
+	std::string out;
+	out.reserve(utf8.size() * 2);
+	const unsigned char *pch = (const unsigned char *)utf8.c_str();
+	const unsigned char *pch_end = pch + utf8.size();
+	while (pch < pch_end)
+	{
+		long code_point = utf8_decode(pch, pch_end);
+		if (code_point < 0)
+			code_point = *pch++;
+
+		if (code_point >= 0x10000)
+		{
+			code_point -= 0x10000;
+			utf16_append(out, 0xd800 | (code_point >> 10), encoding);
+			utf16_append(out, 0xdc00 | (code_point & 0x3ff), encoding);
+		}
+		else
+		{
+			utf16_append(out, code_point, encoding);
+		}
+	}
+	return out;
+}
+
+static void utf8_append(std::string &out, unsigned long code_point)
+{
+	if (code_point < 0x80)
+	{
+		out.push_back(code_point);
+	}
+	else if (code_point < 0x800)
+	{
+		out.push_back(0xc0 | (code_point >> 6));
+		out.push_back(0x80 | (code_point & 0x3f));
+	}
+	else if (code_point < 0x10000)
+	{
+		out.push_back(0xe0 | (code_point >> 12));
+		out.push_back(0x80 | ((code_point >> 6) & 0x3f));
+		out.push_back(0x80 | (code_point & 0x3f));
+	}
+	else
+	{
+		out.push_back(0xf0 | (code_point >> 18));
+		out.push_back(0x80 | ((code_point >> 12) & 0x3f));
+		out.push_back(0x80 | ((code_point >> 6) & 0x3f));
+		out.push_back(0x80 | (code_point & 0x3f));
+	}
+}
+
+std::string utf16_to_utf8(const uint16_t *units, size_t count, text_encoding_t encoding)
+{
+	std::string out;
+	out.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint16_t unit;
+		memcpy(&unit, units + i, sizeof(unit));
+		unit = utf16_unit(unit, encoding);
+
+		if (unit >= 0xd800 && unit <= 0xdbff && i + 1 < count)
+		{
+			uint16_t low;
+			memcpy(&low, units + i + 1, sizeof(low));
+			low = utf16_unit(low, encoding);
+			if (low >= 0xdc00 && low <= 0xdfff)
+			{
+				utf8_append(out, 0x10000 + (((unsigned long)(unit - 0xd800) << 10) | (low - 0xdc00)));
+				++i;
+				continue;
+			}
+		}
+
+		if (unit >= 0xd800 && unit <= 0xdfff)
+			utf8_append(out, 0xfffd);
+		else
+			utf8_append(out, unit);
+	}
+	return out;
+}
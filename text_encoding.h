@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+enum text_encoding_t
+{
+	text_encoding_utf8,	/* and plain ASCII */
+	text_encoding_utf16le,
+	text_encoding_utf16be,
+};
+
+/* looks for a byte order mark first, and otherwise at where the nul bytes
+ * fall in the first few KB: UTF-16 text that's mostly latin has a nul in
+ * every other byte. bom_length is how many bytes the mark takes up. */
+text_encoding_t detect_text_encoding(const char *pch_begin, const char *pch_end, size_t &bom_length);
+
+const char *text_encoding_name(text_encoding_t encoding);
+
+/* UTF-8 text as it would appear in a buffer of the given encoding. bytes
+ * that aren't valid UTF-8 are taken to be Latin-1. */
+std::string encode_text(const std::string &utf8, text_encoding_t encoding);
+
+/* whether text is entirely well formed UTF-8 */
+bool valid_utf8(const std::string &text);
+
+/* UTF-16 code units (in the given byte order) as UTF-8, with unpaired
+ * surrogates replaced by U+FFFD */
+std::string utf16_to_utf8(const uint16_t *units, size_t count, text_encoding_t encoding);
+
+inline uint16_t utf16_unit(uint16_t unit, text_encoding_t encoding)
+{
+	return (encoding == text_encoding_utf16be) ? (uint16_t)((unit >> 8) | (unit << 8)) : unit;
+}
@@ -0,0 +1,161 @@
+#include "thread_pool.h"
+#include <assert.h>
+#include <algorithm>
+
+/* which pool, and which of its deques, the current thread works for */
+static thread_local thread_pool_t *t_thread_pool = nullptr;
+static thread_local unsigned t_thread_pool_index = 0;
+
+thread_pool_t::thread_pool_t(unsigned threads)
+	: m_queued(0), m_next_queue(0), m_stopping(false)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < threads; ++i)
+		m_queues.emplace_back(new worker_queue_t);
+	for (unsigned i = 0; i < threads; ++i)
+		m_threads.emplace_back(&thread_pool_t::worker_main, this, i);
+}
+
+thread_pool_t::~thread_pool_t()
+{
+	assert(!on_worker());
+	{
+		std::lock_guard<std::mutex> lock(m_sleep_lock);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+
+	for (auto &thread : m_threads)
+		thread.join();
+}
+
+thread_pool_t &thread_pool_t::shared()
+{
+	static thread_pool_t pool;
+	return pool;
+}
+
+bool thread_pool_t::on_worker() const
+{
+	return t_thread_pool == this;
+}
+
+void thread_pool_t::submit(thread_pool_task_t &&task)
+{
+	unsigned index = on_worker()
+		? t_thread_pool_index
+		: m_next_queue.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+
+	{
+		std::lock_guard<std::mutex> lock(m_queues[index]->lock);
+		m_queues[index]->tasks.push_back(std::move(task));
+	}
+
+	m_queued.fetch_add(1, std::memory_order_release);
+
+	/* sleepers test m_queued under m_sleep_lock, taking it here means the
+	 * notify can't slip in between their test and their wait */
+	{
+		std::lock_guard<std::mutex> lock(m_sleep_lock);
+	}
+	m_wake.notify_one();
+}
+
+bool thread_pool_t::pop_own(unsigned index, thread_pool_task_t &task)
+{
+	worker_queue_t &queue = *m_queues[index];
+	std::lock_guard<std::mutex> lock(queue.lock);
+	if (queue.tasks.empty())
+		return false;
+
+	task = std::move(queue.tasks.back());
+	queue.tasks.pop_back();
+	return true;
+}
+
+bool thread_pool_t::steal(unsigned thief, thread_pool_task_t &task)
+{
+	for (size_t i = 1; i < m_queues.size(); ++i)
+	{
+		worker_queue_t &queue = *m_queues[(thief + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(queue.lock);
+		if (queue.tasks.empty())
+			continue;
+
+		task = std::move(queue.tasks.front());
+		queue.tasks.pop_front();
+		return true;
+	}
+	return false;
+}
+
+void thread_pool_t::worker_main(unsigned index)
+{
+	t_thread_pool = this;
+	t_thread_pool_index = index;
+
+	thread_pool_task_t task;
+	while (true)
+	{
+		if (pop_own(index, task) || steal(index, task))
+		{
+			m_queued.fetch_sub(1, std::memory_order_relaxed);
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleep_lock);
+		m_wake.wait(lock, [this]() {
+			return m_stopping || m_queued.load(std::memory_order_acquire) != 0;
+		});
+		if (m_stopping && m_queued.load(std::memory_order_acquire) == 0)
+			break;
+	}
+}
+
+thread_pool_group_t::thread_pool_group_t(thread_pool_t &pool)
+	: m_pool(pool), m_inline(pool.on_worker()), m_outstanding(0)
+{
+}
+
+thread_pool_group_t::~thread_pool_group_t()
+{
+	wait();
+}
+
+void thread_pool_group_t::submit(thread_pool_task_t &&task)
+{
+	if (m_inline)
+	{
+		task();
+		return;
+	}
+
+	m_outstanding.fetch_add(1, std::memory_order_relaxed);
+	m_pool.submit([this, task]() {
+		task();
+
+		/* the count drops under the lock, and the notify happens before it's
+		 * released. wait only sees 0 with the lock held, so it can't return
+		 * and let the group be destroyed while this task still uses it. */
+		std::lock_guard<std::mutex> lock(m_done_lock);
+		if (m_outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			m_done.notify_all();
+	});
+}
+
+void thread_pool_group_t::wait()
+{
+	if (m_inline)
+		return;
+
+	assert(!m_pool.on_worker());
+
+	std::unique_lock<std::mutex> lock(m_done_lock);
+	m_done.wait(lock, [this]() {
+		return m_outstanding.load(std::memory_order_acquire) == 0;
+	});
+}
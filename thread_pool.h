@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "nocopy.h"
+
+typedef std::function<void()> thread_pool_task_t;
+
+/* a fixed set of worker threads, each with its own deque. tasks submitted
+ * from a worker go on that worker's deque and are run newest first, which
+ * keeps recursive work (directory walks, say) depth first and cache warm.
+ * idle workers steal the oldest task from the others. */
+class thread_pool_t
+{
+public:
+	NOCOPY(thread_pool_t);
+
+	/* threads == 0 means one per hardware thread */
+	explicit thread_pool_t(unsigned threads = 0);
+
+	/* runs whatever is still queued, then joins */
+	~thread_pool_t();
+
+	void submit(thread_pool_task_t &&task);
+	unsigned size() const { return (unsigned)m_threads.size(); }
+
+	/* whether the calling thread is one of this pool's workers */
+	bool on_worker() const;
+
+	/* created on first use, lives until exit */
+	static thread_pool_t &shared();
+
+private:
+	struct worker_queue_t
+	{
+		std::mutex lock;
+		std::deque<thread_pool_task_t> tasks;
+	};
+
+	bool pop_own(unsigned index, thread_pool_task_t &task);
+	bool steal(unsigned thief, thread_pool_task_t &task);
+	void worker_main(unsigned index);
+
+	std::vector<std::unique_ptr<worker_queue_t>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	/* tasks sitting in some deque, so sleepers know whether to look */
+	std::atomic<size_t> m_queued;
+	std::atomic<unsigned> m_next_queue;
+
+	std::mutex m_sleep_lock;
+	std::condition_variable m_wake;
+	bool m_stopping;
+};
+
+/* tasks submitted through a group can be waited for together, independently
+ * of anything else running on the pool. a group created on one of its
+ * pool's own workers runs its tasks inline instead, since waiting there
+ * could leave every worker blocked on work that nobody is free to run. */
+class thread_pool_group_t
+{
+public:
+	NOCOPY(thread_pool_group_t);
+	explicit thread_pool_group_t(thread_pool_t &pool = thread_pool_t::shared());
+
+	/* waits, the pool may still be running tasks that point at the group */
+	~thread_pool_group_t();
+
+	/* may be called from the group's own tasks */
+	void submit(thread_pool_task_t &&task);
+
+	/* blocks until every task submitted so far (and whatever they submit)
+	 * has finished. must not be called from a task on the same pool, unless
+	 * the group was created there and so runs inline. */
+	void wait();
+
+	thread_pool_t &pool() const { return m_pool; }
+
+private:
+	thread_pool_t &m_pool;
+	bool m_inline;
+	std::atomic<size_t> m_outstanding;
+	std::mutex m_done_lock;
+	std::condition_variable m_done;
+};
@@ -0,0 +1,442 @@
+#include "trigram_index.h"
+#include "disk.h"
+#include "text_encoding.h"
+#include "logger_decls.h"
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <iterator>
+
+static const char trigram_index_magic[8] = { 'T', 'R', 'I', 'G', 'R', 'A', 'M', '1' };
+
+/* files at least this big collect their trigrams in a bitmap rather than
+ * by sorting every one they contain */
+const size_t trigram_index_bitmap_file = 32 << 10;
+const size_t trigram_count_max = 1 << 24;
+
+struct trigram_index_t::header_t
+{
+	char magic[8];
+	uint32_t file_count;
+	uint32_t trigram_count;
+	uint64_t posting_count;
+	uint64_t names_size;
+};
+
+struct trigram_index_t::file_t
+{
+	int64_t mtime_ns;
+	uint64_t size;
+	uint64_t name_offset;
+	uint64_t name_length;
+};
+
+struct trigram_index_t::entry_t
+{
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t first_posting;
+};
+
+trigram_index_t::trigram_index_t()
+	: m_header(nullptr), m_files(nullptr), m_entries(nullptr), m_postings(nullptr), m_names(nullptr),
+	  m_files_read(0), m_files_reused(0)
+{
+}
+
+bool trigram_index_t::open(const std::string &index_path)
+{
+	close();
+	if (!m_file.map_file(index_path, mapped_file_read, mapped_file_random))
+		return false;
+
+	/* the tables follow the header in order, each 8 byte aligned by size */
+	size_t size = m_file.size();
+	const header_t *header = (const header_t *)m_file.begin();
+	if (size < sizeof(header_t) || memcmp(header->magic, trigram_index_magic, sizeof(header->magic)) != 0)
+	{
+		dlog(log_error, "trigram_index_t : %s isn't a trigram index\n", index_path.c_str());
+		m_file.close();
+		return false;
+	}
+
+	uint64_t expected = sizeof(header_t)
+		+ (uint64_t)header->file_count * sizeof(file_t)
+		+ (uint64_t)header->trigram_count * sizeof(entry_t)
+		+ ((header->posting_count * sizeof(uint32_t) + 7) & ~(uint64_t)7)
+		+ header->names_size;
+	if (expected != size)
+	{
+		dlog(log_error, "trigram_index_t : %s is truncated\n", index_path.c_str());
+		m_file.close();
+		return false;
+	}
+
+	m_header = header;
+	m_files = (const file_t *)(header + 1);
+	m_entries = (const entry_t *)(m_files + header->file_count);
+	m_postings = (const uint32_t *)(m_entries + header->trigram_count);
+	m_names = (const char *)m_postings + ((header->posting_count * sizeof(uint32_t) + 7) & ~(uint64_t)7);
+	m_path = index_path;
+	return true;
+}
+
+void trigram_index_t::close()
+{
+	m_header = nullptr;
+	m_files = nullptr;
+	m_entries = nullptr;
+	m_postings = nullptr;
+	m_names = nullptr;
+	m_path.clear();
+	m_file.close();
+}
+
+size_t trigram_index_t::file_count() const
+{
+	return m_header ? m_header->file_count : 0;
+}
+
+size_t trigram_index_t::trigram_count() const
+{
+	return m_header ? m_header->trigram_count : 0;
+}
+
+std::string trigram_index_t::file_path(uint32_t file_id) const
+{
+	return std::string(m_names + m_files[file_id].name_offset, m_files[file_id].name_length);
+}
+
+const uint32_t *trigram_index_t::postings(uint32_t trigram, uint32_t &count) const
+{
+	const entry_t *entries_end = m_entries + m_header->trigram_count;
+	const entry_t *entry = std::lower_bound(m_entries, entries_end, trigram,
+			[](const entry_t &entry, uint32_t trigram) { return entry.trigram < trigram; });
+	if (entry == entries_end || entry->trigram != trigram)
+		return nullptr;
+
+	count = entry->count;
+	return m_postings + entry->first_posting;
+}
+
+static inline uint32_t trigram_at(const char *pch)
+{
+	return ((uint32_t)(uint8_t)pch[0] << 16) | ((uint32_t)(uint8_t)pch[1] << 8) | (uint8_t)pch[2];
+}
+
+/* the distinct trigrams in [pch, pch_end), ascending */
+static void collect_trigrams(const char *pch, const char *pch_end, std::vector<uint32_t> &trigrams)
+{
+	trigrams.clear();
+	if (pch_end - pch < 3)
+		return;
+
+	if ((size_t)(pch_end - pch) < trigram_index_bitmap_file)
+	{
+		for (; pch + 3 <= pch_end; ++pch)
+			trigrams.push_back(trigram_at(pch));
+		std::sort(trigrams.begin(), trigrams.end());
+		trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+		return;
+	}
+
+	/* 2MB a thread, cleared again as the set bits are read back */
+	static thread_local std::vector<uint64_t> bitmap(trigram_count_max / 64);
+	for (; pch + 3 <= pch_end; ++pch)
+	{
+		uint32_t trigram = trigram_at(pch);
+		bitmap[trigram >> 6] |= (uint64_t)1 << (trigram & 63);
+	}
+
+	for (size_t word = 0; word < bitmap.size(); ++word)
+	{
+		uint64_t bits = bitmap[word];
+		if (bits == 0)
+			continue;
+
+		bitmap[word] = 0;
+		while (bits != 0)
+		{
+			trigrams.push_back((uint32_t)(word * 64 + __builtin_ctzll(bits)));
+			bits &= bits - 1;
+		}
+	}
+}
+
+struct trigram_index_source_t
+{
+	std::string path;
+	int64_t mtime_ns;
+	uint64_t size;
+	bool indexed;
+	std::vector<uint32_t> trigrams;
+};
+
+bool trigram_index_t::build(const std::string &root, const std::string &index_path, thread_pool_t &pool)
+{
+	/* everything under root, in a stable order so file ids don't wander */
+	std::vector<trigram_index_source_t> sources;
+	std::mutex sources_lock;
+	std::string temp_path = index_path + ".tmp";
+	if (!for_each_file_parallel(root, [&](const std::string &path, const for_each_file_stat_t &file_stat,
+					for_each_control_t &control) {
+				control.recurse = true;
+				if (!file_stat.regular_file() || path == index_path || path == temp_path)
+					return;
+
+				std::lock_guard<std::mutex> guard(sources_lock);
+				sources.push_back({ path, 0, 0, false, {} });
+			}, pool))
+	{
+		return false;
+	}
+	std::sort(sources.begin(), sources.end(),
+			[](const trigram_index_source_t &a, const trigram_index_source_t &b) { return a.path < b.path; });
+
+	{
+		thread_pool_group_t group(pool);
+		for (auto &source : sources)
+		{
+			group.submit([&source]() {
+				struct stat st;
+				if (::stat(source.path.c_str(), &st) != 0)
+					return;
+
+				source.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+				source.size = st.st_size;
+			});
+		}
+	}
+
+	/* unchanged files take their trigrams from the old index. its posting
+	 * lists are walked once, in trigram order, so each file's list comes out
+	 * sorted. */
+	m_files_read = 0;
+	m_files_reused = 0;
+	if (is_open())
+	{
+		std::vector<int64_t> reuse(m_header->file_count, -1);
+		for (size_t i = 0; i < sources.size(); ++i)
+		{
+			auto &source = sources[i];
+			const file_t *files_end = m_files + m_header->file_count;
+			const file_t *file = std::lower_bound(m_files, files_end, source.path,
+					[this](const file_t &file, const std::string &path) {
+						return path.compare(0, std::string::npos, m_names + file.name_offset, file.name_length) > 0;
+					});
+			if (file != files_end && file->mtime_ns == source.mtime_ns && file->size == source.size
+					&& source.path.compare(0, std::string::npos, m_names + file->name_offset, file->name_length) == 0)
+			{
+				reuse[file - m_files] = i;
+				source.indexed = true;
+				++m_files_reused;
+			}
+		}
+
+		/* nothing added, changed or removed, the open index stands */
+		if (m_files_reused == sources.size() && m_files_reused == m_header->file_count
+				&& m_path == index_path)
+		{
+			dlog(log_info, "trigram_index_t : %s is up to date\n", index_path.c_str());
+			return true;
+		}
+
+		for (const entry_t *entry = m_entries; entry < m_entries + m_header->trigram_count; ++entry)
+		{
+			const uint32_t *posting = m_postings + entry->first_posting;
+			for (uint32_t i = 0; i < entry->count; ++i)
+			{
+				if (reuse[posting[i]] != -1)
+					sources[reuse[posting[i]]].trigrams.push_back(entry->trigram);
+			}
+		}
+	}
+
+	{
+		thread_pool_group_t group(pool);
+		for (auto &source : sources)
+		{
+			if (source.indexed)
+				continue;
+
+			++m_files_read;
+			group.submit([&source]() {
+				mapped_file_t file;
+				source.indexed = true;
+				if (source.size == 0 || !file.map_file(source.path, mapped_file_read,
+							mapped_file_sequential | mapped_file_willneed))
+				{
+					return;
+				}
+				collect_trigrams(file.begin(), file.end(), source.trigrams);
+			});
+		}
+	}
+
+	/* count each trigram's files, then lay the posting lists out end to end
+	 * and fill them in file order, which leaves every list sorted */
+	std::vector<uint32_t> counts(trigram_count_max);
+	uint64_t posting_count = 0;
+	for (auto &source : sources)
+	{
+		for (uint32_t trigram : source.trigrams)
+			++counts[trigram];
+		posting_count += source.trigrams.size();
+	}
+
+	std::vector<entry_t> entries;
+	std::vector<uint64_t> next_posting(trigram_count_max);
+	uint64_t first_posting = 0;
+	for (uint32_t trigram = 0; trigram < trigram_count_max; ++trigram)
+	{
+		if (counts[trigram] == 0)
+			continue;
+
+		entries.push_back({ trigram, counts[trigram], first_posting });
+		next_posting[trigram] = first_posting;
+		first_posting += counts[trigram];
+	}
+	counts = std::vector<uint32_t>();
+
+	std::vector<uint32_t> postings(posting_count);
+	std::vector<file_t> files;
+	std::string names;
+	for (size_t i = 0; i < sources.size(); ++i)
+	{
+		for (uint32_t trigram : sources[i].trigrams)
+			postings[next_posting[trigram]++] = (uint32_t)i;
+
+		files.push_back({ sources[i].mtime_ns, sources[i].size, names.size(), sources[i].path.size() });
+		names += sources[i].path;
+	}
+
+	header_t header;
+	memcpy(header.magic, trigram_index_magic, sizeof(header.magic));
+	header.file_count = (uint32_t)files.size();
+	header.trigram_count = (uint32_t)entries.size();
+	header.posting_count = posting_count;
+	header.names_size = names.size();
+
+	/* written beside the old one and renamed over it, so readers with the
+	 * old one mapped keep their copy */
+	{
+		std::ofstream ofs(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+		ofs.write((const char *)&header, sizeof(header));
+		ofs.write((const char *)files.data(), files.size() * sizeof(file_t));
+		ofs.write((const char *)entries.data(), entries.size() * sizeof(entry_t));
+		ofs.write((const char *)postings.data(), postings.size() * sizeof(uint32_t));
+		static const char padding[8] = {};
+		ofs.write(padding, ((posting_count * sizeof(uint32_t) + 7) & ~(uint64_t)7) - posting_count * sizeof(uint32_t));
+		ofs.write(names.c_str(), names.size());
+		if (!ofs.good())
+		{
+			dlog(log_error, "trigram_index_t : couldn't write %s\n", temp_path.c_str());
+			ofs.close();
+			unlink(temp_path.c_str());
+			return false;
+		}
+	}
+
+	if (rename(temp_path.c_str(), index_path.c_str()) != 0)
+	{
+		dlog(log_error, "trigram_index_t : couldn't rename %s (%s)\n", temp_path.c_str(), strerror(errno));
+		unlink(temp_path.c_str());
+		return false;
+	}
+
+	dlog(log_info, "trigram_index_t : indexed %d files under %s (%d read, %d unchanged), %d trigrams\n",
+			(int)files.size(), root.c_str(), (int)m_files_read, (int)m_files_reused, (int)entries.size());
+	return open(index_path);
+}
+
+std::vector<std::string> trigram_index_t::candidates(const std::vector<std::string> &patterns) const
+{
+	std::vector<std::string> paths;
+	if (!is_open())
+		return paths;
+
+	std::vector<bool> candidate(m_header->file_count, false);
+	std::vector<uint32_t> trigrams;
+	std::vector<uint32_t> matched;
+	std::vector<uint32_t> narrowed;
+	static const text_encoding_t encodings[] = { text_encoding_utf8, text_encoding_utf16le, text_encoding_utf16be };
+	for (auto &pattern : patterns)
+	{
+		if (pattern.size() == 0)
+			continue;
+
+		for (auto encoding : encodings)
+		{
+			std::string bytes = encode_text(pattern, encoding);
+			collect_trigrams(bytes.c_str(), bytes.c_str() + bytes.size(), trigrams);
+			if (trigrams.size() == 0)
+			{
+				candidate.assign(candidate.size(), true);
+				break;
+			}
+
+			/* intersect the posting lists, shortest first */
+			std::vector<std::pair<const uint32_t *, uint32_t>> lists;
+			for (uint32_t trigram : trigrams)
+			{
+				uint32_t count = 0;
+				const uint32_t *list = postings(trigram, count);
+				if (list == nullptr)
+				{
+					lists.clear();
+					break;
+				}
+				lists.push_back({ list, count });
+			}
+			if (lists.size() == 0)
+				continue;
+
+			std::sort(lists.begin(), lists.end(),
+					[](const std::pair<const uint32_t *, uint32_t> &a, const std::pair<const uint32_t *, uint32_t> &b) {
+						return a.second < b.second;
+					});
+			matched.assign(lists[0].first, lists[0].first + lists[0].second);
+			for (size_t i = 1; i < lists.size() && matched.size() != 0; ++i)
+			{
+				narrowed.clear();
+				std::set_intersection(matched.begin(), matched.end(),
+						lists[i].first, lists[i].first + lists[i].second, std::back_inserter(narrowed));
+				matched.swap(narrowed);
+			}
+
+			for (uint32_t file_id : matched)
+				candidate[file_id] = true;
+		}
+	}
+
+	for (uint32_t file_id = 0; file_id < candidate.size(); ++file_id)
+	{
+		if (candidate[file_id])
+			paths.push_back(file_path(file_id));
+	}
+	return paths;
+}
+
+size_t trigram_index_t::search(const std::vector<replace_pair_t> &replacements, bool pretty_print,
+		thread_pool_t &pool) const
+{
+	std::vector<std::string> patterns;
+	for (auto &replacement : replacements)
+		patterns.push_back(replacement.before);
+
+	size_t matched = 0;
+	for (auto &path : candidates(patterns))
+	{
+		if (parallel_replace_file(path, replacements, -1, true /*print_matches*/, pretty_print,
+					false /*do_replace*/, pool))
+		{
+			++matched;
+		}
+	}
+	return matched;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "nocopy.h"
+#include "utils.h"
+
+/* an index of which byte trigrams appear in which files under a directory,
+ * for narrowing down the files a search has to scan. it lives in a single
+ * file laid out to be used straight from a mapping: a header, a table of
+ * files, a table of the trigrams that occur sorted by value, and each
+ * trigram's posting list of file ids in ascending order. */
+class trigram_index_t
+{
+public:
+	NOCOPY(trigram_index_t);
+	trigram_index_t();
+
+	/* maps an index written by build. false if it's missing or isn't one */
+	bool open(const std::string &index_path);
+	void close();
+	bool is_open() const { return m_header != nullptr; }
+
+	/* indexes every regular file under root into index_path, replacing it
+	 * atomically, and opens the result. files whose mtime and size match the
+	 * currently open index keep their trigrams from it without being read.
+	 * called from one of pool's own tasks it does all the work on that one
+	 * thread. */
+	bool build(const std::string &root, const std::string &index_path,
+			thread_pool_t &pool = thread_pool_t::shared());
+
+	/* the indexed files that could contain any of patterns as UTF-8,
+	 * UTF-16LE or UTF-16BE, in path order. a pattern shorter than a trigram
+	 * can't rule anything out. only as current as the last build. */
+	std::vector<std::string> candidates(const std::vector<std::string> &patterns) const;
+
+	/* prints the matches for replacements in every candidate file, each one
+	 * verified with a full scan. returns how many files matched. */
+	size_t search(const std::vector<replace_pair_t> &replacements, bool pretty_print,
+			thread_pool_t &pool = thread_pool_t::shared()) const;
+
+	size_t file_count() const;
+	size_t trigram_count() const;
+	std::string file_path(uint32_t file_id) const;
+
+	/* what the last build did */
+	size_t files_read() const { return m_files_read; }
+	size_t files_reused() const { return m_files_reused; }
+
+private:
+	struct header_t;
+	struct file_t;
+	struct entry_t;
+
+	/* the posting list for trigram, nullptr if no file has it */
+	const uint32_t *postings(uint32_t trigram, uint32_t &count) const;
+
+	std::string m_path;
+	mapped_file_t m_file;
+	const header_t *m_header;
+	const file_t *m_files;
+	const entry_t *m_entries;
+	const uint32_t *m_postings;
+	const char *m_names;
+
+	size_t m_files_read;
+	size_t m_files_reused;
+};
@@ -0,0 +1,202 @@
+#include "upstream_group.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+#include "logger_decls.h"
+#include "clock_source.h"
+
+/* weight given to the newest latency sample */
+const double latency_ewma_alpha = 0.3;
+const int probe_interval = 1000;
+const int max_ejection_doublings = 6;
+
+upstream_group_t::upstream_group_t(
+		const std::vector<std::string> &targets,
+		upstream_balance_t balance,
+		const http_client_options_t &options)
+	: balance(balance), options(options)
+{
+	for (auto &target : targets)
+	{
+		upstream_backend_t backend;
+		auto colon = target.rfind(':');
+		backend.hostname = target.substr(0, colon);
+		backend.port = (colon != std::string::npos) ? atoi(target.c_str() + colon + 1) : 80;
+		backends.push_back(backend);
+	}
+	assert(backends.size() != 0);
+
+	probe_timer = new uv_timer_t;
+	uv_timer_init(uv_default_loop(), probe_timer);
+	probe_timer->data = this;
+	uv_timer_start(probe_timer, on_probe_timer, probe_interval, probe_interval);
+
+	/* probing alone shouldn't keep the loop alive */
+	uv_unref((uv_handle_t *)probe_timer);
+}
+
+static void upstream_group_timer_close(uv_handle_t *handle)
+{
+	delete (uv_timer_t *)handle;
+}
+
+upstream_group_t::~upstream_group_t()
+{
+	uv_timer_stop(probe_timer);
+	uv_close((uv_handle_t *)probe_timer, upstream_group_timer_close);
+}
+
+static double upstream_score(const upstream_backend_t &backend)
+{
+	/* unknown latency counts as cheap, so new backends get traffic */
+	return (backend.outstanding + 1) * std::max(backend.latency_ewma, 1.0);
+}
+
+upstream_backend_t *upstream_group_t::choose()
+{
+	std::vector<upstream_backend_t *> candidates;
+	for (auto &backend : backends)
+	{
+		if (!backend.ejected)
+			candidates.push_back(&backend);
+	}
+
+	if (candidates.size() == 0)
+	{
+		/* everything is ejected, better to try than to fail outright */
+		for (auto &backend : backends)
+			candidates.push_back(&backend);
+	}
+
+	if (candidates.size() == 1)
+		return candidates[0];
+
+	if (balance == upstream_power_of_two)
+	{
+		size_t first = rand() % candidates.size();
+		size_t second = rand() % (candidates.size() - 1);
+		if (second >= first)
+			++second;
+
+		return (upstream_score(*candidates[first]) <= upstream_score(*candidates[second]))
+			? candidates[first] : candidates[second];
+	}
+
+	return *std::min_element(candidates.begin(), candidates.end(),
+			[](const upstream_backend_t *lhs, const upstream_backend_t *rhs) {
+		if (lhs->outstanding != rhs->outstanding)
+			return lhs->outstanding < rhs->outstanding;
+		return lhs->latency_ewma < rhs->latency_ewma;
+	});
+}
+
+static bool upstream_failed(const http_client_response_t &response)
+{
+	return (response.error != http_client_ok) || (response.code >= 500);
+}
+
+static void upstream_eject(upstream_backend_t &backend, int eject_time)
+{
+	backend.ejected = true;
+	backend.ejected_until = uv_now(uv_default_loop())
+		+ ((int64_t)eject_time << std::min(backend.ejections, max_ejection_doublings));
+	++backend.ejections;
+}
+
+static void upstream_readmit(upstream_backend_t &backend)
+{
+	dlog(log_info, "upstream_group_t : %s:%d is back\n",
+			backend.hostname.c_str(), backend.port);
+	backend.ejected = false;
+	backend.ejections = 0;
+	backend.consecutive_failures = 0;
+}
+
+void upstream_group_t::record(
+		upstream_backend_t *backend,
+		const http_client_response_t &response,
+		uint64_t latency)
+{
+	--backend->outstanding;
+	assert(backend->outstanding >= 0);
+
+	double latency_ms = latency / 1000000.0;
+	if (backend->latency_ewma == 0.0)
+		backend->latency_ewma = latency_ms;
+	else
+		backend->latency_ewma += latency_ewma_alpha * (latency_ms - backend->latency_ewma);
+
+	if (!upstream_failed(response))
+	{
+		/* the fallback sends ejected backends traffic when every one of
+		 * them is out, a success there readmits it without the probe */
+		if (backend->ejected)
+			upstream_readmit(*backend);
+		backend->consecutive_failures = 0;
+		return;
+	}
+
+	if (++backend->consecutive_failures >= eject_after && !backend->ejected)
+	{
+		dlog(log_warning, "upstream_group_t : ejecting %s:%d after %d failures\n",
+				backend->hostname.c_str(), backend->port, backend->consecutive_failures);
+		upstream_eject(*backend, eject_time);
+	}
+}
+
+void upstream_group_t::get(const std::string &path, response_callback_t &&callback)
+{
+	upstream_backend_t *backend = choose();
+	++backend->outstanding;
+
+	http_client_options_t request_options(options);
+	request_options.path = path;
+
+	auto self = shared_from_this();
+	uint64_t start = clock_fast_ns();
+	auto shared_callback = std::make_shared<response_callback_t>(std::move(callback));
+	http_get(backend->hostname, backend->port, request_options,
+			[self, backend, start, shared_callback](const http_client_response_t &response) {
+		self->record(backend, response, clock_fast_ns() - start);
+		(*shared_callback)(response);
+	});
+}
+
+void upstream_group_t::probe()
+{
+	int64_t now = uv_now(uv_default_loop());
+	auto self = shared_from_this();
+
+	for (auto &backend : backends)
+	{
+		if (!backend.ejected || backend.probing || now < backend.ejected_until)
+			continue;
+
+		http_client_options_t probe_options(options);
+		probe_options.path = probe_path;
+		probe_options.max_retries = 0;
+		probe_options.hedge = false;
+
+		backend.probing = true;
+		auto backend_ptr = &backend;
+		http_get(backend.hostname, backend.port, probe_options,
+				[self, backend_ptr](const http_client_response_t &response) {
+			auto &backend = *backend_ptr;
+			backend.probing = false;
+			if (upstream_failed(response))
+			{
+				upstream_eject(backend, self->eject_time);
+				return;
+			}
+
+			if (backend.ejected)
+				upstream_readmit(backend);
+		});
+	}
+}
+
+void upstream_group_t::on_probe_timer(uv_timer_t *timer, int status)
+{
+	static_cast<upstream_group_t *>(timer->data)->probe();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <uv.h>
+#include "nocopy.h"
+#include "http_client.h"
+
+enum upstream_balance_t
+{
+	upstream_least_outstanding,
+	upstream_power_of_two,
+};
+
+struct upstream_backend_t
+{
+	std::string hostname;
+	int port;
+
+	int outstanding = 0;
+	double latency_ewma = 0.0; /* milliseconds */
+	int consecutive_failures = 0;
+	int ejections = 0;
+	bool ejected = false;
+	int64_t ejected_until = 0;
+	bool probing = false;
+};
+
+/* spreads requests across a set of equivalent host:port targets, ejecting
+ * backends that fail and probing them periodically until they recover. Any
+ * successful response from an ejected backend readmits it as well.
+ * Must be owned by an upstream_group_ptr_t. */
+struct upstream_group_t : public std::enable_shared_from_this<upstream_group_t>
+{
+	NOCOPY(upstream_group_t);
+	upstream_group_t(const std::vector<std::string> &targets,
+			upstream_balance_t balance = upstream_power_of_two,
+			const http_client_options_t &options = http_client_options_t());
+	~upstream_group_t();
+
+	void get(const std::string &path, response_callback_t &&callback);
+
+	/* consecutive failures before ejection, and the first ejection period
+	 * in milliseconds (it doubles with each repeat ejection) */
+	int eject_after = 5;
+	int eject_time = 10000;
+	std::string probe_path = "/";
+
+	const std::vector<upstream_backend_t> &get_backends() const { return backends; }
+
+private:
+	upstream_backend_t *choose();
+	void record(upstream_backend_t *backend, const http_client_response_t &response, uint64_t latency);
+	void probe();
+
+	std::vector<upstream_backend_t> backends;
+	upstream_balance_t balance;
+	http_client_options_t options;
+	uv_timer_t *probe_timer;
+
+	static void on_probe_timer(uv_timer_t *timer, int status);
+};
+
+typedef std::shared_ptr<upstream_group_t> upstream_group_ptr_t;
@@ -0,0 +1,215 @@
+#include "upstream_pool.h"
+#include <assert.h>
+#include <algorithm>
+#include "dns_cache.h"
+#include "tcp_connect.h"
+#include "logger_decls.h"
+#include "loop_monitor.h"
+
+struct upstream_connect_t
+{
+	upstream_pool_ptr_t pool;
+	upstream_acquire_callback_t callback;
+	tcp_connect_race_t *race = nullptr;
+	uv_timer_t timer;
+	bool finished = false;
+
+	/* the timer plus the resolve, which can't be called off */
+	int open_handles = 2;
+
+	void finish(uv_tcp_t *tcp_handle);
+	void release();
+};
+
+static void upstream_connect_timer_close(uv_handle_t *handle)
+{
+	static_cast<upstream_connect_t *>(handle->data)->release();
+}
+
+void upstream_connect_t::finish(uv_tcp_t *tcp_handle)
+{
+	if (finished)
+		return;
+	finished = true;
+
+	tcp_connect_cancel(race);
+	race = nullptr;
+	uv_timer_stop(&timer);
+	uv_close((uv_handle_t *)&timer, upstream_connect_timer_close);
+
+	if (callback != nullptr)
+	{
+		auto done = std::move(callback);
+		done(tcp_handle);
+	}
+	else if (tcp_handle != nullptr)
+	{
+		upstream_pool_t::close_handle(tcp_handle);
+	}
+}
+
+void upstream_connect_t::release()
+{
+	if (--open_handles == 0)
+		delete this;
+}
+
+upstream_pool_t::upstream_pool_t(const std::string &hostname, int port, size_t max_idle,
+		int connect_timeout)
+	: hostname(hostname), port(port), max_idle(max_idle), connect_timeout(connect_timeout)
+{
+}
+
+upstream_pool_t::~upstream_pool_t()
+{
+	for (auto tcp_handle : idle_handles)
+	{
+		tcp_handle->data = nullptr;
+		close_handle(tcp_handle);
+	}
+}
+
+static void upstream_on_close(uv_handle_t *handle)
+{
+	delete (uv_tcp_t *)handle;
+}
+
+void upstream_pool_t::close_handle(uv_tcp_t *tcp_handle)
+{
+	if (!uv_is_closing((uv_handle_t *)tcp_handle))
+		uv_close((uv_handle_t *)tcp_handle, upstream_on_close);
+}
+
+void upstream_pool_t::forget_idle(uv_tcp_t *tcp_handle)
+{
+	auto iter = std::find(idle_handles.begin(), idle_handles.end(), tcp_handle);
+	if (iter != idle_handles.end())
+		idle_handles.erase(iter);
+}
+
+uv_buf_t upstream_pool_t::idle_alloc(uv_handle_t *handle, size_t suggested_size)
+{
+	uv_buf_t buf;
+	buf.base = new char[suggested_size];
+	buf.len = suggested_size;
+	return buf;
+}
+
+void upstream_pool_t::idle_read(uv_stream_t *stream, ssize_t nread, uv_buf_t buf)
+{
+	loop_monitor_scope_t scope("upstream_pool_t::idle_read");
+	delete[] buf.base;
+
+	if (nread == 0)
+		return;
+
+	/* an idle upstream either hung up or sent something unsolicited,
+	 * neither of which leaves it usable */
+	auto pool = static_cast<upstream_pool_t *>(stream->data);
+	dlog(log_info, "upstream_pool_t : dropping idle connection to %s\n",
+			pool != nullptr ? pool->hostname.c_str() : "?");
+	if (pool != nullptr)
+		pool->forget_idle((uv_tcp_t *)stream);
+	close_handle((uv_tcp_t *)stream);
+}
+
+void upstream_pool_t::after_connect(upstream_connect_t *connect, uv_tcp_t *tcp_handle)
+{
+	if (tcp_handle == nullptr)
+	{
+		dlog(log_error, "upstream_pool_t : connection to %s:%d failed\n",
+				connect->pool->hostname.c_str(), connect->pool->port);
+	}
+	else
+	{
+		uv_tcp_nodelay(tcp_handle, 1);
+	}
+
+	connect->race = nullptr;
+	connect->finish(tcp_handle);
+}
+
+void upstream_pool_t::on_connect_timeout(uv_timer_t *timer, int status)
+{
+	auto connect = static_cast<upstream_connect_t *>(timer->data);
+	dlog(log_error, "upstream_pool_t : connecting to %s:%d timed out\n",
+			connect->pool->hostname.c_str(), connect->pool->port);
+	connect->finish(nullptr);
+}
+
+upstream_connect_t *upstream_pool_t::acquire(upstream_acquire_callback_t &&callback)
+{
+	if (idle_handles.size() != 0)
+	{
+		uv_tcp_t *tcp_handle = idle_handles.back();
+		idle_handles.pop_back();
+		uv_read_stop((uv_stream_t *)tcp_handle);
+		tcp_handle->data = nullptr;
+		callback(tcp_handle);
+		return nullptr;
+	}
+
+	auto connect = new upstream_connect_t;
+	connect->pool = shared_from_this();
+	connect->callback = std::move(callback);
+
+	/* the timeout covers the resolve and the whole connect race */
+	uv_timer_init(uv_default_loop(), &connect->timer);
+	connect->timer.data = connect;
+	if (connect_timeout > 0)
+		uv_timer_start(&connect->timer, on_connect_timeout, connect_timeout, 0);
+
+	dns_resolve(hostname, port, [connect](int status, const dns_addresses_t &addresses) {
+		if (connect->finished)
+		{
+			/* timed out or cancelled while resolving */
+		}
+		else if (status < 0)
+		{
+			connect->finish(nullptr);
+		}
+		else
+		{
+			auto race = tcp_connect(addresses, [connect](uv_tcp_t *tcp_handle) {
+				after_connect(connect, tcp_handle);
+			});
+			if (!connect->finished)
+				connect->race = race;
+		}
+		connect->release();
+	});
+
+	/* the timer's close is still pending, so connect is alive to look at */
+	return connect->finished ? nullptr : connect;
+}
+
+void upstream_pool_t::cancel(upstream_connect_t *connect)
+{
+	if (connect == nullptr)
+		return;
+
+	connect->callback = nullptr;
+	connect->finish(nullptr);
+}
+
+void upstream_pool_t::release(uv_tcp_t *tcp_handle, bool reusable)
+{
+	assert(tcp_handle != nullptr);
+
+	if (!reusable || idle_handles.size() >= max_idle
+			|| uv_is_closing((uv_handle_t *)tcp_handle))
+	{
+		close_handle(tcp_handle);
+		return;
+	}
+
+	/* keep reading so that we notice when the upstream hangs up */
+	tcp_handle->data = this;
+	if (uv_read_start((uv_stream_t *)tcp_handle, idle_alloc, idle_read) != 0)
+	{
+		tcp_handle->data = nullptr;
+		close_handle(tcp_handle);
+		return;
+	}
+	idle_handles.push_back(tcp_handle);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <uv.h>
+#include "nocopy.h"
+
+struct upstream_connect_t;
+
+/* how long resolving and connecting to the upstream may take, in ms */
+const int upstream_connect_timeout = 5000;
+
+/* handed a connected tcp handle, or nullptr if no connection could be made */
+using upstream_acquire_callback_t = std::function<void(uv_tcp_t *tcp_handle)>;
+
+/* a set of keep-alive connections to one upstream host */
+struct upstream_pool_t : public std::enable_shared_from_this<upstream_pool_t>
+{
+	NOCOPY(upstream_pool_t);
+	upstream_pool_t(const std::string &hostname, int port, size_t max_idle = 32,
+			int connect_timeout = upstream_connect_timeout);
+	~upstream_pool_t();
+
+	/* returns the pending connection while callback is yet to run, for
+	 * cancel, and nullptr once it has */
+	upstream_connect_t *acquire(upstream_acquire_callback_t &&callback);
+
+	/* abandons a pending connection, its callback never runs */
+	void cancel(upstream_connect_t *connect);
+
+	/* returns a handle to the pool. handles that are not reusable (errors,
+	 * Connection: close, unread response bytes) are closed instead. */
+	void release(uv_tcp_t *tcp_handle, bool reusable);
+
+	const std::string hostname;
+	const int port;
+
+	static void close_handle(uv_tcp_t *tcp_handle);
+
+private:
+	size_t max_idle;
+	int connect_timeout;
+	std::vector<uv_tcp_t *> idle_handles;
+
+	void forget_idle(uv_tcp_t *tcp_handle);
+
+	static uv_buf_t idle_alloc(uv_handle_t *handle, size_t suggested_size);
+	static void idle_read(uv_stream_t *stream, ssize_t nread, uv_buf_t buf);
+	static void after_connect(upstream_connect_t *connect, uv_tcp_t *tcp_handle);
+	static void on_connect_timeout(uv_timer_t *timer, int status);
+};
+
+typedef std::shared_ptr<upstream_pool_t> upstream_pool_ptr_t;
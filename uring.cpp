@@ -0,0 +1,298 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "logger_decls.h"
+#include "loop_monitor.h"
+
+static int uring_setup(unsigned entries, io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+uring_t::uring_t(uv_loop_t *loop)
+	: m_loop(loop), m_ring_fd(-1), m_event_fd(-1),
+	m_sq_ring(MAP_FAILED), m_sq_ring_size(0), m_cq_ring(MAP_FAILED), m_cq_ring_size(0),
+	m_sqes((io_uring_sqe *)MAP_FAILED), m_sqes_size(0),
+	m_sq_entries(0), m_cq_entries(0), m_to_submit(0), m_in_flight(0),
+	m_prepare(nullptr), m_poll(nullptr), m_referenced(false)
+{
+}
+
+uring_t *uring_t::create(uv_loop_t *loop, unsigned entries)
+{
+	uring_t *uring = new uring_t(loop);
+	if (!uring->setup(entries))
+	{
+		delete uring;
+		return nullptr;
+	}
+	return uring;
+}
+
+bool uring_t::setup(unsigned entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_ring_fd = uring_setup(entries, &params);
+	if (m_ring_fd < 0)
+	{
+		dlog(log_info, "uring_t : io_uring_setup failed (%s)\n", strerror(errno));
+		return false;
+	}
+
+	m_sq_entries = params.sq_entries;
+	m_cq_entries = params.cq_entries;
+	m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+	m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ring == MAP_FAILED)
+		return false;
+
+	if (single_mmap)
+	{
+		m_cq_ring = m_sq_ring;
+	}
+	else
+	{
+		m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+		if (m_cq_ring == MAP_FAILED)
+			return false;
+	}
+
+	m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = (io_uring_sqe *)mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+		return false;
+
+	char *sq = (char *)m_sq_ring;
+	m_sq_head = (unsigned *)(sq + params.sq_off.head);
+	m_sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	m_sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	m_sq_array = (unsigned *)(sq + params.sq_off.array);
+
+	char *cq = (char *)m_cq_ring;
+	m_cq_head = (unsigned *)(cq + params.cq_off.head);
+	m_cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	m_cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	/* which operations this kernel has, so callers can fall back */
+	m_supported.assign(256, false);
+	size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	io_uring_probe *probe = (io_uring_probe *)calloc(1, probe_size);
+	if (uring_register(m_ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+	{
+		for (unsigned i = 0; i < probe->ops_len; ++i)
+		{
+			if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+				m_supported[probe->ops[i].op] = true;
+		}
+	}
+	free(probe);
+
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_event_fd < 0)
+		return false;
+	if (uring_register(m_ring_fd, IORING_REGISTER_EVENTFD, &m_event_fd, 1) != 0)
+		return false;
+
+	m_prepare = new uv_prepare_t;
+	uv_prepare_init(m_loop, m_prepare);
+	m_prepare->data = this;
+	uv_prepare_start(m_prepare, on_prepare);
+	uv_unref((uv_handle_t *)m_prepare);
+
+	m_poll = new uv_poll_t;
+	uv_poll_init(m_loop, m_poll, m_event_fd);
+	m_poll->data = this;
+	uv_poll_start(m_poll, UV_READABLE, on_eventfd);
+	uv_unref((uv_handle_t *)m_poll);
+	return true;
+}
+
+static void uring_prepare_close(uv_handle_t *handle)
+{
+	delete (uv_prepare_t *)handle;
+}
+
+static void uring_poll_close(uv_handle_t *handle)
+{
+	delete (uv_poll_t *)handle;
+}
+
+uring_t::~uring_t()
+{
+	assert(m_in_flight == 0 && m_to_submit == 0 && m_backlog.size() == 0);
+
+	if (m_prepare != nullptr)
+	{
+		uv_prepare_stop(m_prepare);
+		uv_close((uv_handle_t *)m_prepare, uring_prepare_close);
+	}
+	if (m_poll != nullptr)
+	{
+		uv_poll_stop(m_poll);
+		uv_close((uv_handle_t *)m_poll, uring_poll_close);
+	}
+
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+		munmap(m_cq_ring, m_cq_ring_size);
+	if (m_sq_ring != MAP_FAILED)
+		munmap(m_sq_ring, m_sq_ring_size);
+	if (m_event_fd != -1)
+		close(m_event_fd);
+	if (m_ring_fd != -1)
+		close(m_ring_fd);
+}
+
+bool uring_t::supports(int opcode) const
+{
+	return (opcode >= 0) && (opcode < (int)m_supported.size()) && m_supported[opcode];
+}
+
+void uring_t::queue(const io_uring_sqe &sqe, uring_callback_t &&callback)
+{
+	pending_t pending;
+	pending.sqe = sqe;
+	pending.callback = new uring_callback_t(std::move(callback));
+	m_backlog.push_back(pending);
+
+	fill_sq();
+	update_ref();
+}
+
+void uring_t::fill_sq()
+{
+	size_t filled = 0;
+	while (filled < m_backlog.size())
+	{
+		/* never have more outstanding than the completion queue can hold */
+		if (m_in_flight + m_to_submit >= m_cq_entries)
+			break;
+
+		unsigned tail = *m_sq_tail;
+		unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= m_sq_entries)
+		{
+			/* the submission queue is full, let the kernel have it */
+			submit();
+			head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+			if (tail - head >= m_sq_entries)
+				break;
+		}
+
+		unsigned index = tail & *m_sq_mask;
+		m_sqes[index] = m_backlog[filled].sqe;
+		m_sqes[index].user_data = (uint64_t)(uintptr_t)m_backlog[filled].callback;
+		m_sq_array[index] = index;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++m_to_submit;
+		++filled;
+	}
+
+	m_backlog.erase(m_backlog.begin(), m_backlog.begin() + filled);
+}
+
+void uring_t::submit()
+{
+	while (m_to_submit != 0)
+	{
+		int submitted = uring_enter(m_ring_fd, m_to_submit);
+		if (submitted < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EBUSY)
+				log(log_error, "uring_t : io_uring_enter failed (%s)\n", strerror(errno));
+			/* try again on the next loop iteration */
+			return;
+		}
+		m_to_submit -= submitted;
+		m_in_flight += submitted;
+	}
+}
+
+void uring_t::reap()
+{
+	uint64_t events;
+	while (read(m_event_fd, &events, sizeof(events)) > 0)
+	{
+		/* just clearing the eventfd */
+	}
+
+	unsigned head = *m_cq_head;
+	while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+	{
+		io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+		auto callback = (uring_callback_t *)(uintptr_t)cqe->user_data;
+		int result = cqe->res;
+
+		/* give the slot back before the callback, it may queue more */
+		__atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+		--m_in_flight;
+
+		(*callback)(result);
+		delete callback;
+	}
+
+	fill_sq();
+	update_ref();
+}
+
+void uring_t::update_ref()
+{
+	/* only keep the loop alive while something is outstanding */
+	bool busy = (m_in_flight != 0) || (m_to_submit != 0) || (m_backlog.size() != 0);
+	if (busy == m_referenced)
+		return;
+
+	m_referenced = busy;
+	if (busy)
+		uv_ref((uv_handle_t *)m_poll);
+	else
+		uv_unref((uv_handle_t *)m_poll);
+}
+
+void uring_t::on_prepare(uv_prepare_t *handle, int status)
+{
+	auto uring = static_cast<uring_t *>(handle->data);
+	uring->fill_sq();
+	uring->submit();
+	uring->update_ref();
+}
+
+void uring_t::on_eventfd(uv_poll_t *handle, int status, int events)
+{
+	loop_monitor_scope_t scope("uring_t::on_eventfd");
+	static_cast<uring_t *>(handle->data)->reap();
+}
+
+#endif
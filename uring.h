@@ -0,0 +1,106 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <uv.h>
+#include "nocopy.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* result is what the kernel put in the completion, -errno on failure */
+typedef std::function<void(int result)> uring_callback_t;
+
+#ifdef HAVE_IO_URING
+
+/* an io_uring instance driven by a libuv loop, talking to the kernel through
+ * raw syscalls. submissions are queued and handed to the kernel in one
+ * io_uring_enter per loop iteration (from a prepare handle), completions are
+ * signalled through an eventfd that the loop polls. */
+class uring_t
+{
+public:
+	NOCOPY(uring_t);
+	~uring_t();
+
+	/* nullptr when the kernel has no io_uring or won't let us use it */
+	static uring_t *create(uv_loop_t *loop, unsigned entries = 256);
+
+	/* whether the kernel knows the given IORING_OP_ */
+	bool supports(int opcode) const;
+
+	/* copies sqe (user_data is ours) and calls callback once it completes.
+	 * anything the sqe points at must stay valid until then. */
+	void queue(const io_uring_sqe &sqe, uring_callback_t &&callback);
+
+	/* hands queued submissions to the kernel now rather than before the
+	 * loop next blocks */
+	void submit();
+
+private:
+	uring_t(uv_loop_t *loop);
+	bool setup(unsigned entries);
+	void fill_sq();
+	void reap();
+	void update_ref();
+
+	static void on_prepare(uv_prepare_t *handle, int status);
+	static void on_eventfd(uv_poll_t *handle, int status, int events);
+
+	struct pending_t
+	{
+		io_uring_sqe sqe;
+		uring_callback_t *callback;
+	};
+
+	uv_loop_t *m_loop;
+	int m_ring_fd;
+	int m_event_fd;
+
+	void *m_sq_ring;
+	size_t m_sq_ring_size;
+	void *m_cq_ring;
+	size_t m_cq_ring_size;
+	io_uring_sqe *m_sqes;
+	size_t m_sqes_size;
+
+	unsigned *m_sq_head;
+	unsigned *m_sq_tail;
+	unsigned *m_sq_mask;
+	unsigned *m_sq_array;
+	unsigned m_sq_entries;
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned *m_cq_mask;
+	io_uring_cqe *m_cqes;
+	unsigned m_cq_entries;
+
+	/* filled into the sq but not yet given to io_uring_enter */
+	unsigned m_to_submit;
+
+	/* given to the kernel and not completed, kept under m_cq_entries so the
+	 * completion queue can't overflow */
+	unsigned m_in_flight;
+	std::vector<pending_t> m_backlog;
+
+	std::vector<bool> m_supported;
+
+	uv_prepare_t *m_prepare;
+	uv_poll_t *m_poll;
+	bool m_referenced;
+};
+
+#else
+
+class uring_t
+{
+public:
+	static uring_t *create(uv_loop_t *loop, unsigned entries = 256) { return nullptr; }
+};
+
+#endif
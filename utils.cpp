@@ -6,10 +6,16 @@
 #include <sys/types.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <sys/sysctl.h>
 #include <net/if.h>
 #include <iomanip>
 #include "logger_decls.h"
+#include "mapped_file.h"
+#include "multi_search.h"
+#include "text_encoding.h"
+#include "clock_source.h"
 
 #define case_error(error) case error: error_string = #error; break
 
@@ -57,88 +63,96 @@ bool check_errno(const char *tag)
 	return false;
 }
 
-void advance_line_count(
-		const char *pch_dest,
-		int &line,
-		int &char_offset,
-		const char *&pch_last_line_break)
+/* the line and column of successive positions in a buffer. positions are
+ * counted as they're passed, so many matches on one long line stay linear. */
+template <typename T>
+struct line_tracker_t
 {
-	char_offset = 1;
-	const char *pch = pch_last_line_break;
-	assert(pch < pch_dest);
-	while (++pch != pch_dest)
+	line_tracker_t(const T *begin, T newline)
+		: pos(begin), last_line_break(begin - 1), newline(newline), line(1), char_offset(1)
 	{
-		if (*pch == '\n')
-		{
-			pch_last_line_break = pch;
-			char_offset = 1;
-			++line;
-		}
-		else
-		{
-			++char_offset;
-		}
 	}
-}
 
-void advance_line_count(
-		const uint16_t *pch_dest,
-		int &line,
-		int &char_offset,
-		const uint16_t *&pch_last_line_break)
-{
-	char_offset = 1;
-	const uint16_t *pch = pch_last_line_break;
-	assert(pch < pch_dest);
-	while (++pch != pch_dest)
+	void advance(const T *dest)
 	{
-		if (*pch == '\n')
+		for (; pos < dest; ++pos)
 		{
-			pch_last_line_break = pch;
-			char_offset = 1;
-			++line;
-		}
-		else
-		{
-			++char_offset;
+			if (*pos == newline)
+			{
+				last_line_break = pos;
+				char_offset = 1;
+				++line;
+			}
+			else
+			{
+				++char_offset;
+			}
 		}
 	}
-}
 
-void advance_line_count_be(
-		const uint16_t *pch_dest,
-		int &line,
-		int &char_offset,
-		const uint16_t *&pch_last_line_break)
+	const T *pos;
+	const T *last_line_break;
+	T newline;
+	int line;
+	int char_offset;
+};
+
+bool contains_binary(const std::string &text)
 {
-	char_offset = 1;
-	const uint16_t *pch = pch_last_line_break;
-	assert(pch < pch_dest);
-	while (++pch != pch_dest)
+	for (unsigned char ch : text)
 	{
-		if (*pch == (int('\n') << 8))
-		{
-			pch_last_line_break = pch;
-			char_offset = 1;
-			++line;
-		}
-		else
-		{
-			++char_offset;
-		}
+		if ((!iswspace(ch) && (ch < 32)) || (ch == 127))
+			return true;
 	}
+	return !valid_utf8(text);
 }
 
-bool contains_binary(const std::string &text)
+static bool contains_binary(const uint16_t *wch, const uint16_t *wch_end, text_encoding_t encoding)
 {
-	for (auto ch : text)
+	for (; wch < wch_end; ++wch)
 	{
-		if ((!iswspace(ch) && (ch < 32)) || (ch > 127))
+		uint16_t unit = utf16_unit(*wch, encoding);
+		if ((!iswspace(unit) && (unit < 32)) || (unit == 127))
 			return true;
 	}
 	return false;
 }
 
+static void print_match_text(
+		const std::string &input_buffer_name,
+		int line,
+		int char_offset,
+		bool pretty_print,
+		bool binary,
+		const std::string &prefix,
+		const std::string &text,
+		const std::string &suffix)
+{
+	if (binary)
+	{
+		printf("%s%s%s:%d:%d: <line matched but contained seemingly binary data>\n",
+				pretty_print ? KRED : "",
+				input_buffer_name.c_str(),
+				pretty_print ? KNRM : "",
+				line,
+				char_offset);
+	}
+	else
+	{
+		printf("%s%s%s:%d:%d: %s%s%s%s%s\n",
+				pretty_print ? KRED : "",
+				input_buffer_name.c_str(),
+				pretty_print ? KNRM : "",
+				line,
+				char_offset,
+				prefix.c_str(),
+				pretty_print ? KBLU : "",
+				text.c_str(),
+				pretty_print ? KNRM : "",
+				suffix.c_str());
+	}
+}
+
 void print_match_line(
 		const std::string &input_buffer_name,
 		int line,
@@ -147,15 +161,28 @@ void print_match_line(
 		const uint16_t *wch_last_line_break,
 		const uint16_t *wch_next,
 		const char *pch_end,
-		int run_length)
+		int run_length,
+		text_encoding_t encoding)
 {
-	// TODO implement unicode output
-	printf("%s%s%s:%d:%d: <pattern found in unicode file>\n",
-			pretty_print ? KRED : "",
-			input_buffer_name.c_str(),
-			pretty_print ? KNRM : "",
-			line,
-			char_offset);
+	const uint16_t *wch_end = wch_next + (pch_end - (const char *)wch_next) / sizeof(uint16_t);
+	const uint16_t *wch_end_of_line = wch_next + run_length;
+	while (wch_end_of_line < wch_end)
+	{
+		uint16_t unit = utf16_unit(*wch_end_of_line, encoding);
+		if (unit == '\r' || unit == '\n')
+			break;
+		++wch_end_of_line;
+	}
+
+	const uint16_t *wch_line = wch_last_line_break + 1;
+	const uint16_t *wch_suffix = wch_next + run_length;
+	bool binary = contains_binary(wch_line, wch_next, encoding)
+		|| contains_binary(wch_suffix, wch_end_of_line, encoding);
+
+	print_match_text(input_buffer_name, line, char_offset, pretty_print, binary,
+			utf16_to_utf8(wch_line, wch_next - wch_line, encoding),
+			utf16_to_utf8(wch_next, run_length, encoding),
+			utf16_to_utf8(wch_suffix, wch_end_of_line - wch_suffix, encoding));
 }
 
 void print_match_line(
@@ -181,180 +208,431 @@ void print_match_line(
 	auto text = std::string(pch_next, run_length);
 	auto suffix = std::string(pch_next + run_length, (pch_end_of_line - pch_next) - run_length);
 
-	if (contains_binary(prefix) || contains_binary(suffix))
-	{
-		printf("%s%s%s:%d:%d: <line matched but contained seemingly binary data>\n",
-				pretty_print ? KRED : "",
-				input_buffer_name.c_str(),
-				pretty_print ? KNRM : "",
-				line,
-				char_offset);
-	}
-	else
-	{
-		printf("%s%s%s:%d:%d: %s%s%s%s%s\n",
-				pretty_print ? KRED : "",
-				input_buffer_name.c_str(),
-				pretty_print ? KNRM : "",
-				line,
-				char_offset,
-				prefix.c_str(),
-				pretty_print ? KBLU : "",
-				text.c_str(),
-				pretty_print ? KNRM : "",
-				suffix.c_str());
-	}
+	print_match_text(input_buffer_name, line, char_offset, pretty_print,
+			contains_binary(prefix) || contains_binary(suffix), prefix, text, suffix);
 }
 
-bool odd_pointer(const void *p)
+/* the befores as search patterns and the afters as they'll be written, both
+ * in the buffer's encoding. empty befores are dropped, along with their
+ * afters, so the two stay index for index with multi_search_t's patterns. */
+static void encode_replacements(
+		const std::vector<replace_pair_t> &replacements,
+		text_encoding_t encoding,
+		std::vector<search_pattern_t> &patterns,
+		std::vector<std::string> &afters)
 {
-	static_assert(sizeof(unsigned long) == sizeof(void *), "find a way to check this");
-	if (reinterpret_cast<unsigned long>(p) & 1)
+	unsigned alignment = (encoding == text_encoding_utf8) ? 1 : sizeof(uint16_t);
+	for (auto &replacement : replacements)
 	{
-		debug_ex(dlog(log_info, "odd pointer is 0x%8lx\n", (unsigned long)p));
-		return true;
-	}
+		if (replacement.before.size() == 0)
+			continue;
 
-	return false;
+		patterns.push_back({ encode_text(replacement.before, encoding), alignment });
+		afters.push_back(encode_text(replacement.after, encoding));
+	}
 }
 
 bool streamed_replace(
 		const std::string &input_buffer_name,
 		const char *pch_begin,
-	   	const char * const pch_end,
-	   	const std::string &before,
-	   	const std::string &after,
-	   	std::ostream &ofs,
+		const char * const pch_end,
+		const std::vector<replace_pair_t> &replacements,
+		std::ostream &ofs,
 		bool print_matches,
 		bool pretty_print,
 		bool do_replace)
 {
-	assert(odd_pointer((void *)0x1));
-	assert(!odd_pointer((void *)0x1004));
+	/* work out what the buffer holds once, and look for the replacements
+	 * encoded the same way, in a single pass */
+	size_t bom_length;
+	text_encoding_t encoding = detect_text_encoding(pch_begin, pch_end, bom_length);
+	size_t unit_size = (encoding == text_encoding_utf8) ? 1 : sizeof(uint16_t);
+	dlog(log_info, "streamed_replace : %s looks like %s\n", input_buffer_name.c_str(),
+			text_encoding_name(encoding));
+
+	std::vector<search_pattern_t> patterns;
+	std::vector<std::string> afters;
+	encode_replacements(replacements, encoding, patterns, afters);
+	multi_search_t search(patterns);
+
+	line_tracker_t<char> lines(pch_begin, '\n');
+	line_tracker_t<uint16_t> wlines((const uint16_t *)pch_begin, utf16_unit('\n', encoding));
 
 	const char *pch = pch_begin;
 	bool found_before_target = false;
-
-	// TODO get rid of this poor man's ascii -> unicode to enable non-latin code pages, etc...
-	static_assert(sizeof(int16_t) == 2, "doh!");
-	std::basic_string<int16_t> wbefore, wafter;
-	std::basic_string<int16_t> wbefore_be, wafter_be;
-	std::copy(before.begin(), before.end(), std::back_inserter(wbefore));
-	std::copy(after.begin(), after.end(), std::back_inserter(wafter));
-	wbefore_be = wbefore;
-	wafter_be = wafter;
-	for (auto &wch : wbefore_be)
-		std::swap(*(char *)&wch, *(((char *)&wch) + 1));
-	for (auto &wch : wafter_be)
-		std::swap(*(char *)&wch, *(((char *)&wch) + 1));
-
-	int line = 1;
-	int char_offset = 1;
-	const char *pch_last_line_break = pch_begin - 1;
-	const uint16_t *wch_last_line_break = ((const uint16_t *)pch_begin) - 1;
-
-	std::vector<const char *> nexts;
-	assert(((char *)wbefore.c_str())[0] == 0 || ((char *)wbefore.c_str())[1] == 0);
 	while (pch < pch_end)
 	{
-		const uint16_t *wch_next = (const uint16_t *)memmem(pch, pch_end - pch, &wbefore[0], wbefore.size() * sizeof(wbefore[0]));
-		const uint16_t *wch_next_be = (const uint16_t *)memmem(pch, pch_end - pch, &wbefore_be[0], wbefore_be.size() * sizeof(wbefore[0]));
-		const char *pch_next = (const char *)memmem(pch, pch_end - pch, before.c_str(), before.size());
+		size_t pattern;
+		const char *pch_next = search.find(pch_begin, pch, pch_end, pattern);
+		if (pch_next == nullptr)
+		{
+			if (do_replace)
+				ofs.write(pch, pch_end - pch);
+			break;
+		}
 
-		if (odd_pointer(wch_next))
+		found_before_target = true;
+		size_t before_bytes = search.pattern(pattern).bytes.size();
+		if (print_matches)
 		{
-			dlog(log_info, "clearing wch_next in file %s\n",
-					input_buffer_name.c_str());
-			wch_next = nullptr;
+			if (encoding == text_encoding_utf8)
+			{
+				lines.advance(pch_next);
+				print_match_line(input_buffer_name, lines.line, lines.char_offset,
+						pretty_print, lines.last_line_break, pch_next,
+						pch_end, before_bytes);
+			}
+			else
+			{
+				const uint16_t *wch_next = (const uint16_t *)pch_next;
+				wlines.advance(wch_next);
+				print_match_line(input_buffer_name, wlines.line, wlines.char_offset,
+						pretty_print, wlines.last_line_break, wch_next,
+						pch_end, before_bytes / unit_size, encoding);
+			}
 		}
 
-		if (odd_pointer(wch_next_be))
+		if (do_replace)
 		{
-			dlog(log_info, "clearing wch_next_be in file %s\n",
-					input_buffer_name.c_str());
-			wch_next_be = nullptr;
+			ofs.write(pch, pch_next - pch);
+			ofs.write(afters[pattern].c_str(), afters[pattern].size());
 		}
-		nexts.resize(0);
+		pch = pch_next + before_bytes;
+	}
+	return found_before_target;
+}
 
-		if (wch_next != nullptr)
-			nexts.push_back((const char *)wch_next);
-		if (wch_next_be != nullptr)
-			nexts.push_back((const char *)wch_next_be);
-		if (pch_next != nullptr)
-			nexts.push_back(pch_next);
+bool streamed_replace(
+		const std::string &input_buffer_name,
+		const char *pch_begin,
+		const char * const pch_end,
+		const std::string &before,
+		const std::string &after,
+		std::ostream &ofs,
+		bool print_matches,
+		bool pretty_print,
+		bool do_replace)
+{
+	return streamed_replace(input_buffer_name, pch_begin, pch_end, { { before, after } },
+			ofs, print_matches, pretty_print, do_replace);
+}
+
+bool streamed_replace_file(
+		const std::string &file_path,
+		const std::string &before,
+		const std::string &after,
+		std::ostream &ofs,
+		bool print_matches,
+		bool pretty_print,
+		bool do_replace)
+{
+	/* one mapping for the lot, matches and line numbers can't span windows */
+	mapped_file_t file;
+	if (!file.map_file(file_path, mapped_file_read,
+				mapped_file_sequential | mapped_file_willneed | mapped_file_huge_pages))
+	{
+		return false;
+	}
+
+	if (file.size() == 0)
+		return false;
+
+	return streamed_replace(file_path, file.begin(), file.end(), before, after, ofs,
+			print_matches, pretty_print, do_replace);
+}
+
+/* each chunk of a parallel replace is searched from its start, and owns the
+ * matches that start inside it. positions of line breaks are counted per
+ * chunk so the lines can be numbered once the chunks are put in order. */
+struct replace_match_t
+{
+	const char *pch;
+	size_t pattern;
+
+	/* line breaks between the start of the chunk and the match, and the last
+	 * of them (nullptr if there are none) */
+	size_t lines;
+	const char *last_line_break;
+};
 
-		std::sort(nexts.begin(), nexts.end());
-		if (nexts.size() != 0)
+struct replace_chunk_t
+{
+	const char *begin;
+	const char *end;
+	std::vector<replace_match_t> matches;
+	size_t lines;
+	const char *last_line_break;
+};
+
+/* how many line breaks lie in [pch, pch_end), leaving the last of them in
+ * last_line_break */
+static size_t count_line_breaks(
+		const char *pch,
+		const char *pch_end,
+		text_encoding_t encoding,
+		const char *&last_line_break)
+{
+	size_t lines = 0;
+	if (encoding == text_encoding_utf8)
+	{
+		while ((pch = (const char *)memchr(pch, '\n', pch_end - pch)) != nullptr)
 		{
-			found_before_target = true;
-			if (nexts[0] == (const char *)wch_next)
+			last_line_break = pch++;
+			++lines;
+		}
+	}
+	else
+	{
+		uint16_t newline = utf16_unit('\n', encoding);
+		for (const uint16_t *wch = (const uint16_t *)pch; wch < (const uint16_t *)pch_end; ++wch)
+		{
+			if (*wch == newline)
 			{
-				advance_line_count(wch_next, line, char_offset, wch_last_line_break);
+				last_line_break = (const char *)wch;
+				++lines;
+			}
+		}
+	}
+	return lines;
+}
 
-				if (print_matches)
-				{
-					print_match_line(input_buffer_name, line, char_offset,
-							pretty_print, wch_last_line_break, wch_next,
-							pch_end, before.size());
-				}
-				if (do_replace)
-				{
-					ofs.write(pch, ((const char *)(wch_next)) - pch);
-					ofs.write((const char *)wafter.c_str(), wafter.size() * sizeof(wafter[0]));
-				}
-				pch = ((const char *)wch_next) + (wbefore.size() * sizeof(wbefore[0]));
+/* the matches a serial scan would find from pch onwards that start inside
+ * chunk, stopping early if the scan falls in step with matches already found
+ * (from that point the two can only agree) */
+static void rescan_chunk(
+		const multi_search_t &search,
+		const char *pch_base,
+		const char *pch,
+		const char *pch_end,
+		replace_chunk_t &chunk,
+		text_encoding_t encoding,
+		bool count_lines)
+{
+	std::vector<replace_match_t> matches;
+	size_t next = 0;
+	while (pch < chunk.end)
+	{
+		replace_match_t match;
+		match.pch = search.find(pch_base, pch, pch_end, match.pattern);
+		if (match.pch == nullptr || match.pch >= chunk.end)
+		{
+			next = chunk.matches.size();
+			break;
+		}
+
+		while (next < chunk.matches.size() && chunk.matches[next].pch < match.pch)
+			++next;
+		if (next < chunk.matches.size() && chunk.matches[next].pch == match.pch)
+			break;
+
+		match.lines = 0;
+		match.last_line_break = nullptr;
+		if (count_lines)
+			match.lines = count_line_breaks(chunk.begin, match.pch, encoding, match.last_line_break);
+		matches.push_back(match);
+		pch = match.pch + search.pattern(match.pattern).bytes.size();
+	}
+	if (pch >= chunk.end)
+		next = chunk.matches.size();
+
+	matches.insert(matches.end(), chunk.matches.begin() + next, chunk.matches.end());
+	chunk.matches.swap(matches);
+}
+
+/* writes out the whole of iov, coping with short writes */
+static bool writev_all(int fd, std::vector<iovec> &iov)
+{
+	size_t first = 0;
+	while (first < iov.size())
+	{
+		int count = (int)std::min(iov.size() - first, (size_t)IOV_MAX);
+		ssize_t written = writev(fd, &iov[first], count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			dlog(log_error, "parallel_replace_file : couldn't write output (%s)\n", strerror(errno));
+			return false;
+		}
+
+		while (written > 0)
+		{
+			if ((size_t)written >= iov[first].iov_len)
+			{
+				written -= iov[first].iov_len;
+				++first;
 			}
-			if (nexts[0] == (const char *)wch_next_be)
+			else
 			{
-				advance_line_count_be(wch_next_be, line, char_offset, wch_last_line_break);
-
-				if (print_matches)
-				{
-					print_match_line(input_buffer_name, line, char_offset,
-							pretty_print, wch_last_line_break, wch_next_be,
-							pch_end, before.size());
-				}
-				if (do_replace)
-				{
-					ofs.write(pch, ((const char *)(wch_next_be)) - pch);
-					ofs.write((const char *)wafter_be.c_str(), wafter_be.size() * sizeof(wafter_be[0]));
-				}
-				pch = ((const char *)wch_next_be) + (wbefore_be.size() * sizeof(wbefore_be[0]));
+				iov[first].iov_base = (char *)iov[first].iov_base + written;
+				iov[first].iov_len -= written;
+				written = 0;
 			}
-			else if (nexts[0] == pch_next)
+		}
+	}
+	iov.clear();
+	return true;
+}
+
+bool parallel_replace_file(
+		const std::string &file_path,
+		const std::vector<replace_pair_t> &replacements,
+		int out_fd,
+		bool print_matches,
+		bool pretty_print,
+		bool do_replace,
+		thread_pool_t &pool)
+{
+	mapped_file_t file;
+	if (!file.map_file(file_path, mapped_file_read, mapped_file_willneed | mapped_file_huge_pages))
+		return false;
+
+	const char *pch_begin = file.begin();
+	const char *pch_end = file.end();
+	size_t bom_length;
+	text_encoding_t encoding = detect_text_encoding(pch_begin, pch_end, bom_length);
+	size_t unit_size = (encoding == text_encoding_utf8) ? 1 : sizeof(uint16_t);
+
+	std::vector<search_pattern_t> patterns;
+	std::vector<std::string> afters;
+	encode_replacements(replacements, encoding, patterns, afters);
+	multi_search_t search(patterns);
+
+	/* a match starting at the very end of a chunk can run this far into
+	 * the next one */
+	size_t overlap = 0;
+	for (size_t i = 0; i < search.size(); ++i)
+		overlap = std::max(overlap, search.pattern(i).bytes.size());
+
+	/* a few chunks per thread so uneven ones even out, but not so small
+	 * that the overlap and the merge start to matter */
+	size_t size = file.size();
+	size_t chunk_count = std::max((size_t)1, std::min(size / parallel_replace_min_chunk,
+				(size_t)pool.size() * 4));
+	size_t chunk_size = ((size / chunk_count) + 4095) & ~(size_t)4095;
+
+	std::vector<replace_chunk_t> chunks;
+	for (const char *pch = pch_begin; pch < pch_end; pch += chunk_size)
+	{
+		replace_chunk_t chunk;
+		chunk.begin = pch;
+		chunk.end = std::min(pch + chunk_size, pch_end);
+		chunk.lines = 0;
+		chunk.last_line_break = nullptr;
+		chunks.push_back(chunk);
+	}
+
+	auto search_chunk = [&](replace_chunk_t &chunk)
+	{
+		const char *pch_search_end = std::min(chunk.end + overlap, pch_end);
+		const char *pch_counted = chunk.begin;
+		const char *pch = chunk.begin;
+		while (pch < chunk.end)
+		{
+			replace_match_t match;
+			match.pch = search.find(pch_begin, pch, pch_search_end, match.pattern);
+			if (match.pch == nullptr || match.pch >= chunk.end)
+				break;
+
+			if (print_matches)
 			{
-				advance_line_count(pch_next, line, char_offset, pch_last_line_break);
+				chunk.lines += count_line_breaks(pch_counted, match.pch, encoding, chunk.last_line_break);
+				pch_counted = match.pch;
+			}
+			match.lines = chunk.lines;
+			match.last_line_break = chunk.last_line_break;
+			chunk.matches.push_back(match);
+			pch = match.pch + search.pattern(match.pattern).bytes.size();
+		}
+		if (print_matches)
+			chunk.lines += count_line_breaks(pch_counted, chunk.end, encoding, chunk.last_line_break);
+	};
 
-				if (print_matches)
+	if (search.size() != 0)
+	{
+		if (chunks.size() == 1 || pool.on_worker())
+		{
+			for (auto &chunk : chunks)
+				search_chunk(chunk);
+		}
+		else
+		{
+			thread_pool_group_t group(pool);
+			for (auto &chunk : chunks)
+				group.submit([&search_chunk, &chunk]() { search_chunk(chunk); });
+			group.wait();
+		}
+	}
+
+	/* put the chunks back together in order. a match running over the end
+	 * of a chunk hides whatever the next chunk found underneath it, and
+	 * what a serial scan would have found instead has to be worked out. */
+	const char *pch_written = pch_begin;
+	const char *last_line_break = pch_begin - unit_size;
+	size_t line = 1;
+	bool found_before_target = false;
+	std::vector<iovec> iov;
+	for (auto &chunk : chunks)
+	{
+		if (chunk.matches.size() != 0 && chunk.matches.front().pch < pch_written)
+		{
+			rescan_chunk(search, pch_begin, pch_written, std::min(chunk.end + overlap, pch_end),
+					chunk, encoding, print_matches);
+		}
+
+		for (auto &match : chunk.matches)
+		{
+			found_before_target = true;
+			size_t before_bytes = search.pattern(match.pattern).bytes.size();
+			if (print_matches)
+			{
+				const char *match_line_break = match.last_line_break ? match.last_line_break : last_line_break;
+				int char_offset = (int)((match.pch - match_line_break) / unit_size);
+				if (encoding == text_encoding_utf8)
 				{
-					print_match_line(input_buffer_name, line, char_offset,
-							pretty_print, pch_last_line_break, pch_next,
-							pch_end, before.size());
+					print_match_line(file_path, (int)(line + match.lines), char_offset,
+							pretty_print, match_line_break, match.pch,
+							pch_end, before_bytes);
 				}
-				if (do_replace)
+				else
 				{
-					ofs.write(pch, pch_next - pch);
-					ofs.write(after.c_str(), after.size());
+					print_match_line(file_path, (int)(line + match.lines), char_offset,
+							pretty_print, (const uint16_t *)match_line_break,
+							(const uint16_t *)match.pch, pch_end,
+							before_bytes / unit_size, encoding);
 				}
-				pch = pch_next + before.size();
 			}
-		}
-		else
-		{
+
 			if (do_replace)
-				ofs.write(pch, pch_end - pch);
-			pch = pch_end;
+			{
+				if (match.pch != pch_written)
+					iov.push_back({ (void *)pch_written, (size_t)(match.pch - pch_written) });
+				if (afters[match.pattern].size() != 0)
+					iov.push_back({ (void *)afters[match.pattern].c_str(), afters[match.pattern].size() });
+				if (iov.size() >= IOV_MAX && !writev_all(out_fd, iov))
+					return false;
+			}
+			pch_written = match.pch + before_bytes;
 		}
+
+		line += chunk.lines;
+		if (chunk.last_line_break != nullptr)
+			last_line_break = chunk.last_line_break;
+	}
+
+	if (do_replace)
+	{
+		if (pch_written < pch_end)
+			iov.push_back({ (void *)pch_written, (size_t)(pch_end - pch_written) });
+		if (!writev_all(out_fd, iov))
+			return false;
 	}
 	return found_before_target;
 }
 
 double get_current_time()
 {
-	timeval tv;
-	gettimeofday(&tv, NULL);
-	double time_now = tv.tv_sec + (double(tv.tv_usec) / 1000000.0);
-	return time_now;
+	return clock_realtime_ns() / 1e9;
 }
 
 std::string ellipsis(const std::string &text, int max_len)
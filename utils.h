@@ -2,7 +2,10 @@
 #pragma once
 #include <string>
 #include <sstream>
+#include <vector>
 #include "logger_decls.h"
+#include "thread_pool.h"
+#include "object_census.h"
 
 #define debug_ex(x)
 
@@ -17,6 +20,32 @@
 bool check_errno(const char *tag);
 std::string ellipsis(const std::string &text, int max_len);
 bool streamed_replace(const std::string &input_buffer_name, const char *pch_begin, const char * const pch_end, const std::string &before, const std::string &after, std::ostream &ofs, bool print_matches, bool pretty_print, bool do_replace);
+
+struct replace_pair_t
+{
+	std::string before;
+	std::string after;
+};
+
+/* all of replacements in one pass. the buffer's encoding (UTF-8 or UTF-16
+ * either way round) is detected up front, and the UTF-8 befores and afters
+ * are converted to match. where several could match at the same place the
+ * longest wins. */
+bool streamed_replace(const std::string &input_buffer_name, const char *pch_begin, const char * const pch_end, const std::vector<replace_pair_t> &replacements, std::ostream &ofs, bool print_matches, bool pretty_print, bool do_replace);
+
+/* streamed_replace over the whole of a file, mapped rather than read in */
+bool streamed_replace_file(const std::string &file_path, const std::string &before, const std::string &after, std::ostream &ofs, bool print_matches, bool pretty_print, bool do_replace);
+
+/* files smaller than this are searched in one piece */
+const size_t parallel_replace_min_chunk = 4 << 20;
+
+/* like streamed_replace_file, but the file is split into chunks that are
+ * searched on pool at the same time. matches are printed in file order, and
+ * the output goes to out_fd with writev, straight from the mapping between
+ * replacements. false if nothing matched or the output couldn't be written. */
+bool parallel_replace_file(const std::string &file_path, const std::vector<replace_pair_t> &replacements, int out_fd, bool print_matches, bool pretty_print, bool do_replace, thread_pool_t &pool = thread_pool_t::shared());
+/* wall clock seconds since the epoch, for timestamps. it jumps when the clock
+ * is stepped, so time intervals with clock_source.h instead. */
 double get_current_time();
 
 inline bool mask(int grf, int grf_mask)
@@ -45,65 +74,3 @@ constexpr size_t countof(T (&array)[N])
 #define KCYN  "\x1B[36m"
 #define KWHT  "\x1B[37m"
 
-#define STATIC_COUNT_DEBUG
-
-template <class T, unsigned int T_Max = 0, bool T_report = true>
-class static_count
-{
-protected:
-#ifdef STATIC_COUNT_DEBUG
-	void report() const
-	{
-		if (T_report)
-		{
-			std::stringstream ss;
-			const char *name = typeid(T).name();
-			while (isdigit(*name))
-				name++;
-			ss << "static_count<" << name << "> : count is ";
-		   	ss << s_objCount << "\n";
-			log(log_info, ss.str().c_str());
-		}
-	}
-#endif // DEBUG
-
-	static_count() : instance_id(++s_instance_id_next)
-	{
-		++s_objCount;
-#ifdef STATIC_COUNT_DEBUG
-		report();
-		if ((int)T_Max > 0 && s_objCount > T_Max)
-		{
-			std::stringstream ss;
-			ss << __PRETTY_FUNCTION__ << " : unexpected : too many objects exist.";
-			dlog(log_info, ss.str().c_str());
-		}
-#endif // DEBUG
-	}
-	~static_count()
-	{
-		--s_objCount;
-#ifdef STATIC_COUNT_DEBUG
-		report();
-#endif // DEBUG
-	}
-
-public:
-	static unsigned int class_instance_count()
-	{
-		return s_objCount;
-	}
-
-	unsigned int instance_id;
-
-protected:
-	static unsigned int s_objCount;
-	static unsigned int s_instance_id_next;
-};
-
-template <class T, unsigned int T_Max, bool T_report>
-unsigned int static_count<T, T_Max, T_report>::s_objCount = 0;
-
-template <class T, unsigned int T_Max, bool T_report>
-unsigned int static_count<T, T_Max, T_report>::s_instance_id_next = 0;
-